@@ -0,0 +1,127 @@
+import argparse
+import os
+import signal
+import subprocess
+import tempfile
+import time
+
+parser = argparse.ArgumentParser(description='Benchmarks for shell')
+parser.add_argument('-e', type=str, default='./mybash',
+                    help='executable shell file')
+parser.add_argument('--count', type=int, default=10 * 1000,
+                    help='Number of commands to launch')
+parser.add_argument('--pipe_length', type=int, default=100,
+                    help='Number of commands in one pipeline')
+parser.add_argument('--pipe_count', type=int, default=100,
+                    help='Number of pipelines to run')
+parser.add_argument('--job_count', type=int, default=10 * 1000,
+                    help='Number of background jobs to launch')
+parser.add_argument('--running_jobs', type=int, default=1000,
+                    help='Number of jobs running while other lines execute')
+parser.add_argument('--parallel_jobs', type=int, default=1000,
+                    help='Number of jobs to run with a limit of parallel jobs')
+parser.add_argument('--script_lines', type=int, default=1000 * 1000,
+                    help='Number of lines in a long script')
+parser.add_argument('--heap_mb', type=int, default=64,
+                    help='Size of a comment which inflates the shell heap')
+parser.add_argument('--file_mb', type=int, default=1024,
+                    help='Size of a file to copy with cat')
+parser.add_argument('--file_repeat', type=int, default=3,
+                    help='How many times to copy the file')
+args = parser.parse_args()
+
+exe_path = os.path.abspath(args.e)
+
+
+def run_script(script, flags=[]):
+    start = time.monotonic()
+    p = subprocess.Popen([exe_path] + flags, stdin=subprocess.PIPE,
+                         stdout=subprocess.DEVNULL, start_new_session=True)
+    p.communicate(script.encode())
+    duration = time.monotonic() - start
+    # Jobs left running are killed with the whole session.
+    try:
+        os.killpg(p.pid, signal.SIGKILL)
+    except ProcessLookupError:
+        pass
+    if p.returncode != 0:
+        print('Shell failed with code {}'.format(p.returncode))
+        exit(-1)
+    return duration
+
+
+def report(name, duration, command_count):
+    print('{}: {:.3f} s, {:.0f} commands/s, {:.1f} us per command'.format(
+        name, duration, command_count / duration,
+        duration * 1000 * 1000 / command_count))
+
+
+# A path to the program is not taken for a builtin and starts a process.
+script = '/bin/true\n' * args.count
+report('{} /bin/true'.format(args.count), run_script(script), args.count)
+
+# The parser buffer keeps its size, so the shell heap stays big.
+big_comment = '#' + 'x' * (args.heap_mb * 1024 * 1024) + '\n'
+report('{} /bin/true with {} MB heap'.format(args.count, args.heap_mb),
+       run_script(big_comment + script), args.count)
+
+script = 'echo line of generated output > /dev/null\n' * args.count
+report('{} echo'.format(args.count), run_script(script), args.count)
+
+script = 'false || printf "%s=%d\\n" key 1 && true > /dev/null\n' * args.count
+report('{} false || printf && true'.format(args.count), run_script(script),
+       args.count * 3)
+
+script = '/bin/true &\n' * args.job_count + 'wait\n'
+duration = run_script(script)
+print('{} background jobs launched and reaped: {:.3f} s, {:.1f} us per job'.format(
+    args.job_count, duration, duration * 1000 * 1000 / args.job_count))
+
+# A lot of running children make each waitpid(-1) longer.
+jobs = 'sleep 1000 &\n' * args.running_jobs
+base = run_script(jobs)
+duration = run_script(jobs + 'true\n' * args.count) - base
+report('{} true with {} running jobs'.format(args.count, args.running_jobs),
+       duration, args.count)
+
+# Each job mostly waits, so the parallel jobs overlap even on one CPU.
+script = 'sleep 0.01 && echo done &\n' * args.parallel_jobs
+for limit in [1, 4, 16, 64]:
+    report('{} jobs with -j {}'.format(args.parallel_jobs, limit),
+           run_script(script, ['-j', str(limit)]), args.parallel_jobs)
+
+lines = ['true', 'echo hello world > /dev/null', 'false || true',
+         'printf "%s\\n" a b c > /dev/null', 'true && false || true']
+script = '\n'.join(lines[i % len(lines)] for i in range(args.script_lines)) + '\n'
+for name, flags in [('', []), (', streaming', ['-s'])]:
+    report('{} lines script{}'.format(args.script_lines, name),
+           run_script(script, flags), args.script_lines)
+
+pipeline = ' | '.join(['echo test'] + ['cat'] * (args.pipe_length - 1))
+script = (pipeline + '\n') * args.pipe_count
+report('{} pipelines of {} commands'.format(args.pipe_count, args.pipe_length),
+       run_script(script), args.pipe_count * args.pipe_length)
+
+with tempfile.TemporaryDirectory() as tmp_dir:
+    src = os.path.join(tmp_dir, 'src')
+    dst = os.path.join(tmp_dir, 'dst')
+    with open(src, 'wb') as f:
+        chunk = os.urandom(1024 * 1024)
+        for i in range(args.file_mb):
+            f.write(chunk)
+    for name, script in [('cat file > file', 'cat {0} > {1}'),
+                         ('cat file >> file', 'cat {0} >> {1}'),
+                         ('cat file | wc -c', 'cat {0} | wc -c'),
+                         ('cat file | cat | cat > file', 'cat {0} | cat | cat > {1}')]:
+        # The page cache and the disk writeback are noisy, the best run is taken.
+        durations = []
+        for i in range(args.file_repeat):
+            if os.path.exists(dst):
+                os.remove(dst)
+            durations.append(run_script(script.format(src, dst) + '\n'))
+        duration = min(durations)
+        print('{} of {} MB: {:.3f} s, {:.0f} MB/s'.format(
+            name, args.file_mb, duration, args.file_mb / duration))
+        if os.path.exists(dst) and os.path.getsize(dst) != os.path.getsize(src):
+            print('Copy has a wrong size')
+            exit(-1)
@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+
+#include "builtin.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+enum
+{
+    COPY_BUFFER_SIZE = 64 * 1024,
+    ZERO_COPY_CHUNK_SIZE = 1 << 30,
+    PIPE_SIZE = 1024 * 1024,
+};
+
+enum copy_method
+{
+    COPY_SPLICE,
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+};
+
+struct builtin
+{
+    const char *name;
+    /** Whether the arguments are supported. Otherwise the real program is run. */
+    bool (*is_supported)(const struct command *command, bool has_input);
+    int (*run)(const struct command *command, int input_fd, int output_fd);
+};
+
+static bool write_all(int fd, const char *data, size_t size);
+static bool is_help_or_version(const struct command *command);
+static bool echo_is_supported(const struct command *command, bool has_input);
+static int echo_run(const struct command *command, int input_fd, int output_fd);
+static bool true_is_supported(const struct command *command, bool has_input);
+static int true_run(const struct command *command, int input_fd, int output_fd);
+static int false_run(const struct command *command, int input_fd, int output_fd);
+static bool printf_is_supported(const struct command *command, bool has_input);
+static int printf_run(const struct command *command, int input_fd, int output_fd);
+static bool cat_is_supported(const struct command *command, bool has_input);
+static int cat_run(const struct command *command, int input_fd, int output_fd);
+
+static const struct builtin builtins[] = {
+    {"echo", echo_is_supported, echo_run},
+    {"true", true_is_supported, true_run},
+    {"false", true_is_supported, false_run},
+    {"printf", printf_is_supported, printf_run},
+    {"cat", cat_is_supported, cat_run},
+};
+
+const struct builtin *builtin_find(const struct command *command, bool has_input)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i)
+    {
+        if (strcmp(command->exe, builtins[i].name) == 0)
+            return builtins[i].is_supported(command, has_input) ? &builtins[i] : NULL;
+    }
+
+    return NULL;
+}
+
+void builtin_grow_pipe(const struct builtin *builtin, int pipe_fd)
+{
+    // Большой пайп реже будит читателя. Ошибка не важна, размер просто останется прежним
+    if (builtin->run == cat_run)
+        fcntl(pipe_fd, F_SETPIPE_SZ, PIPE_SIZE);
+}
+
+int builtin_run(const struct builtin *builtin, const struct command *command,
+                int input_fd, int output_fd)
+{
+    // SIGPIPE от записи в закрытый пайп остается висеть на потоке и забирается ниже
+    sigset_t pipe_set;
+    sigset_t old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    int exit_code = builtin->run(command, input_fd, output_fd);
+
+    struct timespec no_wait = {0, 0};
+    while (sigtimedwait(&pipe_set, NULL, &no_wait) == SIGPIPE)
+        ;
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return exit_code;
+}
+
+static bool write_all(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t rc = write(fd, data, size);
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        data += rc;
+        size -= rc;
+    }
+
+    return true;
+}
+
+static bool is_help_or_version(const struct command *command)
+{
+    for (uint32_t i = 0; i < command->arg_count; ++i)
+        if (strcmp(command->args[i], "--help") == 0 || strcmp(command->args[i], "--version") == 0)
+            return true;
+
+    return false;
+}
+
+/**
+ * Only -n is supported from the options. Other arguments looking
+ * like options are left to the real echo.
+ */
+static bool echo_is_supported(const struct command *command, bool has_input)
+{
+    (void)has_input;
+    for (uint32_t i = 0; i < command->arg_count; ++i)
+    {
+        const char *arg = command->args[i];
+        if (arg[0] != '-' || arg[1] == 0 || arg[strspn(arg + 1, "neE") + 1] != 0)
+            return true;
+
+        if (strcmp(arg, "-n") != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static int echo_run(const struct command *command, int input_fd, int output_fd)
+{
+    (void)input_fd;
+    uint32_t first = 0;
+    while (first < command->arg_count && strcmp(command->args[first], "-n") == 0)
+        ++first;
+
+    char *output;
+    size_t size;
+    FILE *stream = open_memstream(&output, &size);
+    if (stream == NULL)
+        return EXIT_FAILURE;
+
+    for (uint32_t i = first; i < command->arg_count; ++i)
+    {
+        if (i > first)
+            fputc(' ', stream);
+
+        fputs(command->args[i], stream);
+    }
+
+    if (first == 0)
+        fputc('\n', stream);
+
+    fclose(stream);
+    bool ok = write_all(output_fd, output, size);
+    free(output);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool true_is_supported(const struct command *command, bool has_input)
+{
+    (void)has_input;
+    return !is_help_or_version(command);
+}
+
+static int true_run(const struct command *command, int input_fd, int output_fd)
+{
+    (void)command;
+    (void)input_fd;
+    (void)output_fd;
+    return EXIT_SUCCESS;
+}
+
+static int false_run(const struct command *command, int input_fd, int output_fd)
+{
+    (void)command;
+    (void)input_fd;
+    (void)output_fd;
+    return EXIT_FAILURE;
+}
+
+/**
+ * Decode an escape sequence of the printf format. Returns the
+ * character or -1 if the escape is not supported.
+ */
+static int printf_escape(char c)
+{
+    switch (c)
+    {
+    case '\\':
+        return '\\';
+    case '"':
+        return '"';
+    case '\'':
+        return '\'';
+    case 'a':
+        return '\a';
+    case 'b':
+        return '\b';
+    case 'f':
+        return '\f';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    case 't':
+        return '\t';
+    case 'v':
+        return '\v';
+    default:
+        return -1;
+    }
+}
+
+static bool printf_is_number(const char *arg)
+{
+    if (*arg == '+' || *arg == '-')
+        ++arg;
+
+    return *arg != 0 && arg[strspn(arg, "0123456789")] == 0 && strlen(arg) <= 18;
+}
+
+/**
+ * The format can contain escapes and %s, %d, %i and %%
+ * conversions without flags. Arguments of %d must be decimal.
+ */
+static bool printf_is_supported(const struct command *command, bool has_input)
+{
+    (void)has_input;
+    if (command->arg_count == 0 || command->args[0][0] == '-')
+        return false;
+
+    const char *format = command->args[0];
+    uint32_t conversion_count = 0;
+    uint32_t number_mask = 0;
+    for (const char *pos = format; *pos != 0; ++pos)
+    {
+        if (*pos == '\\')
+        {
+            if (printf_escape(*++pos) == -1)
+                return false;
+        }
+        else if (*pos == '%' && *++pos != '%')
+        {
+            if (conversion_count >= 32 || (*pos != 's' && *pos != 'd' && *pos != 'i'))
+                return false;
+
+            if (*pos != 's')
+                number_mask |= 1u << conversion_count;
+
+            ++conversion_count;
+        }
+    }
+
+    // Формат повторяется, пока не кончатся аргументы
+    for (uint32_t i = 1; i < command->arg_count && conversion_count > 0; ++i)
+        if ((number_mask >> ((i - 1) % conversion_count)) & 1 && !printf_is_number(command->args[i]))
+            return false;
+
+    return true;
+}
+
+static int printf_run(const struct command *command, int input_fd, int output_fd)
+{
+    (void)input_fd;
+    char *output;
+    size_t size;
+    FILE *stream = open_memstream(&output, &size);
+    if (stream == NULL)
+        return EXIT_FAILURE;
+
+    const char *format = command->args[0];
+    uint32_t arg = 1;
+    do
+    {
+        uint32_t first_arg = arg;
+        for (const char *pos = format; *pos != 0; ++pos)
+        {
+            if (*pos == '\\')
+                fputc(printf_escape(*++pos), stream);
+            else if (*pos != '%')
+                fputc(*pos, stream);
+            else if (*++pos == '%')
+                fputc('%', stream);
+            else
+            {
+                const char *value = arg < command->arg_count ? command->args[arg++] : NULL;
+                if (*pos == 's')
+                    fputs(value != NULL ? value : "", stream);
+                else
+                    fprintf(stream, "%lld", value != NULL ? strtoll(value, NULL, 10) : 0);
+            }
+        }
+
+        if (arg == first_arg)
+            break;
+    } while (arg < command->arg_count);
+
+    fclose(stream);
+    bool ok = write_all(output_fd, output, size);
+    free(output);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/** Files only, or the pipe when there are no arguments. */
+static bool cat_is_supported(const struct command *command, bool has_input)
+{
+    for (uint32_t i = 0; i < command->arg_count; ++i)
+        if (command->args[i][0] == '-' || command->args[i][0] == 0)
+            return false;
+
+    return command->arg_count > 0 || has_input;
+}
+
+/**
+ * Move data with one syscall and no copy through the user space:
+ * splice when either side is a pipe, copy_file_range between
+ * regular files, sendfile from a regular file to anything else.
+ * Returns how many bytes were moved, 0 on EOF, -1 on error.
+ */
+static ssize_t cat_move(enum copy_method method, int input_fd, int output_fd)
+{
+    switch (method)
+    {
+    case COPY_SPLICE:
+        return splice(input_fd, NULL, output_fd, NULL, ZERO_COPY_CHUNK_SIZE, SPLICE_F_MOVE);
+    case COPY_FILE_RANGE:
+        return copy_file_range(input_fd, NULL, output_fd, NULL, ZERO_COPY_CHUNK_SIZE, 0);
+    case COPY_SENDFILE:
+        return sendfile(output_fd, input_fd, NULL, ZERO_COPY_CHUNK_SIZE);
+    default:
+        abort();
+    }
+}
+
+static enum copy_method cat_choose_method(int input_fd, int output_fd)
+{
+    struct stat input_st;
+    struct stat output_st;
+    if (fstat(input_fd, &input_st) == -1 || fstat(output_fd, &output_st) == -1)
+        return COPY_READ_WRITE;
+
+    if (S_ISFIFO(input_st.st_mode) || S_ISFIFO(output_st.st_mode))
+        return COPY_SPLICE;
+
+    if (S_ISREG(input_st.st_mode))
+        return S_ISREG(output_st.st_mode) ? COPY_FILE_RANGE : COPY_SENDFILE;
+
+    return COPY_READ_WRITE;
+}
+
+/**
+ * Copy the whole @a input_fd into @a output_fd. The descriptor
+ * positions are moved, so when the kernel can not copy between such
+ * files, the rest is copied with read and write.
+ * @retval 0 Success.
+ * @retval -1 Read error.
+ * @retval -2 Write error.
+ */
+static int cat_copy(int input_fd, int output_fd, char *buffer)
+{
+    enum copy_method method = cat_choose_method(input_fd, output_fd);
+    while (method != COPY_READ_WRITE)
+    {
+        ssize_t rc = cat_move(method, input_fd, output_fd);
+        if (rc == 0)
+            return 0;
+
+        if (rc > 0 || errno == EINTR)
+            continue;
+
+        if (errno == EPIPE)
+            return -2;
+
+        // O_APPEND, разные ФС, файлы без поддержки splice
+        if (errno != EINVAL && errno != ENOSYS && errno != EXDEV && errno != EOPNOTSUPP &&
+            errno != EBADF)
+            return -1;
+
+        method = COPY_READ_WRITE;
+    }
+
+    while (true)
+    {
+        ssize_t rc = read(input_fd, buffer, COPY_BUFFER_SIZE);
+        if (rc == 0)
+            return 0;
+
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        if (!write_all(output_fd, buffer, rc))
+            return -2;
+    }
+}
+
+static int cat_run(const struct command *command, int input_fd, int output_fd)
+{
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+        return EXIT_FAILURE;
+
+    int exit_code = EXIT_SUCCESS;
+    if (command->arg_count == 0)
+    {
+        int rc = cat_copy(input_fd, output_fd, buffer);
+        if (rc != 0)
+        {
+            if (errno != EPIPE)
+                fprintf(stderr, "cat: %s\n", strerror(errno));
+
+            exit_code = EXIT_FAILURE;
+        }
+    }
+
+    for (uint32_t i = 0; i < command->arg_count; ++i)
+    {
+        const char *name = command->args[i];
+        int fd = open(name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            exit_code = EXIT_FAILURE;
+            continue;
+        }
+
+        int rc = cat_copy(fd, output_fd, buffer);
+        int copy_errno = errno;
+        close(fd);
+        if (rc == -1)
+        {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(copy_errno));
+            exit_code = EXIT_FAILURE;
+        }
+        else if (rc == -2)
+        {
+            if (copy_errno != EPIPE)
+                fprintf(stderr, "cat: write error: %s\n", strerror(copy_errno));
+
+            exit_code = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    free(buffer);
+    return exit_code;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "parser.h"
+
+/**
+ * Simple commands executed right in the shell process: echo, true,
+ * false, printf with %s/%d and cat of files or of a pipe. Only the
+ * common forms of the arguments are supported, anything else, like
+ * options, is left to the real programs.
+ */
+struct builtin;
+
+/**
+ * Find a builtin able to run @a command.
+ * @param command Command to run.
+ * @param has_input Whether the command would read a pipe and not
+ *     the shell input.
+ *
+ * @retval NULL The command should be started as a process.
+ * @retval not NULL The builtin.
+ */
+const struct builtin *builtin_find(const struct command *command, bool has_input);
+
+/**
+ * Grow the pipe created by the shell for the output of the builtin,
+ * if the builtin writes much. A pipe not created by the shell is not
+ * changed, the size would stay after the command.
+ */
+void builtin_grow_pipe(const struct builtin *builtin, int pipe_fd);
+
+/**
+ * Run the builtin in the calling thread. The descriptors are not
+ * closed. A closed reader of @a output_fd fails the command instead
+ * of killing the shell with SIGPIPE.
+ * @param builtin Builtin from builtin_find().
+ * @param command Command to run.
+ * @param input_fd Descriptor to read, -1 if there is none.
+ * @param output_fd Descriptor to write.
+ *
+ * @return Exit code of the command.
+ */
+int builtin_run(const struct builtin *builtin, const struct command *command,
+                int input_fd, int output_fd);
@@ -26,6 +26,8 @@ parser.add_argument('--tests', type=str, default='./tests.txt',
                     help='File with tests')
 parser.add_argument('--verbose', type=bool, default=False,
                     help='Print more info for all sorts of things')
+parser.add_argument('--streaming', type=bool, default=False,
+                    help='Run the shell with -s, parsing ahead in a thread')
 args = parser.parse_args()
 
 if args.with_logic:
@@ -34,6 +36,7 @@ if args.with_background:
     points += 5
 
 exe_path = os.path.abspath(args.e)
+shell_args = ['-s'] if args.streaming else []
 all_sections = test_parser.parse(args.tests)
 test_sections = []
 for section in all_sections:
@@ -50,7 +53,7 @@ for section in all_sections:
     test_sections.append(section)
 
 def open_new_shell():
-    return subprocess.Popen([exe_path], shell=False, stdin=subprocess.PIPE,
+    return subprocess.Popen([exe_path] + shell_args, shell=False, stdin=subprocess.PIPE,
                             stdout=subprocess.PIPE,
                             stderr=subprocess.STDOUT, bufsize=0,
                             cwd=test_dir)
@@ -177,6 +180,50 @@ for test in tests:
         sys.exit(-1)
 print('✅ Passed')
 
+##########################################################################################
+# Test the limit of parallel background jobs. The output of each job is
+# buffered and printed in one piece, so the lines of different jobs never
+# interleave. With one job at a time they also keep the order of the input.
+if args.with_background:
+    job_count = 12
+    script = ''
+    jobs_expected = []
+    for i in range(job_count):
+        script += "sh -c 'echo job {0} start; sleep 0.0{1}; echo job {0} end' &\n"\
+                  .format(i, i % 4)
+        jobs_expected.append('job {0} start\njob {0} end\n'.format(i))
+    for limit in [4, 1]:
+        print('⏳ Test background jobs with -j {}'.format(limit))
+        p = subprocess.Popen([exe_path] + shell_args + ['-j', str(limit)],
+                             shell=False, stdin=subprocess.PIPE,
+                             stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                             cwd=test_dir)
+        try:
+            output, report = p.communicate(script.encode(), small_timeout)
+        except subprocess.TimeoutExpired:
+            print('Too long no output with -j {}. Probably the jobs are not '\
+                  'waited for at the end'.format(limit))
+            sys.exit(-1)
+        lines = output.decode().splitlines(keepends=True)
+        jobs_got = [''.join(lines[i:i + 2]) for i in range(0, len(lines), 2)]
+        if limit == 1:
+            is_ok = jobs_got == jobs_expected
+        else:
+            is_ok = sorted(jobs_got) == sorted(jobs_expected)
+        if not is_ok:
+            print('Outputs of the jobs are mixed with -j {}'.format(limit))
+            if args.verbose:
+                print_diff(''.join(jobs_expected), output.decode())
+            sys.exit(-1)
+        if not report.decode().startswith('{} jobs, '.format(job_count)):
+            print('Bad report of the jobs with -j {}: {}'.format(
+                  limit, report.decode()))
+            sys.exit(-1)
+        if p.returncode != 0:
+            print('Expected zero exit code with -j {}'.format(limit))
+            sys.exit(-1)
+        print('✅ Passed')
+
 ##########################################################################################
 # Test an extra long command. To ensure the shell doesn't have an internal
 # buffer size limit (well, it always can allocate like 1GB, but this has to be
@@ -205,6 +252,33 @@ if is_error:
     sys.exit(-1)
 print('✅ Passed')
 
+##########################################################################################
+# Test a line longer than the biggest read of the shell. It comes in many
+# reads, and the parser has to wait for its end without losing any part.
+count = 3 * 1024 * 1024 + 1
+print('⏳ Test a line longer than the input reads ({} symbols)'.format(count))
+p = open_new_shell()
+output_expected = 'b' * count + '\n'
+command = 'echo ' + output_expected
+try:
+    output = p.communicate(command.encode(), 5)[0].decode()
+except subprocess.TimeoutExpired:
+    print('Too long no output on a line longer than the input reads')
+    is_error = True
+p.terminate()
+if not is_error and output != output_expected:
+    print('Bad output for a line longer than the input reads')
+    is_error = True
+if not is_error and p.returncode != 0:
+    print('Bad return code for a line longer than the input reads - '\
+          'expected 0 (success)')
+    is_error = True
+if is_error:
+    print('Failed a line longer than the input reads (`echo b....` with '\
+          '`b` repeated {} times'.format(count))
+    sys.exit(-1)
+print('✅ Passed')
+
 ##########################################################################################
 # Test extra many args. To ensure the shell doesn't have an internal argument
 # count limit (insane limits like 1 million have to be caught at review).
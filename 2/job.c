@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+
+#include "job.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+enum
+{
+    REAP_BATCH_SIZE = 64,
+};
+
+struct job_process
+{
+    pid_t pid;
+    /** -1 when the process is reaped or pidfd is not supported. */
+    int pidfd;
+    bool is_running;
+    struct job *job;
+    struct job_process *next;
+};
+
+struct job
+{
+    int id;
+    /** The command line as it would be typed, for printing. */
+    char *text;
+    struct job_process *processes;
+    struct job_process *last_process;
+    int running_count;
+    int exit_code;
+    /** File with the buffered output or -1. */
+    int output_fd;
+    struct job *prev;
+    struct job *next;
+};
+
+/** The jobs ordered by id. */
+static struct job *job_head = NULL;
+static struct job *job_tail = NULL;
+static int job_count = 0;
+/** Epoll with the pidfds of all the running processes. */
+static int job_epoll_fd = -1;
+/** Count of the running processes without a pidfd, they are scanned. */
+static int unwatched_count = 0;
+/**
+ * Count of the processes which could not be added to the table.
+ * While it is not 0, the finished children are looked through by
+ * pid, the ones of the table are reaped with their status.
+ */
+static int untracked_count = 0;
+
+static char *job_text_new(const struct command_line *line);
+static void job_delete(struct job *job);
+static void job_flush_output(struct job *job);
+static void job_process_reaped(struct job_process *process, int status, int *job_exit_code);
+static bool job_process_try_reap(struct job_process *process, int options, int *job_exit_code);
+static struct job_process *job_find_process(pid_t pid);
+static void job_reap_untracked(void);
+static int job_watch(pid_t pid);
+
+struct job *job_new(const struct command_line *line)
+{
+    struct job *job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        return NULL;
+
+    job->text = job_text_new(line);
+    job->output_fd = -1;
+    ++job_count;
+    job->id = job_tail != NULL ? job_tail->id + 1 : 1;
+    job->prev = job_tail;
+    if (job_tail != NULL)
+        job_tail->next = job;
+    else
+        job_head = job;
+
+    job_tail = job;
+    return job;
+}
+
+struct job *job_add_process(struct job *job, pid_t pid)
+{
+    struct job_process *process = job != NULL ? malloc(sizeof(*process)) : NULL;
+    if (process == NULL)
+    {
+        ++untracked_count;
+        // Задача без процессов никогда не была бы удалена
+        if (job != NULL && job->processes == NULL)
+        {
+            job_delete(job);
+            return NULL;
+        }
+
+        return job;
+    }
+
+    process->pid = pid;
+    process->is_running = true;
+    process->job = job;
+    process->next = NULL;
+    if (job->last_process != NULL)
+        job->last_process->next = process;
+    else
+        job->processes = process;
+
+    job->last_process = process;
+    ++job->running_count;
+
+    process->pidfd = job_watch(pid);
+    if (process->pidfd == -1)
+    {
+        ++unwatched_count;
+        return job;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = process};
+    if (epoll_ctl(job_epoll_fd, EPOLL_CTL_ADD, process->pidfd, &event) == -1)
+    {
+        close(process->pidfd);
+        process->pidfd = -1;
+        ++unwatched_count;
+    }
+
+    return job;
+}
+
+void job_set_output(struct job *job, int fd)
+{
+    job->output_fd = fd;
+}
+
+void job_table_reap(void)
+{
+    if (job_epoll_fd != -1)
+    {
+        struct epoll_event events[REAP_BATCH_SIZE];
+        int count;
+        do
+        {
+            count = epoll_wait(job_epoll_fd, events, REAP_BATCH_SIZE, 0);
+            for (int i = 0; i < count; ++i)
+                job_process_try_reap(events[i].data.ptr, WNOHANG, NULL);
+        } while (count == REAP_BATCH_SIZE);
+    }
+
+    if (untracked_count > 0)
+        job_reap_untracked();
+
+    if (unwatched_count == 0)
+        return;
+
+    for (struct job *job = job_head, *next; job != NULL; job = next)
+    {
+        next = job->next;
+        for (struct job_process *process = job->processes; process != NULL; process = process->next)
+        {
+            if (!process->is_running || process->pidfd != -1)
+                continue;
+
+            // Задача удаляется вместе с последним процессом
+            bool is_last_running = job->running_count == 1;
+            if (job_process_try_reap(process, WNOHANG, NULL) && is_last_running)
+                break;
+        }
+    }
+}
+
+int job_table_wait_process(pid_t pid)
+{
+    int pidfd = job_head != NULL && job_epoll_fd != -1 ? job_watch(pid) : -1;
+    // epoll с pidfd процесса, NULL в data отличает его от фоновых
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (pidfd != -1 && epoll_ctl(job_epoll_fd, EPOLL_CTL_ADD, pidfd, &event) == -1)
+    {
+        close(pidfd);
+        pidfd = -1;
+    }
+
+    bool is_finished = pidfd == -1;
+    while (!is_finished)
+    {
+        struct epoll_event events[REAP_BATCH_SIZE];
+        int count = epoll_wait(job_epoll_fd, events, REAP_BATCH_SIZE, -1);
+        if (count == -1 && errno != EINTR)
+            break;
+
+        // Фоновые процессы собираются по одному, waitpid(-1) забрал бы и этот
+        for (int i = 0; i < count; ++i)
+        {
+            if (events[i].data.ptr == NULL)
+                is_finished = true;
+            else
+                job_process_try_reap(events[i].data.ptr, WNOHANG, NULL);
+        }
+    }
+
+    if (pidfd != -1)
+    {
+        epoll_ctl(job_epoll_fd, EPOLL_CTL_DEL, pidfd, NULL);
+        close(pidfd);
+    }
+
+    int status;
+    pid_t rc;
+    do
+        rc = waitpid(pid, &status, 0);
+    while (rc == -1 && errno == EINTR);
+
+    return rc == -1 ? -1 : status;
+}
+
+void job_table_wait_input(int fd)
+{
+    // Без pidfd конец процесса не разбудил бы poll
+    while (job_head != NULL && job_epoll_fd != -1 && unwatched_count == 0)
+    {
+        struct pollfd fds[2] = {
+            {.fd = fd, .events = POLLIN},
+            {.fd = job_epoll_fd, .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return;
+        }
+
+        if (fds[1].revents != 0)
+            job_table_reap();
+
+        if (fds[0].revents != 0)
+            return;
+    }
+}
+
+void job_table_wait_count(int count)
+{
+    job_table_reap();
+    while (job_count >= count && job_head != NULL)
+    {
+        if (job_epoll_fd == -1 || unwatched_count > 0)
+        {
+            // Без pidfd ждать можно только конкретный процесс
+            struct job_process *process = job_head->processes;
+            while (!process->is_running)
+                process = process->next;
+
+            job_process_try_reap(process, 0, NULL);
+            continue;
+        }
+
+        struct epoll_event event;
+        if (epoll_wait(job_epoll_fd, &event, 1, -1) == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            return;
+        }
+
+        job_table_reap();
+    }
+}
+
+void job_table_print(int fd)
+{
+    job_table_reap();
+    for (struct job *job = job_head; job != NULL; job = job->next)
+    {
+        char mark = job == job_tail ? '+' : job->next == job_tail ? '-' : ' ';
+        dprintf(fd, "[%d]%c  %-24s%s &\n", job->id, mark, "Running",
+                job->text != NULL ? job->text : "");
+    }
+}
+
+int job_table_wait(const char *arg)
+{
+    struct job *target = NULL;
+    if (arg != NULL)
+    {
+        bool is_job_id = arg[0] == '%';
+        int value = atoi(arg + is_job_id);
+        for (struct job *job = job_head; job != NULL && target == NULL; job = job->next)
+        {
+            if (is_job_id)
+            {
+                if (job->id == value)
+                    target = job;
+
+                continue;
+            }
+
+            for (struct job_process *process = job->processes; process != NULL; process = process->next)
+                if (process->pid == value)
+                    target = job;
+        }
+
+        if (target == NULL)
+        {
+            fprintf(stderr, "wait: %s: no such job\n", arg);
+            return 127;
+        }
+    }
+
+    while (job_head != NULL)
+    {
+        struct job *job = target != NULL ? target : job_head;
+        struct job_process *process = job->processes;
+        while (!process->is_running)
+            process = process->next;
+
+        int job_exit_code = -1;
+        job_process_try_reap(process, 0, &job_exit_code);
+        if (job == target && job_exit_code != -1)
+            return job_exit_code;
+    }
+
+    return 0;
+}
+
+static void job_append_command(FILE *stream, const struct command *command)
+{
+    fputs(command->exe, stream);
+    for (uint32_t i = 0; i < command->arg_count; ++i)
+        fprintf(stream, " %s", command->args[i]);
+}
+
+static char *job_text_new(const struct command_line *line)
+{
+    char *text;
+    size_t size;
+    FILE *stream = open_memstream(&text, &size);
+    if (stream == NULL)
+        return NULL;
+
+    for (const struct expr *expr = line->head; expr != NULL; expr = expr->next)
+    {
+        if (expr != line->head)
+            fputc(' ', stream);
+
+        if (expr->type == EXPR_TYPE_COMMAND)
+            job_append_command(stream, &expr->cmd);
+        else
+            fputs(expr->type == EXPR_TYPE_PIPE ? "|" : expr->type == EXPR_TYPE_AND ? "&&" : "||",
+                  stream);
+    }
+
+    if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+        fprintf(stream, " > %s", line->out_file);
+    else if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+        fprintf(stream, " >> %s", line->out_file);
+
+    fclose(stream);
+    return text;
+}
+
+static void job_delete(struct job *job)
+{
+    job_flush_output(job);
+    --job_count;
+    if (job->prev != NULL)
+        job->prev->next = job->next;
+    else
+        job_head = job->next;
+
+    if (job->next != NULL)
+        job->next->prev = job->prev;
+    else
+        job_tail = job->prev;
+
+    struct job_process *process = job->processes;
+    while (process != NULL)
+    {
+        struct job_process *next = process->next;
+        free(process);
+        process = next;
+    }
+
+    free(job->text);
+    free(job);
+}
+
+/** Print the buffered output of the finished job in one piece. */
+static void job_flush_output(struct job *job)
+{
+    if (job->output_fd == -1)
+        return;
+
+    off_t size = lseek(job->output_fd, 0, SEEK_END);
+    off_t offset = 0;
+    while (offset < size)
+    {
+        ssize_t rc = sendfile(STDOUT_FILENO, job->output_fd, &offset, size - offset);
+        if (rc > 0 || (rc == -1 && errno == EINTR))
+            continue;
+
+        if (rc == -1 && errno != EINVAL && errno != ENOSYS)
+            break;
+
+        // stdout не умеет принимать sendfile, копия через буфер
+        char buf[4096];
+        ssize_t size_read = pread(job->output_fd, buf, sizeof(buf), offset);
+        if (size_read <= 0 || write(STDOUT_FILENO, buf, size_read) != size_read)
+            break;
+
+        offset += size_read;
+    }
+
+    close(job->output_fd);
+    job->output_fd = -1;
+}
+
+static void job_process_reaped(struct job_process *process, int status, int *job_exit_code)
+{
+    struct job *job = process->job;
+    process->is_running = false;
+    if (process->pidfd != -1)
+    {
+        // Новый процесс может еще держать копию pidfd, тогда close не убрал бы его из epoll
+        epoll_ctl(job_epoll_fd, EPOLL_CTL_DEL, process->pidfd, NULL);
+        close(process->pidfd);
+        process->pidfd = -1;
+    }
+    else
+    {
+        --unwatched_count;
+    }
+
+    if (process == job->last_process)
+        job->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+
+    if (--job->running_count > 0)
+        return;
+
+    if (job_exit_code != NULL)
+        *job_exit_code = job->exit_code;
+
+    job_delete(job);
+}
+
+/**
+ * Reap the process if it is finished, or wait for it without
+ * WNOHANG in @a options. The job is deleted with its last running
+ * process, then its exit code is saved into @a job_exit_code if it
+ * is not NULL. Returns true if the process is reaped.
+ */
+static bool job_process_try_reap(struct job_process *process, int options, int *job_exit_code)
+{
+    int status = 0;
+    pid_t rc;
+    do
+        rc = waitpid(process->pid, &status, options);
+    while (rc == -1 && errno == EINTR);
+
+    if (rc == 0)
+        return false;
+
+    // ECHILD значит, что процесс уже собран кем-то другим
+    job_process_reaped(process, rc == -1 ? 0 : status, job_exit_code);
+    return true;
+}
+
+/** Find the running process of the table by @a pid. */
+static struct job_process *job_find_process(pid_t pid)
+{
+    for (struct job *job = job_head; job != NULL; job = job->next)
+        for (struct job_process *process = job->processes; process != NULL; process = process->next)
+            if (process->is_running && process->pid == pid)
+                return process;
+
+    return NULL;
+}
+
+/**
+ * Reap the finished children which are not in the table. waitpid(-1)
+ * would take the status of the table's processes too, so the next
+ * finished child is only looked at with WNOWAIT, and then reaped by
+ * its pid. A process of the table gives its status to its job.
+ */
+static void job_reap_untracked(void)
+{
+    while (untracked_count > 0)
+    {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0)
+            return;
+
+        struct job_process *process = job_find_process(info.si_pid);
+        if (process != NULL)
+            job_process_try_reap(process, WNOHANG, NULL);
+        else if (waitpid(info.si_pid, NULL, WNOHANG) > 0)
+            --untracked_count;
+        else
+            return;
+    }
+}
+
+/** Open a pidfd of the process. Returns -1 if it is not supported. */
+static int job_watch(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    if (job_epoll_fd == -1)
+        job_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (job_epoll_fd == -1)
+        return -1;
+
+    // pidfd всегда открывается с O_CLOEXEC
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "parser.h"
+
+#include <sys/types.h>
+
+/**
+ * Table of background jobs. A job is a background command line
+ * with all the processes started for it. Each process is watched
+ * through its pidfd in one epoll, so the finished processes are
+ * found without a scan of all the children.
+ */
+struct job;
+
+/**
+ * Create a job for the background @a line and add it to the table.
+ * @retval NULL Not enough memory, the processes will not be tracked.
+ * @retval not NULL The job.
+ */
+struct job *job_new(const struct command_line *line);
+
+/**
+ * Add a started process to the job. The last added process gives
+ * the exit code of the job. The job can be NULL, if it could not be
+ * created, then the process is only reaped.
+ * @return The job, or NULL if it is deleted, because the process
+ *     could not be added and the job has no other ones.
+ */
+struct job *job_add_process(struct job *job, pid_t pid);
+
+/**
+ * Buffer the output of the job in the file @a fd. The job takes the
+ * descriptor and prints its content into stdout when the job
+ * finishes, so outputs of parallel jobs are not mixed.
+ */
+void job_set_output(struct job *job, int fd);
+
+/**
+ * Reap the finished processes without blocking and drop the jobs
+ * having no running processes left. Takes time proportional to the
+ * count of the finished processes.
+ */
+void job_table_reap(void);
+
+/**
+ * Wait for the foreground process @a pid and return its status from
+ * waitpid(), -1 on an error. The background processes finished
+ * meanwhile are reaped right away, through the same epoll.
+ */
+int job_table_wait_process(pid_t pid);
+
+/**
+ * Wait until @a fd is readable. The background processes finished
+ * meanwhile are reaped right away, so the jobs do not stay zombies
+ * while the shell waits for the input.
+ */
+void job_table_wait_input(int fd);
+
+/**
+ * Wait until there are less than @a count jobs.
+ */
+void job_table_wait_count(int count);
+
+/**
+ * Print the running jobs like "[1]+  Running  sleep 10 &" into @a fd.
+ */
+void job_table_print(int fd);
+
+/**
+ * Wait until a job finishes.
+ * @param arg "%N" for the job N, a pid for the job of this process
+ *     or NULL for all the jobs.
+ *
+ * @return Exit code of the job, 0 when waited for all the jobs, 127
+ *     if there is no such job.
+ */
+int job_table_wait(const char *arg);
@@ -5,12 +5,11 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct parser
-{
-	char *buffer;
-	uint32_t size;
-	uint32_t capacity;
-};
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 enum token_type
 {
@@ -28,47 +27,287 @@ enum token_type
 struct token
 {
 	enum token_type type;
+	/**
+	 * While the token is a contiguous part of the input, it is not
+	 * copied anywhere and this is its beginning.
+	 */
+	const char *slice;
+	bool is_slice;
+	/** Token data if it had quotes or escapes inside. */
 	char *data;
 	uint32_t size;
 	uint32_t capacity;
 };
 
-static char *token_strdup(const struct token *t)
+struct parser
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+	char *buffer;
+	/**
+	 * Not parsed data starts at this offset. Consumed lines only move
+	 * it, the data is moved to the buffer beginning when the free
+	 * space runs out.
+	 */
+	uint32_t start;
+	uint32_t size;
+	uint32_t capacity;
+	/**
+	 * How many pending bytes are known to have no complete line. A
+	 * line ends with a new line, so a long line fed in small parts is
+	 * not parsed again until a new line arrives.
+	 */
+	uint32_t checked;
+	/** Reused by each parser_pop_next() to avoid allocations. */
+	struct token token;
+	/** Sizes of the tokens of the current line which are slices. */
+	uint32_t *slice_sizes;
+	uint32_t slice_count;
+	uint32_t slice_capacity;
+};
+
+enum
+{
+	ARENA_CHUNK_SIZE = 4096,
+	ARENA_ALIGN = 8,
+};
+
+/**
+ * Memory of a command line. The line itself, its exprs, args arrays
+ * and strings are bump-allocated from a list of chunks and freed all
+ * at once.
+ */
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	uint32_t size;
+	uint32_t used;
+	char data[];
+};
+
+static struct arena_chunk *arena_chunk_new(uint32_t size)
+{
+	struct arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void *arena_alloc(struct command_line *line, uint32_t size)
+{
+	struct arena_chunk *chunk = line->arena;
+	uint32_t offset = (chunk->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (offset + size > chunk->size)
+	{
+		uint32_t chunk_size = chunk->size * 2;
+		if (chunk_size < size)
+			chunk_size = size;
+		struct arena_chunk *next = arena_chunk_new(chunk_size);
+		next->next = chunk;
+		line->arena = chunk = next;
+		offset = 0;
+	}
+	chunk->used = offset + size;
+	return chunk->data + offset;
+}
+
+static struct command_line *command_line_new(void)
+{
+	struct arena_chunk *chunk = arena_chunk_new(ARENA_CHUNK_SIZE);
+	struct command_line *line = (struct command_line *)chunk->data;
+	memset(line, 0, sizeof(*line));
+	chunk->used = sizeof(*line);
+	line->arena = chunk;
+	return line;
 }
 
-static void token_append(struct token *t, char c)
+static void token_unslice(struct token *t)
 {
-	if (t->size == t->capacity)
+	if (t->capacity < t->size)
+	{
+		t->capacity = t->size * 2;
+		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+	}
+	memcpy(t->data, t->slice, t->size);
+	t->is_slice = false;
+}
+
+/**
+ * Append @a size characters starting at @a src. The token stays a
+ * slice of the input while the characters go one after another there.
+ */
+static void token_append_run(struct token *t, const char *src, uint32_t size)
+{
+	if (t->size == 0)
+	{
+		t->slice = src;
+		t->is_slice = true;
+		t->size = size;
+		return;
+	}
+	if (t->is_slice)
+	{
+		if (src == t->slice + t->size)
+		{
+			t->size += size;
+			return;
+		}
+		token_unslice(t);
+	}
+	while (t->size + size > t->capacity)
 	{
 		t->capacity = (t->capacity + 1) * 2;
 		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
 	}
-	else
+	memcpy(t->data + t->size, src, size);
+	t->size += size;
+}
+
+static void token_append(struct token *t, const char *src)
+{
+	token_append_run(t, src, 1);
+}
+
+/** Characters which have a meaning outside of quotes. */
+static const bool is_special[256] = {
+	['\''] = true, ['"'] = true, ['\\'] = true, ['&'] = true,
+	['|'] = true, ['>'] = true, ['#'] = true, [' '] = true,
+	['\t'] = true, ['\r'] = true, ['\n'] = true,
+};
+
+/**
+ * Find the first character outside of quotes which is special for
+ * parse_token(). Everything before it is a plain part of a token.
+ */
+static const char *scan_unquoted(const char *pos, const char *end)
+{
+#if defined(__AVX2__)
+	const __m256i specials[] = {
+		_mm256_set1_epi8('\''), _mm256_set1_epi8('"'),
+		_mm256_set1_epi8('\\'), _mm256_set1_epi8('&'),
+		_mm256_set1_epi8('|'), _mm256_set1_epi8('>'),
+		_mm256_set1_epi8('#'), _mm256_set1_epi8(' '),
+		_mm256_set1_epi8('\t'), _mm256_set1_epi8('\r'),
+		_mm256_set1_epi8('\n'),
+	};
+	while (end - pos >= 32)
 	{
-		assert(t->size < t->capacity);
+		__m256i v = _mm256_loadu_si256((const __m256i *)pos);
+		__m256i match = _mm256_setzero_si256();
+		for (unsigned i = 0; i < sizeof(specials) / sizeof(specials[0]); ++i)
+			match = _mm256_or_si256(match, _mm256_cmpeq_epi8(v, specials[i]));
+		uint32_t mask = _mm256_movemask_epi8(match);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
 	}
-	t->data[t->size++] = c;
+#elif defined(__SSE2__)
+	const __m128i specials[] = {
+		_mm_set1_epi8('\''), _mm_set1_epi8('"'), _mm_set1_epi8('\\'),
+		_mm_set1_epi8('&'), _mm_set1_epi8('|'), _mm_set1_epi8('>'),
+		_mm_set1_epi8('#'), _mm_set1_epi8(' '), _mm_set1_epi8('\t'),
+		_mm_set1_epi8('\r'), _mm_set1_epi8('\n'),
+	};
+	while (end - pos >= 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i match = _mm_setzero_si128();
+		for (unsigned i = 0; i < sizeof(specials) / sizeof(specials[0]); ++i)
+			match = _mm_or_si128(match, _mm_cmpeq_epi8(v, specials[i]));
+		uint32_t mask = _mm_movemask_epi8(match);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	while (pos < end && !is_special[(unsigned char)*pos])
+		++pos;
+	return pos;
+}
+
+/**
+ * Find the end of a plain part of a quoted token: the quote or a
+ * backslash in double quotes.
+ */
+static const char *scan_quoted(const char *pos, const char *end, char quote)
+{
+	char escape = quote == '"' ? '\\' : quote;
+#if defined(__AVX2__)
+	const __m256i v_quote = _mm256_set1_epi8(quote);
+	const __m256i v_escape = _mm256_set1_epi8(escape);
+	while (end - pos >= 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)pos);
+		__m256i match = _mm256_or_si256(_mm256_cmpeq_epi8(v, v_quote),
+						_mm256_cmpeq_epi8(v, v_escape));
+		uint32_t mask = _mm256_movemask_epi8(match);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i v_quote = _mm_set1_epi8(quote);
+	const __m128i v_escape = _mm_set1_epi8(escape);
+	while (end - pos >= 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i match = _mm_or_si128(_mm_cmpeq_epi8(v, v_quote),
+					     _mm_cmpeq_epi8(v, v_escape));
+		uint32_t mask = _mm_movemask_epi8(match);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#endif
+	while (pos < end && *pos != quote && *pos != escape)
+		++pos;
+	return pos;
 }
 
 static void token_reset(struct token *t)
 {
 	t->size = 0;
+	t->is_slice = false;
 	t->type = TOKEN_TYPE_NONE;
 }
 
-static void command_append_arg(struct command *cmd, char *arg)
+/**
+ * Make a string of the token. A slice is returned as is, pointing
+ * into the parser buffer, and is moved into the line memory when the
+ * line is complete. See command_line_own_slices().
+ */
+static char *token_strdup(struct parser *p, struct command_line *line,
+			  const struct token *t)
+{
+	assert(t->type == TOKEN_TYPE_STR);
+	assert(t->size > 0);
+	if (t->is_slice)
+	{
+		if (p->slice_count == p->slice_capacity)
+		{
+			p->slice_capacity = (p->slice_capacity + 1) * 2;
+			p->slice_sizes = realloc(p->slice_sizes,
+				sizeof(*p->slice_sizes) * p->slice_capacity);
+		}
+		p->slice_sizes[p->slice_count++] = t->size;
+		return (char *)t->slice;
+	}
+	char *res = arena_alloc(line, t->size + 1);
+	memcpy(res, t->data, t->size);
+	res[t->size] = 0;
+	return res;
+}
+
+static void command_append_arg(struct command_line *line, struct command *cmd,
+			       char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity)
 	{
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		uint32_t new_capacity = (cmd->arg_capacity + 1) * 2;
+		char **new_args = arena_alloc(line, sizeof(*cmd->args) * new_capacity);
+		if (cmd->arg_count > 0)
+			memcpy(new_args, cmd->args, sizeof(*cmd->args) * cmd->arg_count);
+		cmd->args = new_args;
+		cmd->arg_capacity = new_capacity;
 	}
 	else
 	{
@@ -77,24 +316,52 @@ static void command_append_arg(struct command *cmd, char *arg)
 	cmd->args[cmd->arg_count++] = arg;
 }
 
+static void slice_own(char **str, const char *begin, const char *end, char *copy,
+		      const uint32_t *sizes, uint32_t *i)
+{
+	if (*str < begin || *str >= end)
+		return;
+	char *res = copy + (*str - begin);
+	/* The byte after a slice is a delimiter, nobody needs it anymore. */
+	res[sizes[(*i)++]] = 0;
+	*str = res;
+}
+
+/**
+ * Copy the line text from the parser buffer into the line memory
+ * and make the slices point there. The strings are walked in the
+ * order they were created in.
+ */
+static void command_line_own_slices(struct parser *p, struct command_line *line,
+				    const char *begin, const char *end)
+{
+	if (p->slice_count == 0)
+		return;
+	char *copy = arena_alloc(line, end - begin + 1);
+	memcpy(copy, begin, end - begin);
+	uint32_t i = 0;
+	for (struct expr *e = line->head; e != NULL; e = e->next)
+	{
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		slice_own(&e->cmd.exe, begin, end, copy, p->slice_sizes, &i);
+		for (uint32_t j = 0; j < e->cmd.arg_count; ++j)
+			slice_own(&e->cmd.args[j], begin, end, copy, p->slice_sizes, &i);
+	}
+	if (line->out_file != NULL)
+		slice_own(&line->out_file, begin, end, copy, p->slice_sizes, &i);
+	assert(i == p->slice_count);
+}
+
 void command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL)
+	struct arena_chunk *chunk = line->arena;
+	while (chunk != NULL)
 	{
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND)
-		{
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
-	free(line->out_file);
-	free(line);
 }
 
 static void command_line_append(struct command_line *line, struct expr *e)
@@ -113,30 +380,41 @@ struct parser *parser_new(void)
 
 void parser_feed(struct parser *p, const char *str, uint32_t len)
 {
-	uint32_t cap = p->capacity - p->size;
+	uint32_t cap = p->capacity - p->start - p->size;
 	if (cap < len)
 	{
-		uint32_t new_capacity = (p->capacity + 1) * 2;
-		if (new_capacity - p->size < len)
-			new_capacity = p->size + len;
-		p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
-		p->capacity = new_capacity;
+		/*
+		 * Compact only if it frees enough space and the moved data is
+		 * not bigger than the consumed part. Then each byte is moved
+		 * amortized O(1) times.
+		 */
+		if (p->start > 0 && p->size <= p->start &&
+		    p->capacity - p->size >= len)
+		{
+			memmove(p->buffer, p->buffer + p->start, p->size);
+			p->start = 0;
+		}
+		else
+		{
+			uint32_t new_capacity = (p->capacity + 1) * 2;
+			if (new_capacity - p->start - p->size < len)
+				new_capacity = p->start + p->size + len;
+			p->buffer = realloc(p->buffer,
+					    sizeof(*p->buffer) * new_capacity);
+			p->capacity = new_capacity;
+		}
 	}
-	memcpy(p->buffer + p->size, str, len);
+	memcpy(p->buffer + p->start + p->size, str, len);
 	p->size += len;
-	assert(p->size <= p->capacity);
+	assert(p->start + p->size <= p->capacity);
 }
 
 static void parser_consume(struct parser *p, uint32_t size)
 {
 	assert(p->size >= size);
-	if (size == p->size)
-	{
-		p->size = 0;
-		return;
-	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
 	p->size -= size;
+	p->checked = 0;
+	p->start = p->size == 0 ? 0 : p->start + size;
 }
 
 static uint32_t parse_token(const char *pos, const char *end, struct token *out)
@@ -157,6 +435,16 @@ static uint32_t parse_token(const char *pos, const char *end, struct token *out)
 	char quote = 0;
 	while (pos < end)
 	{
+		/* Plain characters are appended in bulk. */
+		const char *plain_end = quote == 0 ? scan_unquoted(pos, end) :
+				        scan_quoted(pos, end, quote);
+		if (plain_end != pos)
+		{
+			token_append_run(out, pos, plain_end - pos);
+			pos = plain_end;
+			if (pos == end)
+				break;
+		}
 		char c = *pos;
 		switch (c)
 		{
@@ -195,7 +483,7 @@ static uint32_t parse_token(const char *pos, const char *end, struct token *out)
 				default:
 					break;
 				}
-				token_append(out, '\\');
+				token_append(out, pos - 1);
 				goto append_and_next;
 			}
 			assert(quote == 0);
@@ -297,7 +585,7 @@ static uint32_t parse_token(const char *pos, const char *end, struct token *out)
 			goto append_and_next;
 		}
 	append_and_next:
-		token_append(out, c);
+		token_append(out, pos);
 		++pos;
 	}
 	return 0;
@@ -305,31 +593,42 @@ static uint32_t parse_token(const char *pos, const char *end, struct token *out)
 
 enum parser_error parser_pop_next(struct parser *p, struct command_line **out)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
+	if (p->checked == p->size ||
+	    memchr(p->buffer + p->start + p->checked, '\n',
+		   p->size - p->checked) == NULL)
+	{
+		p->checked = p->size;
+		*out = NULL;
+		return PARSER_ERR_NONE;
+	}
+	uint32_t size_before = p->size;
+	struct command_line *line = command_line_new();
+	char *pos = p->buffer + p->start;
 	const char *begin = pos;
 	char *end = pos + p->size;
-	struct token token = {0};
+	struct token *token = &p->token;
 	enum parser_error res = PARSER_ERR_NONE;
+	p->slice_count = 0;
 
 	while (pos < end)
 	{
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
 		struct expr *e;
-		switch (token.type)
+		switch (token->type)
 		{
 		case TOKEN_TYPE_STR:
 			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND)
 			{
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
+				command_append_arg(line, &line->tail->cmd, token_strdup(p, line, token));
 				continue;
 			}
-			e = calloc(1, sizeof(*e));
+			e = arena_alloc(line, sizeof(*e));
+			memset(e, 0, sizeof(*e));
 			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
+			e->cmd.exe = token_strdup(p, line, token);
 			command_line_append(line, e);
 			continue;
 		case TOKEN_TYPE_NEW_LINE:
@@ -348,7 +647,8 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
+			e = arena_alloc(line, sizeof(*e));
+			memset(e, 0, sizeof(*e));
 			e->type = EXPR_TYPE_PIPE;
 			command_line_append(line, e);
 			continue;
@@ -363,7 +663,8 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
+			e = arena_alloc(line, sizeof(*e));
+			memset(e, 0, sizeof(*e));
 			e->type = EXPR_TYPE_AND;
 			command_line_append(line, e);
 			continue;
@@ -378,7 +679,8 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e = calloc(1, sizeof(*e));
+			e = arena_alloc(line, sizeof(*e));
+			memset(e, 0, sizeof(*e));
 			e->type = EXPR_TYPE_OR;
 			command_line_append(line, e);
 			continue;
@@ -393,38 +695,39 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out)
 	goto return_no_line;
 
 close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
+	if (token->type == TOKEN_TYPE_OUT_NEW || token->type == TOKEN_TYPE_OUT_APPEND)
 	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
+		if (token->type == TOKEN_TYPE_OUT_NEW)
 			line->out_type = OUTPUT_TYPE_FILE_NEW;
 		else
 			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
-		if (token.type != TOKEN_TYPE_STR)
+		if (token->type != TOKEN_TYPE_STR)
 		{
 			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
 			goto return_error;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
+		line->out_file = token_strdup(p, line, token);
+		used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
 	}
-	if (token.type == TOKEN_TYPE_BACKGROUND)
+	if (token->type == TOKEN_TYPE_BACKGROUND)
 	{
 		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			goto return_no_line;
 		pos += used;
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE)
+	if (token->type == TOKEN_TYPE_NEW_LINE)
 	{
 		assert(line->tail != NULL);
+		command_line_own_slices(p, line, begin, pos);
 		parser_consume(p, pos - begin);
 		if (line->tail->type != EXPR_TYPE_COMMAND)
 		{
@@ -445,11 +748,11 @@ return_error:
 	 */
 	while (pos < end)
 	{
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, token);
 		if (used == 0)
 			break;
 		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE)
+		if (token->type == TOKEN_TYPE_NEW_LINE)
 		{
 			parser_consume(p, pos - begin);
 			goto return_no_line;
@@ -459,16 +762,19 @@ return_error:
 	goto return_no_line;
 
 return_no_line:
+	if (p->size == size_before)
+		p->checked = p->size;
 	command_line_delete(line);
 	*out = NULL;
 
 return_final:
-	free(token.data);
 	return res;
 }
 
 void parser_delete(struct parser *p)
 {
+	free(p->token.data);
+	free(p->slice_sizes);
 	free(p->buffer);
 	free(p);
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct parser;
+struct arena_chunk;
 
 enum parser_error
 {
@@ -60,6 +61,12 @@ struct command_line
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+
+	/**
+	 * Memory of the line. The line, its exprs and all the strings
+	 * are allocated here and freed by command_line_delete().
+	 */
+	struct arena_chunk *arena;
 };
 
 void command_line_delete(struct command_line *line);
@@ -0,0 +1,165 @@
+#include "parser.h"
+
+#ifdef HEAP_HELP
+#include "heap_help.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Parser throughput benchmark. Generates scripts of command lines and
+ * pushes them through parser_feed() and parser_pop_next():
+ * - typical lines in 1KB portions, the same way the shell reads its
+ *   input;
+ * - 100MB of short lines in 1MB portions, when a lot of lines are
+ *   pending in the parser;
+ * - lines with long arguments in 64KB portions, where the tokenizer
+ *   speed matters most;
+ * - arguments made of many quoted and escaped pieces, where the
+ *   vectorized scan stops after a few characters;
+ * - lines of 32 commands joined with |, && and ||.
+ *
+ * Built with -DHEAP_HELP and utils/heap_help it also reports the
+ * allocations per command line. Those runs are slower, so the speed
+ * is measured by a separate build without it.
+ *
+ * Usage: ./parser_bench [mixed_mb] [short_mb] [long_mb] [quoted_mb] [operators_mb]
+ */
+
+static const char *mixed_lines[] = {
+	"echo hello world 123\n",
+	"grep -e \"some quoted argument\" file.txt | sort -r | uniq -c > out.txt\n",
+	"cat 'single quoted name' a\\ b && echo ok || echo fail &\n",
+	"mkdir -p ../testdir/a/b/c && cd ../testdir >> log.txt\n",
+	"printf \"%s\\n\" first second third fourth fifth sixth seventh\n",
+	"# a comment line\n",
+	NULL,
+};
+
+static const char *short_lines[] = {
+	"true\n",
+	"ls -l\n",
+	"echo 1\n",
+	NULL,
+};
+
+#define LONG_WORD "0123456789abcdefghijklmnopqrstuvwxyz_0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+
+static const char *long_lines[] = {
+	"cp /" LONG_WORD "/" LONG_WORD "/" LONG_WORD " /" LONG_WORD "/" LONG_WORD "\n",
+	"echo \"" LONG_WORD " " LONG_WORD " " LONG_WORD "\" '" LONG_WORD LONG_WORD "'\n",
+	"grep " LONG_WORD LONG_WORD LONG_WORD " file | wc -l > " LONG_WORD "\n",
+	NULL,
+};
+
+#define QUOTED_WORD "\"a\\\"b\\\\c\"'d\"e'\\ f\\'\"'g'\"h"
+
+static const char *quoted_lines[] = {
+	"echo " QUOTED_WORD QUOTED_WORD QUOTED_WORD QUOTED_WORD " " QUOTED_WORD QUOTED_WORD "\n",
+	"printf '%s\\n' \"x\\\"y\\\"z\"'\"'\\\"\"\\\\\" a\\ b\\ c > out.txt\n",
+	NULL,
+};
+
+#define OPERATORS "a | b -c && c || d | e && f 1 || g | h"
+
+static const char *operator_lines[] = {
+	OPERATORS " && " OPERATORS " || " OPERATORS " | " OPERATORS "\n",
+	OPERATORS " | " OPERATORS " | " OPERATORS " && " OPERATORS " >> log\n",
+	NULL,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_run(const char *name, const char **lines, size_t script_mb, size_t portion)
+{
+	size_t script_size = script_mb * 1024 * 1024;
+	/* The last line can cross the size, it is kept whole. */
+	size_t max_len = 0;
+	for (int i = 0; lines[i] != NULL; ++i)
+	{
+		if (strlen(lines[i]) > max_len)
+			max_len = strlen(lines[i]);
+	}
+	char *script = malloc(script_size + max_len);
+	size_t size = 0;
+	for (int i = 0; size < script_size; ++i)
+	{
+		if (lines[i] == NULL)
+			i = 0;
+		size_t len = strlen(lines[i]);
+		memcpy(script + size, lines[i], len);
+		size += len;
+	}
+
+	struct parser *p = parser_new();
+	size_t line_count = 0;
+#ifdef HEAP_HELP
+	uint64_t alloc_count = heaph_get_alloc_count_total();
+#endif
+	double start = now();
+	for (size_t pos = 0; pos < size; pos += portion)
+	{
+		size_t len = size - pos < portion ? size - pos : portion;
+		parser_feed(p, script + pos, len);
+		struct command_line *line = NULL;
+		while (true)
+		{
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			if (err != PARSER_ERR_NONE)
+			{
+				printf("Error: %d\n", (int)err);
+				parser_delete(p);
+				free(script);
+				return -1;
+			}
+			++line_count;
+			command_line_delete(line);
+		}
+	}
+	double duration = now() - start;
+	parser_delete(p);
+	free(script);
+#ifdef HEAP_HELP
+	(void)duration;
+	alloc_count = heaph_get_alloc_count_total() - alloc_count;
+	printf("%s, %zu lines: %.2f allocations per line\n", name, line_count,
+	       (double)alloc_count / line_count);
+#else
+	printf("%s, %.1f MB in %zu byte portions, %zu lines: %.3f s, %.1f MB/s, "
+	       "%.0f lines/s\n", name, size / 1024.0 / 1024, portion, line_count,
+	       duration, size / 1024.0 / 1024 / duration, line_count / duration);
+#endif
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t mixed_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+	size_t short_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+	size_t long_mb = argc > 3 ? strtoul(argv[3], NULL, 10) : 100;
+	size_t quoted_mb = argc > 4 ? strtoul(argv[4], NULL, 10) : 16;
+	size_t operators_mb = argc > 5 ? strtoul(argv[5], NULL, 10) : 16;
+	if (mixed_mb == 0 || short_mb == 0 || long_mb == 0 || quoted_mb == 0 ||
+	    operators_mb == 0)
+	{
+		printf("Invalid script size\n");
+		return -1;
+	}
+	if (bench_run("mixed lines", mixed_lines, mixed_mb, 1024) != 0 ||
+	    bench_run("short lines", short_lines, short_mb, 1024 * 1024) != 0 ||
+	    bench_run("long arguments", long_lines, long_mb, 64 * 1024) != 0 ||
+	    bench_run("quotes and escapes", quoted_lines, quoted_mb, 64 * 1024) != 0 ||
+	    bench_run("operators", operator_lines, operators_mb, 64 * 1024) != 0)
+		return -1;
+	return 0;
+}
@@ -1,29 +1,120 @@
+#define _GNU_SOURCE
+
 #include "shell.h"
+#include "builtin.h"
+#include "job.h"
 #include "parser.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
-static void reap_background_processes();
+extern char **environ;
+
+/** Builtin running in a thread as a stage of a pipeline. */
+struct builtin_stage
+{
+    const struct builtin *builtin;
+    const struct command *command;
+    int input_fd;
+    int output_fd;
+    pthread_t thread;
+};
+
+/** The background line being executed. Its job is created with the first process. */
+static const struct command_line *background_line = NULL;
+static struct job *background_job = NULL;
+/** Limit of the parallel background jobs, 0 means no limit. */
+static int job_limit = 0;
+/** Output of the background line, buffered while the jobs are limited. */
+static int background_output_fd = STDOUT_FILENO;
+static unsigned started_job_count = 0;
+
+static int execute_command_line_impl(const struct command_line *line, bool *need_exit);
 int execute_command_block(const struct command_line *line, struct expr **expr_ptr, bool *need_exit);
-static bool run_builtin_command(const struct command *command, bool *need_exit, int *exit_code);
+static void track_background_process(pid_t pid);
+static bool run_builtin_command(const struct command_line *line, const struct command *command,
+                                bool *need_exit, int *exit_code);
+static bool is_builtin_command(const struct command *command);
+static int run_builtin_in_subshell(const struct command *command);
+static bool start_builtin_stage(struct builtin_stage *stage);
+static void *builtin_stage_f(void *arg);
+static int run_builtin_to_file(const struct builtin *builtin, const struct command *command,
+                               int input_fd, const struct command_line *line);
+static int open_output_file(const struct command_line *line);
 static bool command_block_has_pipe(const struct expr *start, const struct expr *end);
 static int run_pipeline(const struct command_line *line);
 static void redirect_io(int input_fd, int output_fd);
-static void close_unused_pipes(int input_fd, int is_last, int pipe_fds[2]);
 static int run_single_command(const struct command_line *line, bool *need_exit);
 static void apply_output_redirection(const struct command_line *line);
+static pid_t spawn_command(const struct command *command, int input_fd, int output_fd,
+                           const struct command_line *line);
+static pid_t fork_command(char **args, int input_fd, int output_fd,
+                          const struct command_line *line);
 static int wait_for_processes(pid_t *process_ids, int process_count, pid_t last_process_id);
 
+void shell_set_job_limit(int limit)
+{
+    job_limit = limit;
+}
+
+void shell_wait_input(int fd)
+{
+    job_table_wait_input(fd);
+}
+
+unsigned shell_wait_jobs(void)
+{
+    job_table_wait(NULL);
+    return started_job_count;
+}
+
 int execute_command_line(const struct command_line *line, bool *need_exit)
 {
-    reap_background_processes();
+    job_table_reap();
+    background_line = line->is_background ? line : NULL;
+    background_job = NULL;
+    background_output_fd = STDOUT_FILENO;
+    if (line->is_background && job_limit > 0)
+    {
+        // Новая задача ждет, пока не освободится место
+        job_table_wait_count(job_limit);
+        if (!line->out_file)
+        {
+            int fd = memfd_create("job", MFD_CLOEXEC);
+            if (fd != -1)
+                background_output_fd = fd;
+        }
+    }
+
+    int exit_code = execute_command_line_impl(line, need_exit);
+    if (background_job)
+        ++started_job_count;
 
+    if (background_output_fd != STDOUT_FILENO)
+    {
+        if (background_job)
+            job_set_output(background_job, background_output_fd);
+        else
+            close(background_output_fd);
+
+        background_output_fd = STDOUT_FILENO;
+    }
+
+    return exit_code;
+}
+
+static int execute_command_line_impl(const struct command_line *line, bool *need_exit)
+{
     int last_exit_code = 0;
     struct expr *expr = line->head;
 
@@ -64,11 +155,12 @@ int execute_command_line(const struct command_line *line, bool *need_exit)
     return last_exit_code;
 }
 
-static void reap_background_processes()
+static void track_background_process(pid_t pid)
 {
-    int status;
-    while (waitpid(-1, &status, WNOHANG) > 0)
-        ;
+    if (!background_job)
+        background_job = job_new(background_line);
+
+    background_job = job_add_process(background_job, pid);
 }
 
 int execute_command_block(const struct command_line *line, struct expr **expr_ptr, bool *need_exit)
@@ -88,7 +180,7 @@ int execute_command_block(const struct command_line *line, struct expr **expr_pt
     if (start == end && start->type == EXPR_TYPE_COMMAND)
     {
         int builtin_exit_code = 0;
-        if (run_builtin_command(&start->cmd, need_exit, &builtin_exit_code))
+        if (run_builtin_command(line, &start->cmd, need_exit, &builtin_exit_code))
         {
             *expr_ptr = end->next;
             return builtin_exit_code;
@@ -111,7 +203,8 @@ int execute_command_block(const struct command_line *line, struct expr **expr_pt
     return exit_code;
 }
 
-static bool run_builtin_command(const struct command *command, bool *need_exit, int *exit_code)
+static bool run_builtin_command(const struct command_line *line, const struct command *command,
+                                bool *need_exit, int *exit_code)
 {
     if (strcmp(command->exe, "cd") == 0)
     {
@@ -128,7 +221,124 @@ static bool run_builtin_command(const struct command *command, bool *need_exit,
         return true;
     }
 
-    return false;
+    if (strcmp(command->exe, "jobs") != 0 && strcmp(command->exe, "wait") != 0)
+        return false;
+
+    // Фоновые jobs и wait работают в подоболочке, у которой нет задач
+    if (line->is_background)
+    {
+        *exit_code = 0;
+        return true;
+    }
+
+    if (strcmp(command->exe, "wait") == 0)
+    {
+        *exit_code = job_table_wait(command->arg_count > 0 ? command->args[0] : NULL);
+        return true;
+    }
+
+    int fd = line->out_file ? open_output_file(line) : STDOUT_FILENO;
+    if (fd == -1)
+    {
+        *exit_code = EXIT_FAILURE;
+        return true;
+    }
+
+    job_table_print(fd);
+    if (fd != STDOUT_FILENO)
+        close(fd);
+
+    *exit_code = 0;
+    return true;
+}
+
+static bool is_builtin_command(const struct command *command)
+{
+    return strcmp(command->exe, "cd") == 0 || strcmp(command->exe, "exit") == 0 ||
+           strcmp(command->exe, "jobs") == 0 || strcmp(command->exe, "wait") == 0;
+}
+
+/**
+ * cd and exit inside a pipeline work like in a subshell and do not
+ * change the shell itself. Only the exit code and the error are left.
+ * The subshell has no jobs, so jobs and wait do nothing.
+ */
+static int run_builtin_in_subshell(const struct command *command)
+{
+    if (strcmp(command->exe, "exit") == 0)
+        return command->arg_count > 0 ? atoi(command->args[0]) : 0;
+
+    if (strcmp(command->exe, "cd") != 0)
+        return 0;
+
+    struct stat st;
+    if (command->arg_count > 0)
+    {
+        const char *path = command->args[0];
+        if (stat(path, &st) == -1 || access(path, X_OK) == -1)
+            perror("chdir");
+        else if (!S_ISDIR(st.st_mode))
+        {
+            errno = ENOTDIR;
+            perror("chdir");
+        }
+    }
+
+    return 0;
+}
+
+static bool start_builtin_stage(struct builtin_stage *stage)
+{
+    int rc = pthread_create(&stage->thread, NULL, builtin_stage_f, stage);
+    if (rc != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+        return false;
+    }
+
+    return true;
+}
+
+static void *builtin_stage_f(void *arg)
+{
+    struct builtin_stage *stage = arg;
+    builtin_run(stage->builtin, stage->command, stage->input_fd, stage->output_fd);
+    if (stage->input_fd != -1)
+        close(stage->input_fd);
+
+    close(stage->output_fd);
+    return NULL;
+}
+
+/**
+ * Run the builtin in the shell, writing into the output file of
+ * @a line if there is one, or into stdout.
+ */
+static int run_builtin_to_file(const struct builtin *builtin, const struct command *command,
+                               int input_fd, const struct command_line *line)
+{
+    if (!line->out_file)
+        return builtin_run(builtin, command, input_fd, STDOUT_FILENO);
+
+    int fd = open_output_file(line);
+    if (fd == -1)
+        return EXIT_FAILURE;
+
+    int exit_code = builtin_run(builtin, command, input_fd, fd);
+    close(fd);
+    return exit_code;
+}
+
+/** Open the output file of @a line for the shell itself. */
+static int open_output_file(const struct command_line *line)
+{
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+                (line->out_type == OUTPUT_TYPE_FILE_APPEND ? O_APPEND : O_TRUNC);
+    int fd = open(line->out_file, flags, 0644);
+    if (fd == -1)
+        fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+
+    return fd;
 }
 
 static bool command_block_has_pipe(const struct expr *start, const struct expr *end)
@@ -148,6 +358,11 @@ static int run_pipeline(const struct command_line *line)
     pid_t *process_ids = NULL;
     pid_t last_process_id = -1;
     int process_count = 0;
+    struct builtin_stage **stages = NULL;
+    int stage_count = 0;
+    bool is_last_failed = false;
+    bool is_last_in_shell = false;
+    int last_exit_code = 0;
 
     while (current_expr && current_expr != line->tail->next)
     {
@@ -158,9 +373,10 @@ static int run_pipeline(const struct command_line *line)
         }
 
         int is_last = !(current_expr->next && current_expr->next->type == EXPR_TYPE_PIPE);
-        int output_fd = STDOUT_FILENO;
+        int output_fd = line->is_background ? background_output_fd : STDOUT_FILENO;
 
-        if (!is_last && pipe(pipe_fds) == -1)
+        // Концы пайпов не должны утекать в другие процессы конвейера
+        if (!is_last && pipe2(pipe_fds, O_CLOEXEC) == -1)
         {
             perror("pipe");
             exit(EXIT_FAILURE);
@@ -169,28 +385,62 @@ static int run_pipeline(const struct command_line *line)
         if (!is_last)
             output_fd = pipe_fds[1];
 
-        pid_t child_pid = fork();
-        if (child_pid == -1)
+        const struct command *command = &current_expr->cmd;
+        if (is_builtin_command(command))
         {
-            perror("fork");
-            exit(EXIT_FAILURE);
+            is_last_in_shell = is_last;
+            last_exit_code = run_builtin_in_subshell(command);
+            goto next_command;
+        }
+
+        // Фоновый конвейер не ждут, поэтому его команды запускаются процессами
+        const struct builtin *builtin = line->is_background
+                                            ? NULL
+                                            : builtin_find(command, input_fd != -1);
+        if (builtin && is_last)
+        {
+            // Остальные команды уже запущены, последнюю выполняет сам шелл
+            is_last_in_shell = true;
+            last_exit_code = run_builtin_to_file(builtin, command, input_fd, line);
+            goto next_command;
         }
 
-        if (child_pid == 0)
+        if (builtin)
         {
-            redirect_io(input_fd, output_fd);
-            close_unused_pipes(input_fd, is_last, pipe_fds);
-
-            struct command_line single_command = {
-                .head = current_expr,
-                .tail = current_expr,
-                .out_file = is_last ? line->out_file : NULL,
-                .out_type = is_last ? line->out_type : OUTPUT_TYPE_STDOUT,
-                .is_background = 0};
-
-            bool exit_flag = false;
-            int code = run_single_command(&single_command, &exit_flag);
-            _exit(code);
+            struct builtin_stage *stage = malloc(sizeof(*stage));
+            stages = realloc(stages, sizeof(*stages) * (stage_count + 1));
+            if (!stage || !stages)
+            {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+
+            if (!is_last)
+                builtin_grow_pipe(builtin, output_fd);
+
+            *stage = (struct builtin_stage){
+                .builtin = builtin,
+                .command = command,
+                .input_fd = input_fd,
+                .output_fd = output_fd,
+            };
+            if (start_builtin_stage(stage))
+            {
+                // Поток сам закроет свои концы пайпов
+                stages[stage_count++] = stage;
+                input_fd = pipe_fds[0];
+                current_expr = current_expr->next;
+                continue;
+            }
+
+            free(stage);
+        }
+
+        pid_t child_pid = spawn_command(command, input_fd, output_fd, is_last ? line : NULL);
+        if (child_pid == -1)
+        {
+            is_last_failed = is_last;
+            goto next_command;
         }
 
         process_ids = realloc(process_ids, sizeof(pid_t) * (process_count + 1));
@@ -205,6 +455,7 @@ static int run_pipeline(const struct command_line *line)
         if (is_last)
             last_process_id = child_pid;
 
+    next_command:
         if (input_fd != -1)
             close(input_fd);
 
@@ -218,10 +469,28 @@ static int run_pipeline(const struct command_line *line)
     if (input_fd != -1)
         close(input_fd);
 
+    if (line->is_background)
+    {
+        for (int i = 0; i < process_count; ++i)
+            track_background_process(process_ids[i]);
+    }
+
     int exit_code = line->is_background
                         ? 0
                         : wait_for_processes(process_ids, process_count, last_process_id);
+    if (is_last_in_shell && !line->is_background)
+        exit_code = last_exit_code;
+
+    if (is_last_failed && !line->is_background)
+        exit_code = EXIT_FAILURE;
 
+    for (int i = 0; i < stage_count; ++i)
+    {
+        pthread_join(stages[i]->thread, NULL);
+        free(stages[i]);
+    }
+
+    free(stages);
     free(process_ids);
 
     return exit_code;
@@ -236,18 +505,6 @@ static void redirect_io(int input_fd, int output_fd)
         dup2(output_fd, STDOUT_FILENO);
 }
 
-static void close_unused_pipes(int input_fd, int is_last, int pipe_fds[2])
-{
-    if (input_fd != -1)
-        close(input_fd);
-
-    if (!is_last)
-    {
-        close(pipe_fds[0]);
-        close(pipe_fds[1]);
-    }
-}
-
 static int run_single_command(const struct command_line *line, bool *need_exit)
 {
     if (!line || !line->head || line->head->type != EXPR_TYPE_COMMAND)
@@ -256,39 +513,30 @@ static int run_single_command(const struct command_line *line, bool *need_exit)
     struct command *command = &line->head->cmd;
 
     int builtin_exit_code = 0;
-    if (run_builtin_command(command, need_exit, &builtin_exit_code))
+    if (run_builtin_command(line, command, need_exit, &builtin_exit_code))
         return builtin_exit_code;
 
-    char *args[command->arg_count + 2];
-    args[0] = command->exe;
-    for (uint32_t i = 0; i < command->arg_count; i++)
-        args[i + 1] = command->args[i];
-
-    args[command->arg_count + 1] = NULL;
-
-    // Создаем дочерний процесс
-    pid_t pid = fork();
-    if (pid == -1)
-    {
-        perror("fork");
-        return 0;
-    }
+    // Простые команды вроде echo не требуют нового процесса
+    const struct builtin *builtin = line->is_background ? NULL : builtin_find(command, false);
+    if (builtin)
+        return run_builtin_to_file(builtin, command, -1, line);
 
-    if (pid == 0) // Дочерний процесс
+    // Создаем дочерний процесс без копирования памяти шелла
+    pid_t pid = spawn_command(command, -1,
+                              line->is_background ? background_output_fd : STDOUT_FILENO, line);
+    if (line->is_background)
     {
-        apply_output_redirection(line);
-        execvp(args[0], args);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    }
+        if (pid != -1)
+            track_background_process(pid);
 
-    if (line->is_background)
         return 0;
+    }
 
-    int status;
-    waitpid(pid, &status, 0);
+    if (pid == -1)
+        return EXIT_FAILURE;
 
-    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    int status = job_table_wait_process(pid);
+    return status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : 1;
 }
 
 static void apply_output_redirection(const struct command_line *line)
@@ -309,16 +557,86 @@ static void apply_output_redirection(const struct command_line *line)
     close(fd);
 }
 
+/**
+ * Start the command with posix_spawn. The memory of the shell is
+ * not copied, so the launch cost does not depend on the shell heap.
+ * The output file of @a line, if any, is opened by the child: an
+ * open of a FIFO blocks until there is a reader.
+ */
+static pid_t spawn_command(const struct command *command, int input_fd, int output_fd,
+                           const struct command_line *line)
+{
+    char *args[command->arg_count + 2];
+    args[0] = command->exe;
+    for (uint32_t i = 0; i < command->arg_count; i++)
+        args[i + 1] = command->args[i];
+
+    args[command->arg_count + 1] = NULL;
+
+    // posix_spawn ждет exec, а открытие FIFO в фоне может ждать читателя бесконечно
+    if (line && line->out_file && line->is_background)
+        return fork_command(args, input_fd, output_fd, line);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input_fd != STDIN_FILENO && input_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+
+    if (line && line->out_file)
+    {
+        int flags = O_WRONLY | O_CREAT |
+                    (line->out_type == OUTPUT_TYPE_FILE_APPEND ? O_APPEND : O_TRUNC);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, line->out_file, flags, 0644);
+    }
+    else if (output_fd != STDOUT_FILENO && output_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+
+    pid_t pid;
+    int rc = posix_spawnp(&pid, args[0], &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0)
+    {
+        // Ошибка открытия файла тоже приходит сюда
+        fprintf(stderr, "%s: %s\n", args[0], strerror(rc));
+        return -1;
+    }
+
+    return pid;
+}
+
+static pid_t fork_command(char **args, int input_fd, int output_fd,
+                          const struct command_line *line)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        redirect_io(input_fd, output_fd);
+        apply_output_redirection(line);
+        execvp(args[0], args);
+        perror("execvp");
+        exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
 static int wait_for_processes(pid_t *process_ids, int process_count, pid_t last_process_id)
 {
     int status;
     int exit_code = 0;
-    if (last_process_id != -1 && waitpid(last_process_id, &status, 0) > 0 && WIFEXITED(status))
+    if (last_process_id != -1 && (status = job_table_wait_process(last_process_id)) != -1 &&
+        WIFEXITED(status))
         exit_code = WEXITSTATUS(status);
 
     for (int i = 0; i < process_count; ++i)
         if (process_ids[i] != last_process_id)
-            waitpid(process_ids[i], NULL, 0);
+            job_table_wait_process(process_ids[i]);
 
     return exit_code;
 }
\ No newline at end of file
@@ -2,4 +2,23 @@
 
 #include "parser.h"
 
-int execute_command_line(const struct command_line *line, bool *need_exit);
\ No newline at end of file
+int execute_command_line(const struct command_line *line, bool *need_exit);
+
+/**
+ * Run at most @a limit background jobs at once. A new background
+ * line waits for a free slot, and the output of each job is printed
+ * in one piece when it finishes. 0 removes the limit.
+ */
+void shell_set_job_limit(int limit);
+
+/**
+ * Wait until the input @a fd is readable, reaping the background
+ * jobs finished meanwhile.
+ */
+void shell_wait_input(int fd);
+
+/**
+ * Wait for all the background jobs.
+ * @return Count of the background jobs started so far.
+ */
+unsigned shell_wait_jobs(void);
@@ -1,20 +1,294 @@
 #include "parser.h"
 #include "shell.h"
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-int main(void)
+enum
 {
-	const size_t buf_size = 1024;
-	char buf[buf_size];
-	int rc;
+	READ_SIZE_MIN = 1024,
+	READ_SIZE_MAX = 1024 * 1024,
+	LINE_QUEUE_SIZE = 1024,
+};
+
+/**
+ * Input reader. The read size grows while the reads fill the whole
+ * buffer, so a big script is read in a few calls, and shrinks back
+ * when the input comes in small portions, like from a terminal.
+ */
+struct input
+{
+	char *buf;
+	size_t size;
+};
+
+/** A parsed line or a parser error, in the order of the input. */
+struct line_item
+{
+	struct command_line *line;
+	enum parser_error err;
+};
+
+/**
+ * Bounded queue between the parser thread and the executor. Both
+ * sides move all the available items under one lock.
+ */
+struct line_queue
+{
+	struct line_item items[LINE_QUEUE_SIZE];
+	/** Index of the first item. */
+	size_t begin;
+	size_t count;
+	/** The input is over, no more items will come. */
+	bool is_eof;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_not_empty;
+	pthread_cond_t cond_not_full;
+	struct parser *parser;
+	/** Input of the parser thread. */
+	struct input in;
+	/** Parsed items not yet moved into the queue. */
+	struct line_item pending[LINE_QUEUE_SIZE];
+	size_t pending_begin;
+	size_t pending_count;
+};
+
+static ssize_t input_read(struct input *in)
+{
+	ssize_t rc = read(STDIN_FILENO, in->buf, in->size);
+	size_t new_size = in->size;
+	if (rc == (ssize_t)in->size && in->size < READ_SIZE_MAX)
+		new_size = in->size * 2;
+	else if (rc > 0 && (size_t)rc < in->size / 4 && in->size > READ_SIZE_MIN)
+		new_size = in->size / 2;
+	if (new_size != in->size)
+	{
+		char *buf = realloc(in->buf, new_size);
+		if (buf != NULL)
+		{
+			in->buf = buf;
+			in->size = new_size;
+		}
+	}
+	return rc;
+}
+
+static void line_queue_unlock(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+/**
+ * Move the pending items into the queue, waiting for free space.
+ * The wait is a cancellation point, the mutex is released then, and
+ * the items left in pending are freed by the owner of the queue.
+ */
+static void line_queue_push_pending(struct line_queue *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	pthread_cleanup_push(line_queue_unlock, &q->mutex);
+	while (q->pending_begin < q->pending_count)
+	{
+		while (q->count == LINE_QUEUE_SIZE)
+			pthread_cond_wait(&q->cond_not_full, &q->mutex);
+		bool was_empty = q->count == 0;
+		for (; q->pending_begin < q->pending_count && q->count < LINE_QUEUE_SIZE; ++q->count)
+		{
+			size_t pos = (q->begin + q->count) % LINE_QUEUE_SIZE;
+			q->items[pos] = q->pending[q->pending_begin++];
+		}
+		if (was_empty)
+			pthread_cond_signal(&q->cond_not_empty);
+	}
+	pthread_cleanup_pop(1);
+	q->pending_begin = 0;
+	q->pending_count = 0;
+}
+
+static void *parser_thread_f(void *arg)
+{
+	struct line_queue *q = arg;
+	ssize_t rc;
+	while ((rc = input_read(&q->in)) > 0)
+	{
+		parser_feed(q->parser, q->in.buf, rc);
+		while (true)
+		{
+			struct line_item *item = &q->pending[q->pending_count];
+			item->err = parser_pop_next(q->parser, &item->line);
+			if (item->err == PARSER_ERR_NONE && item->line == NULL)
+				break;
+			if (++q->pending_count == LINE_QUEUE_SIZE)
+				line_queue_push_pending(q);
+		}
+		line_queue_push_pending(q);
+	}
+	pthread_mutex_lock(&q->mutex);
+	q->is_eof = true;
+	pthread_cond_signal(&q->cond_not_empty);
+	pthread_mutex_unlock(&q->mutex);
+	return NULL;
+}
+
+/**
+ * Execute the line or print the parser error. Returns false when the
+ * shell has to exit.
+ */
+static bool execute_item(const struct line_item *item, int *exit_code)
+{
+	if (item->err != PARSER_ERR_NONE)
+	{
+		printf("Error: %d\n", (int)item->err);
+		return true;
+	}
+	bool need_exit = false;
+	*exit_code = execute_command_line(item->line, &need_exit);
+	command_line_delete(item->line);
+	return !need_exit;
+}
+
+/**
+ * Read and parse the input in a separate thread, while the commands
+ * are executed. The execution stays sequential, only the next lines
+ * are parsed ahead. The parser thread reads the input before the
+ * commands run, so they should not read the shell input themselves.
+ */
+static int run_streaming(struct parser *p)
+{
+	struct line_queue *q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return EXIT_FAILURE;
+	q->parser = p;
+	q->in.size = READ_SIZE_MIN;
+	q->in.buf = malloc(q->in.size);
+	if (q->in.buf == NULL)
+	{
+		free(q);
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->cond_not_empty, NULL);
+	pthread_cond_init(&q->cond_not_full, NULL);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, parser_thread_f, q) != 0)
+	{
+		free(q->in.buf);
+		free(q);
+		return EXIT_FAILURE;
+	}
+
+	struct line_item batch[LINE_QUEUE_SIZE];
+	int exit_code = 0;
+	bool is_running = true;
+	while (is_running)
+	{
+		pthread_mutex_lock(&q->mutex);
+		while (q->count == 0 && !q->is_eof)
+			pthread_cond_wait(&q->cond_not_empty, &q->mutex);
+		size_t count = q->count;
+		for (size_t i = 0; i < count; ++i)
+			batch[i] = q->items[(q->begin + i) % LINE_QUEUE_SIZE];
+		q->begin = (q->begin + count) % LINE_QUEUE_SIZE;
+		q->count = 0;
+		is_running = count > 0;
+		if (count == LINE_QUEUE_SIZE)
+			pthread_cond_signal(&q->cond_not_full);
+		pthread_mutex_unlock(&q->mutex);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (is_running && !execute_item(&batch[i], &exit_code))
+				is_running = false;
+			else if (!is_running && batch[i].line != NULL)
+				command_line_delete(batch[i].line);
+		}
+	}
+
+	/* After exit the parser thread can still wait for input. */
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+	for (size_t i = 0; i < q->count; ++i)
+	{
+		struct line_item *item = &q->items[(q->begin + i) % LINE_QUEUE_SIZE];
+		if (item->line != NULL)
+			command_line_delete(item->line);
+	}
+	for (size_t i = q->pending_begin; i < q->pending_count; ++i)
+	{
+		if (q->pending[i].line != NULL)
+			command_line_delete(q->pending[i].line);
+	}
+	free(q->in.buf);
+	pthread_cond_destroy(&q->cond_not_full);
+	pthread_cond_destroy(&q->cond_not_empty);
+	pthread_mutex_destroy(&q->mutex);
+	free(q);
+	return exit_code;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Wait for the parallel jobs and print their throughput into stderr,
+ * so it is not mixed with the output of the commands.
+ */
+static void report_jobs(double start)
+{
+	unsigned count = shell_wait_jobs();
+	double duration = now_sec() - start;
+	fprintf(stderr, "%u jobs, %.3f s, %.1f jobs/s\n", count, duration,
+		duration > 0 ? count / duration : 0);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	bool is_streaming = false;
+	int job_limit = 0;
+	while ((opt = getopt(argc, argv, "sj:")) != -1)
+	{
+		if (opt == 's')
+			is_streaming = true;
+		else if (opt == 'j' && (job_limit = atoi(optarg)) > 0)
+			shell_set_job_limit(job_limit);
+		else
+		{
+			fprintf(stderr, "Usage: %s [-s] [-j jobs]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	double start = now_sec();
 	struct parser *p = parser_new();
+	if (is_streaming)
+	{
+		int exit_code = run_streaming(p);
+		parser_delete(p);
+		if (job_limit > 0)
+			report_jobs(start);
+		return exit_code;
+	}
+
+	struct input in = {malloc(READ_SIZE_MIN), READ_SIZE_MIN};
+	int rc;
 	int exit_code = 0;
 	bool need_exit = false;
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0)
+	while (in.buf != NULL)
 	{
-		parser_feed(p, buf, rc);
+		/* The jobs finished while the input is awaited are reaped. */
+		shell_wait_input(STDIN_FILENO);
+		if ((rc = input_read(&in)) <= 0)
+			break;
+		parser_feed(p, in.buf, rc);
 		struct command_line *line = NULL;
 		while (true)
 		{
@@ -29,12 +303,14 @@ int main(void)
 			exit_code = execute_command_line(line, &need_exit);
 			command_line_delete(line);
 			if (need_exit)
-			{
-				parser_delete(p);
-				return exit_code;
-			}
+				break;
 		}
+		if (need_exit)
+			break;
 	}
+	free(in.buf);
 	parser_delete(p);
+	if (job_limit > 0)
+		report_jobs(start);
 	return exit_code;
-}
\ No newline at end of file
+}
@@ -0,0 +1,137 @@
+#include "userfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Cold start benchmark. Compares how long it takes to get a populated
+ * FS back: either by replaying all the writes into a heap FS, or by
+ * mounting an image file which already has the data.
+ *
+ * Usage: ./bench [total_mb] [file_count]
+ */
+
+enum
+{
+	CHUNK_SIZE = 4096,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_files(size_t total_size, int file_count)
+{
+	char chunk[CHUNK_SIZE];
+	for (size_t i = 0; i < sizeof(chunk); ++i)
+		chunk[i] = 'a' + i % ('z' - 'a' + 1);
+
+	size_t file_size = total_size / file_count;
+	char name[32];
+	for (int i = 0; i < file_count; ++i)
+	{
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1)
+		{
+			printf("open failed: %d\n", ufs_errno());
+			exit(-1);
+		}
+
+		for (size_t done = 0; done < file_size; done += CHUNK_SIZE)
+		{
+			if (ufs_write(fd, chunk, CHUNK_SIZE) != CHUNK_SIZE)
+			{
+				printf("write failed: %d\n", ufs_errno());
+				exit(-1);
+			}
+		}
+
+		ufs_close(fd);
+	}
+}
+
+static void open_files(int file_count)
+{
+	char name[32];
+	char byte;
+	for (int i = 0; i < file_count; ++i)
+	{
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		if (fd == -1 || ufs_read(fd, &byte, 1) != 1)
+		{
+			printf("reopen failed: %d\n", ufs_errno());
+			exit(-1);
+		}
+
+		ufs_close(fd);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t total_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+	int file_count = argc > 2 ? atoi(argv[2]) : 16;
+	size_t total_size = total_mb * 1024 * 1024;
+	if (file_count <= 0 || total_size / file_count > 100 * 1024 * 1024)
+	{
+		printf("Files must be not bigger than 100MB each\n");
+		return -1;
+	}
+
+	printf("%zu MB in %d files\n", total_mb, file_count);
+
+	double start = now();
+	fill_files(total_size, file_count);
+	double replay = now() - start;
+	ufs_destroy();
+	printf("heap, replay writes:    %10.3f ms\n", replay * 1000);
+
+	char path[] = "/tmp/ufs_bench_image.XXXXXX";
+	int tmp = mkstemp(path);
+	if (tmp == -1)
+	{
+		perror("mkstemp");
+		return -1;
+	}
+
+	close(tmp);
+	if (ufs_mount(path, total_size + total_size / 8 + 1024 * 1024) != 0)
+	{
+		printf("mount failed: %d\n", ufs_errno());
+		return -1;
+	}
+
+	start = now();
+	fill_files(total_size, file_count);
+	double image_fill = now() - start;
+	start = now();
+	ufs_checkpoint();
+	double checkpoint = now() - start;
+	ufs_destroy();
+	printf("image, fill:            %10.3f ms\n", image_fill * 1000);
+	printf("image, checkpoint:      %10.3f ms\n", checkpoint * 1000);
+
+	start = now();
+	if (ufs_mount(path, 0) != 0)
+	{
+		printf("remount failed: %d\n", ufs_errno());
+		return -1;
+	}
+
+	double mount = now() - start;
+	open_files(file_count);
+	double mount_open = now() - start;
+	ufs_destroy();
+	unlink(path);
+	printf("image, mount:           %10.3f ms\n", mount * 1000);
+	printf("image, mount+open all:  %10.3f ms\n", mount_open * 1000);
+	return 0;
+}
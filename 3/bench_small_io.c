@@ -0,0 +1,83 @@
+#include "userfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Small I/O benchmark. Writes and then reads a file with tiny calls
+ * through plain and UFS_BUFFERED descriptors, so the per-call cost
+ * is visible.
+ *
+ * Usage: ./bench_small_io [total_mb]
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(size_t total_size, size_t call_size, int flags)
+{
+	char chunk[64];
+	memset(chunk, 'a', sizeof(chunk));
+	size_t calls = total_size / call_size;
+
+	double start = now();
+	int fd = ufs_open("file", UFS_CREATE | flags);
+	for (size_t i = 0; i < calls; ++i)
+	{
+		if (ufs_write(fd, chunk, call_size) != (ssize_t)call_size)
+		{
+			printf("write failed: %d\n", ufs_errno());
+			exit(-1);
+		}
+	}
+
+	ufs_close(fd);
+	double write_time = now() - start;
+
+	start = now();
+	fd = ufs_open("file", flags);
+	for (size_t i = 0; i < calls; ++i)
+	{
+		if (ufs_read(fd, chunk, call_size) != (ssize_t)call_size)
+		{
+			printf("read failed: %d\n", ufs_errno());
+			exit(-1);
+		}
+	}
+
+	ufs_close(fd);
+	double read_time = now() - start;
+	ufs_delete("file");
+
+	printf("%2zu bytes, %-8s write: %7.1f ns/call, read: %7.1f ns/call\n", call_size,
+		   flags & UFS_BUFFERED ? "buffered" : "plain", write_time * 1e9 / calls,
+		   read_time * 1e9 / calls);
+}
+
+int main(int argc, char **argv)
+{
+	size_t total_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+	size_t total_size = total_mb * 1024 * 1024;
+	if (total_mb == 0 || total_mb > 100)
+	{
+		printf("File size must be from 1 to 100 MB\n");
+		return -1;
+	}
+
+	printf("%zu MB file\n", total_mb);
+	size_t call_sizes[] = {1, 16};
+	for (size_t i = 0; i < sizeof(call_sizes) / sizeof(call_sizes[0]); ++i)
+	{
+		run(total_size, call_sizes[i], 0);
+		run(total_size, call_sizes[i], UFS_BUFFERED);
+	}
+
+	ufs_destroy();
+	return 0;
+}
@@ -0,0 +1,177 @@
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Multi-threaded benchmark. Runs the same amount of 4KB operations per
+ * thread with a growing thread count, so ideal scaling keeps the time
+ * constant and multiplies the throughput.
+ *
+ * Usage: ./bench_threads [max_threads] [ops_per_thread]
+ */
+
+enum
+{
+	CHUNK_SIZE = 4096,
+	FILE_SIZE = 16 * 1024 * 1024,
+};
+
+enum bench_mode
+{
+	/** Each thread writes and reads its own file. */
+	MODE_DISTINCT,
+	/** All threads read the same file. */
+	MODE_SHARED_READ,
+	/** All threads read the same file, one of them writes into it. */
+	MODE_SHARED_MIXED,
+};
+
+static const char *mode_names[] = {
+	"distinct files, write+read",
+	"shared file, read only",
+	"shared file, 1 writer",
+};
+
+struct bench_ctx
+{
+	enum bench_mode mode;
+	int ops;
+	int id;
+	pthread_barrier_t *barrier;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *bench_worker_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	char chunk[CHUNK_SIZE];
+	memset(chunk, 'a' + ctx->id % 26, sizeof(chunk));
+	char name[32];
+	if (ctx->mode == MODE_DISTINCT)
+		sprintf(name, "file%d", ctx->id);
+	else
+		sprintf(name, "shared");
+
+	bool is_writer = ctx->mode == MODE_DISTINCT ||
+					 (ctx->mode == MODE_SHARED_MIXED && ctx->id == 0);
+	/*
+	 * Sequential access through descriptors. Random offsets would measure
+	 * the walk over the block list instead of the locking.
+	 */
+	int fd = -1;
+	size_t offset = FILE_SIZE;
+	pthread_barrier_wait(ctx->barrier);
+	for (int i = 0; i < ctx->ops; ++i)
+	{
+		if (offset == FILE_SIZE)
+		{
+			if (fd != -1)
+				ufs_close(fd);
+
+			fd = ufs_open(name, 0);
+			offset = 0;
+		}
+
+		ssize_t rc;
+		if (is_writer && (ctx->mode != MODE_DISTINCT || i % 2 == 0))
+			rc = ufs_write(fd, chunk, CHUNK_SIZE);
+		else
+			rc = ufs_read(fd, chunk, CHUNK_SIZE);
+
+		if (rc != CHUNK_SIZE)
+			abort();
+
+		offset += CHUNK_SIZE;
+	}
+
+	ufs_close(fd);
+	return NULL;
+}
+
+static void fill_file(const char *name)
+{
+	char chunk[CHUNK_SIZE];
+	memset(chunk, 'x', sizeof(chunk));
+	int fd = ufs_open(name, UFS_CREATE);
+	for (size_t done = 0; done < FILE_SIZE; done += CHUNK_SIZE)
+		ufs_write(fd, chunk, CHUNK_SIZE);
+
+	ufs_close(fd);
+}
+
+static double run(enum bench_mode mode, int thread_count, int ops)
+{
+	char name[32];
+	if (mode == MODE_DISTINCT)
+	{
+		for (int i = 0; i < thread_count; ++i)
+		{
+			sprintf(name, "file%d", i);
+			fill_file(name);
+		}
+	}
+	else
+		fill_file("shared");
+
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, thread_count + 1);
+	pthread_t threads[thread_count];
+	struct bench_ctx ctxs[thread_count];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		ctxs[i] = (struct bench_ctx){
+			.mode = mode,
+			.ops = ops,
+			.id = i,
+			.barrier = &barrier,
+		};
+		pthread_create(&threads[i], NULL, bench_worker_f, &ctxs[i]);
+	}
+
+	pthread_barrier_wait(&barrier);
+	double start = now();
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+
+	double duration = now() - start;
+	pthread_barrier_destroy(&barrier);
+	ufs_destroy();
+	return duration;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	int ops = argc > 2 ? atoi(argv[2]) : 200000;
+	if (max_threads <= 0 || ops <= 0)
+	{
+		printf("Invalid arguments\n");
+		return -1;
+	}
+
+	printf("%d ops of %d bytes per thread\n", ops, CHUNK_SIZE);
+	for (int mode = MODE_DISTINCT; mode <= MODE_SHARED_MIXED; ++mode)
+	{
+		printf("%s:\n", mode_names[mode]);
+		for (int threads = 1; threads <= max_threads; threads *= 2)
+		{
+			double duration = run(mode, threads, ops);
+			printf("  %3d threads: %8.3f s, %10.0f ops/s\n", threads, duration,
+				   threads * ops / duration);
+		}
+	}
+
+	return 0;
+}
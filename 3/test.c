@@ -1,8 +1,13 @@
 #include "userfs.h"
 #include "unit.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 static void test_open(void)
 {
@@ -474,6 +479,486 @@ static void test_resize(void)
 #endif
 }
 
+static void test_vectored_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char part1[] = "hello, ";
+	char part2[1000];
+	for (size_t i = 0; i < sizeof(part2); ++i)
+		part2[i] = 'a' + i % ('z' - 'a' + 1);
+	struct iovec iov[64] = {
+		{.iov_base = part1, .iov_len = strlen(part1)},
+		{.iov_base = part2, .iov_len = sizeof(part2)},
+	};
+	ssize_t total = strlen(part1) + sizeof(part2);
+	unit_check(ufs_writev(fd, iov, 2) == total, "writev");
+
+	char buffer[2048];
+	unit_check(ufs_pread(fd, buffer, 5, 0) == 5, "pread from the start");
+	unit_check(memcmp(buffer, "hello", 5) == 0, "data is correct");
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), 600) == total - 600,
+			   "pread in the middle till the end");
+	unit_check(memcmp(buffer, part2 + 600 - strlen(part1), total - 600) == 0,
+			   "data is correct");
+	unit_check(ufs_pread(fd, buffer, 1, total) == 0, "pread at the end");
+	unit_check(ufs_pwrite(fd, "HELLO", 5, 0) == 5, "pwrite");
+	unit_check(ufs_write(fd, "!", 1) == 1, "descriptor position is kept");
+	unit_check(ufs_pwrite(fd, "x", 1, total + 10) == 1, "pwrite past the end");
+
+	int fd2 = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(fd2 == -1);
+	char head[5], tail[16];
+	iov[0] = (struct iovec){.iov_base = head, .iov_len = sizeof(head)};
+	iov[1] = (struct iovec){.iov_base = buffer, .iov_len = total - 5};
+	iov[2] = (struct iovec){.iov_base = tail, .iov_len = sizeof(tail)};
+	unit_check(ufs_readv(fd2, iov, 3) == total + 11, "readv");
+	unit_check(memcmp(head, "HELLO", 5) == 0, "data is correct");
+	unit_check(memcmp(buffer + strlen(part1) - 5, part2, sizeof(part2) - 1) == 0,
+			   "data is correct");
+	unit_check(tail[9] == 0 && tail[10] == 'x', "the gap is zeroed");
+	unit_check(ufs_pwrite(fd2, "a", 1, 0) == -1, "pwrite needs write rights");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	int iovcnt = 64;
+	unit_check(ufs_read_map(fd2, 2, iov, &iovcnt) == 2, "map a few bytes");
+	unit_check(iovcnt == 1 && memcmp(iov[0].iov_base, "HE", 2) == 0,
+			   "mapped data is correct");
+	iovcnt = 64;
+	size_t mapped = ufs_read_map(fd2, sizeof(buffer), iov, &iovcnt);
+	unit_check(mapped == (size_t)total + 9, "map the rest");
+	unit_check(iovcnt >= 1 && memcmp(iov[0].iov_base, "LLO, ", 5) == 0,
+			   "mapped data is correct");
+	iovcnt = 64;
+	unit_check(ufs_read_map(fd2, sizeof(buffer), iov, &iovcnt) == 0 &&
+				   iovcnt == 0,
+			   "nothing to map at the end");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+#if NEED_RESIZE
+	/* Move a descriptor to 10 bytes before the max file size. */
+	size_t max_size = 100 * 1024 * 1024;
+	unit_fail_if(ufs_resize(fd, max_size - 10) != 0);
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char *big = malloc(1024 * 1024);
+	for (size_t done = 0; done < max_size - 10;)
+	{
+		ssize_t rc = ufs_read(fd2, big, 1024 * 1024);
+		unit_fail_if(rc <= 0);
+		done += rc;
+	}
+	free(big);
+	iov[0] = (struct iovec){.iov_base = part1, .iov_len = 5};
+	iov[1] = (struct iovec){.iov_base = part2, .iov_len = sizeof(part2)};
+	unit_check(ufs_writev(fd2, iov, 2) == 10,
+			   "writev returns the written part on an error");
+	unit_check(ufs_pread(fd, buffer, 10, max_size - 10) == 10 &&
+				   memcmp(buffer, "hello", 5) == 0 && memcmp(buffer + 5, part2, 5) == 0,
+			   "the written part is in the file");
+	unit_check(ufs_writev(fd2, iov, 2) == -1, "writev fails when nothing is written");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_fail_if(ufs_close(fd2) != 0);
+#endif
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void test_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	size_t size = 50 * 1024 * 1024;
+	unit_check(ufs_resize(fd, size) == 0, "grow to a big size");
+	char buffer[2048], zeros[2048];
+	memset(zeros, 0, sizeof(zeros));
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), size / 2) == sizeof(buffer),
+			   "read from the hole");
+	unit_check(memcmp(buffer, zeros, sizeof(buffer)) == 0, "the hole is zeroed");
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), size - 10) == 10,
+			   "read the hole end");
+
+	memset(buffer, 'a', sizeof(buffer));
+	unit_check(ufs_pwrite(fd, buffer, sizeof(buffer), size / 2 + 100) == sizeof(buffer),
+			   "write in the middle");
+	unit_check(ufs_pread(fd, buffer, 200, size / 2) == 200, "read around the data");
+	unit_check(memcmp(buffer, zeros, 100) == 0 && buffer[100] == 'a',
+			   "data is between zeros");
+
+	unit_check(ufs_punch_hole(fd, size / 2 + 1000, 1000) == 0, "punch a hole");
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), size / 2 + 100) == sizeof(buffer),
+			   "read the punched range");
+	unit_check(buffer[899] == 'a' && memcmp(buffer + 900, zeros, 1000) == 0 &&
+				   buffer[1900] == 'a',
+			   "only the range is zeroed");
+
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_write(fd, "0123456789", 10) != 10);
+	unit_check(ufs_punch_hole(fd, 0, 100) == 0, "punch the whole file");
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), 0) == 10, "size is kept");
+	unit_check(memcmp(buffer, zeros, 10) == 0, "the file is zeroed");
+	unit_fail_if(ufs_resize(fd, 3) != 0);
+	unit_fail_if(ufs_pwrite(fd, "x", 1, 2) != 1);
+	unit_fail_if(ufs_resize(fd, 20) != 0);
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), 0) == 20, "grow again");
+	unit_check(buffer[2] == 'x' && memcmp(buffer + 3, zeros, 17) == 0,
+			   "old data past the end is not visible");
+
+	int fd2 = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_punch_hole(fd2, 0, 1) == -1, "punch needs write rights");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void test_buffered(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE | UFS_BUFFERED);
+	unit_fail_if(fd == -1);
+	int reader = ufs_open("file", 0);
+	unit_fail_if(reader == -1);
+	char buffer[8192];
+	for (size_t i = 0; i < 1000; ++i)
+		unit_fail_if(ufs_write(fd, "x", 1) != 1);
+	unit_check(ufs_read(reader, buffer, sizeof(buffer)) == 0,
+			   "buffered writes are not visible before flush");
+	unit_check(ufs_flush(fd) == 0, "flush");
+	unit_check(ufs_read(reader, buffer, sizeof(buffer)) == 1000,
+			   "buffered writes are visible after flush");
+	unit_check(buffer[0] == 'x' && buffer[999] == 'x', "data is correct");
+
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % ('z' - 'a' + 1);
+	unit_fail_if(ufs_write(fd, buffer, 10) != 10);
+	unit_check(ufs_write(fd, buffer + 10, sizeof(buffer) - 10) ==
+				   sizeof(buffer) - 10,
+			   "big write after a small one");
+	unit_fail_if(ufs_write(fd, "tail", 4) != 4);
+	unit_check(ufs_close(fd) == 0, "close flushes");
+	char data[sizeof(buffer)];
+	unit_check(ufs_read(reader, data, sizeof(data)) == sizeof(data),
+			   "read the flushed data");
+	unit_check(memcmp(data, buffer, sizeof(buffer)) == 0, "order is kept");
+	unit_fail_if(ufs_close(reader) != 0);
+
+	fd = ufs_open("file", UFS_BUFFERED);
+	unit_fail_if(fd == -1);
+	size_t total = 1000 + sizeof(buffer) + 4;
+	size_t done = 0;
+	char byte;
+	bool is_correct = true;
+	for (; done < 1000; ++done)
+		is_correct = is_correct && ufs_read(fd, &byte, 1) == 1 && byte == 'x';
+	unit_check(is_correct, "small buffered reads");
+	unit_check(ufs_read(fd, data, 100) == 100 && memcmp(data, buffer, 100) == 0,
+			   "read across the prefetched data");
+	done += 100;
+	unit_check(ufs_write(fd, "XY", 2) == 2, "write after prefetch");
+	unit_check(ufs_pread(fd, data, 4, done - 1) == 4, "pread flushes");
+	unit_check(memcmp(data, "vXYy", 4) == 0,
+			   "the write went right after the read data");
+	unit_check(ufs_read(fd, data, sizeof(data)) == (ssize_t)(total - done - 2),
+			   "read the rest");
+	unit_check(memcmp(data + total - done - 6, "tail", 4) == 0,
+			   "data is correct");
+	unit_check(ufs_read(fd, &byte, 1) == 0, "EOF");
+
+	int writer = ufs_open("file", 0);
+	unit_fail_if(writer == -1);
+	unit_fail_if(ufs_resize(writer, 10) != 0);
+	unit_check(ufs_write(fd, "end", 3) == 3 && ufs_flush(fd) == 0,
+			   "write after resize");
+	unit_check(ufs_pread(writer, data, sizeof(data), 0) == 13, "file size");
+	unit_check(memcmp(data + 10, "end", 3) == 0,
+			   "descriptor proceeds from the new end");
+	unit_fail_if(ufs_close(writer) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+enum
+{
+	TEST_THREAD_COUNT = 8,
+	TEST_THREAD_FILE_SIZE = 64 * 1024,
+};
+
+static char test_thread_pattern(size_t pos)
+{
+	return 'a' + pos % ('z' - 'a' + 1);
+}
+
+static void *test_threads_worker_f(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[32], buffer[1024];
+	sprintf(name, "thread_file_%d", id);
+	int fd = ufs_open(name, UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int shared = ufs_open("shared", 0);
+	unit_fail_if(shared == -1);
+
+	for (size_t done = 0; done < TEST_THREAD_FILE_SIZE;)
+	{
+		size_t size = (done + id) % sizeof(buffer) + 1;
+		if (size > TEST_THREAD_FILE_SIZE - done)
+			size = TEST_THREAD_FILE_SIZE - done;
+
+		for (size_t i = 0; i < size; i++)
+			buffer[i] = test_thread_pattern(done + i);
+
+		unit_fail_if(ufs_write(fd, buffer, size) != (ssize_t)size);
+		done += size;
+
+		size_t offset = done * 7 % (TEST_THREAD_FILE_SIZE - size);
+		unit_fail_if(ufs_pread(shared, buffer, size, offset) != (ssize_t)size);
+		for (size_t i = 0; i < size; i++)
+			unit_fail_if(buffer[i] != test_thread_pattern(offset + i));
+	}
+
+	for (size_t done = 0; done < TEST_THREAD_FILE_SIZE; done += sizeof(buffer))
+	{
+		unit_fail_if(ufs_pread(fd, buffer, sizeof(buffer), done) != sizeof(buffer));
+		for (size_t i = 0; i < sizeof(buffer); i++)
+			unit_fail_if(buffer[i] != test_thread_pattern(done + i));
+	}
+
+	unit_fail_if(ufs_close(shared) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete(name) != 0);
+	return NULL;
+}
+
+#if NEED_RESIZE
+
+static void *test_threads_opener_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 2000; ++i)
+	{
+		int fd = ufs_open("opened", 0);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	return NULL;
+}
+
+static void *test_threads_resizer_f(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	for (int i = 0; i < 2000; ++i)
+		unit_fail_if(ufs_resize(fd, i % 2 == 0 ? 100 : 5000) != 0);
+	return NULL;
+}
+
+#endif
+
+static void test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[TEST_THREAD_FILE_SIZE];
+	for (size_t i = 0; i < sizeof(buffer); i++)
+		buffer[i] = test_thread_pattern(i);
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+
+	pthread_t threads[TEST_THREAD_COUNT];
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i)
+	{
+		int rc = pthread_create(&threads[i], NULL, test_threads_worker_f,
+								(void *)(intptr_t)i);
+		unit_fail_if(rc != 0);
+	}
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_msg("threads wrote own files and read the shared one");
+
+	unit_check(ufs_open("thread_file_0", 0) == -1, "own files are deleted");
+
+#if NEED_RESIZE
+	/* Resize of a file must not touch the descriptors of other files. */
+	int opened = ufs_open("opened", UFS_CREATE);
+	unit_fail_if(opened == -1);
+	pthread_t resizer;
+	unit_fail_if(pthread_create(&resizer, NULL, test_threads_resizer_f,
+								(void *)(intptr_t)fd) != 0);
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i)
+	{
+		int rc = pthread_create(&threads[i], NULL, test_threads_opener_f, NULL);
+		unit_fail_if(rc != 0);
+	}
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_fail_if(pthread_join(resizer, NULL) != 0);
+	unit_msg("resize of one file while the other is opened and closed");
+	unit_fail_if(ufs_close(opened) != 0);
+	unit_fail_if(ufs_delete("opened") != 0);
+#endif
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+/** Free space of the mounted image, measured by a file filling it. */
+static size_t test_image_free_size(void)
+{
+	int fd = ufs_open("free_space", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[512] = {0};
+	size_t size = 0;
+	ssize_t rc;
+	while ((rc = ufs_write(fd, buffer, sizeof(buffer))) > 0)
+		size += rc;
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("free_space") != 0);
+	return size;
+}
+
+static void test_image(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/ufs_test_image.XXXXXX";
+	int tmp = mkstemp(path);
+	unit_fail_if(tmp == -1);
+	close(tmp);
+
+	unit_check(ufs_mount(path, 1024 * 1024) == 0, "mount a new image");
+	unit_check(ufs_mount(path, 1024 * 1024) == -1, "can not mount twice");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+
+	char buffer[2048];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % ('z' - 'a' + 1);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, buffer, sizeof(buffer)) == sizeof(buffer),
+			   "write into the image");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	int ghost = ufs_open("ghost", UFS_CREATE);
+	unit_fail_if(ghost == -1);
+	unit_fail_if(ufs_write(ghost, "boo", 3) != 3);
+	unit_fail_if(ufs_delete("ghost") != 0);
+	unit_check(ufs_checkpoint() == 0, "checkpoint");
+	ufs_destroy();
+
+	unit_check(ufs_mount(path, 0) == 0, "mount the existing image");
+	unit_check(ufs_open("ghost", 0) == -1,
+			   "file deleted while opened is gone");
+	fd = ufs_open("file", 0);
+	unit_check(fd != -1, "file survived the remount");
+	char data[sizeof(buffer)];
+	unit_check(ufs_read(fd, data, sizeof(data)) == sizeof(data),
+			   "read all");
+	unit_check(memcmp(data, buffer, sizeof(buffer)) == 0, "data is correct");
+	unit_fail_if(ufs_resize(fd, 600) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, data, sizeof(data)) == 600, "resize persisted");
+	unit_check(memcmp(data, buffer, 600) == 0, "data is correct");
+	unit_fail_if(ufs_punch_hole(fd, 0, 512) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, data, sizeof(data)) == 600, "read after punch");
+	unit_check(data[0] == 0 && data[511] == 0 && memcmp(data + 512, buffer + 512, 88) == 0,
+			   "hole persisted");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	ssize_t rc;
+	while ((rc = ufs_write(fd, buffer, sizeof(buffer))) > 0)
+		;
+	unit_check(rc == -1, "image gets full");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	unit_check(ufs_open("file", 0) == -1, "deletion persisted");
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, buffer, sizeof(buffer)) == sizeof(buffer),
+			   "freed space is reused");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+
+	/* The image is 1MB, the file is sparse and 10 times bigger. */
+	size_t free_size = test_image_free_size();
+	size_t big_size = 10 * 1024 * 1024;
+	fd = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, big_size) != 0);
+	unit_check(ufs_pwrite(fd, "x", 1, big_size) == 1, "write past the end of a sparse file");
+	unit_check(test_image_free_size() == free_size - 512, "holes take no image blocks");
+	unit_fail_if(ufs_pwrite(fd, buffer, sizeof(buffer), 0) != sizeof(buffer));
+	unit_check(test_image_free_size() == free_size - 5 * 512, "written blocks take space");
+	unit_fail_if(ufs_punch_hole(fd, 0, sizeof(buffer)) != 0);
+	unit_check(test_image_free_size() == free_size - 512, "punch frees the image blocks");
+	unit_fail_if(ufs_pwrite(fd, "y", 1, 1000) != 1);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	fd = ufs_open("sparse", 0);
+	unit_fail_if(fd == -1);
+	char zeros[sizeof(buffer)] = {0};
+	unit_check(ufs_pread(fd, data, sizeof(data), 0) == sizeof(data) && data[1000] == 'y' &&
+				   memcmp(data, zeros, 1000) == 0 && memcmp(data + 1001, zeros, 1047) == 0,
+			   "punched blocks are zeros after the remount");
+	unit_check(ufs_pread(fd, data, sizeof(data), big_size) == 1 && data[0] == 'x',
+			   "sparse file persisted");
+	unit_check(test_image_free_size() == free_size - 2 * 512, "free space persisted");
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_check(test_image_free_size() == free_size, "resize frees the image blocks");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	/* Point the inode table of the superblock past the image end. */
+	tmp = open(path, O_RDWR);
+	unit_fail_if(tmp == -1);
+	uint64_t offset = UINT64_MAX / 2;
+	unit_fail_if(pwrite(tmp, &offset, sizeof(offset), 32) != sizeof(offset));
+	close(tmp);
+	unit_check(ufs_mount(path, 0) == -1, "corrupted image is not mounted");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int main(int argc, char **argv)
 {
 	if (doCmdMaxPoints(argc, argv))
@@ -498,10 +983,16 @@ int main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_vectored_io();
+	test_sparse();
+	test_buffered();
+	test_threads();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
 
+	test_image();
+
 	unit_test_finish();
 	return 0;
 }
\ No newline at end of file
@@ -1,32 +1,49 @@
 #include "userfs.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 enum
 {
 	BLOCK_SIZE = 512,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	NAMESPACE_SHARD_COUNT = 64,
+	DESCRIPTOR_CHUNK_SIZE = 1024,
+	DESCRIPTOR_CHUNK_COUNT = 1024,
+	MAX_DESCRIPTORS = DESCRIPTOR_CHUNK_SIZE * DESCRIPTOR_CHUNK_COUNT,
+	DESCRIPTOR_BUFFER_SIZE = 8 * BLOCK_SIZE,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** Error code of the calling thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
 struct block
 {
-	/** Block memory. */
+	/**
+	 * Block memory. NULL for a hole - the block reads as zeros and
+	 * gets memory on the first write into it.
+	 */
 	char *memory;
 
-	/** How many bytes are occupied. */
-	int occupied;
-
 	/** Next block in the file. */
 	struct block *next;
 
 	/** Previous block in the file. */
 	struct block *prev;
+
+	/**
+	 * Index of the block in the image data area. Valid in image mode,
+	 * IMAGE_BLOCK_END for a hole.
+	 */
+	uint32_t index;
 };
 
 struct file
@@ -37,27 +54,72 @@ struct file
 	/** Last block in the list above for fast access to the end of file. */
 	struct block *last_block;
 
+	/**
+	 * How many blocks are in the list. The file size can go beyond
+	 * them, the rest of the file is an implicit hole.
+	 */
+	size_t block_count;
+
 	/** How many file descriptors are opened on the file. */
 	int refs;
 
 	/** File name. */
 	char *name;
 
-	/** Files are stored in a double-linked list. */
+	/** Files of a namespace shard are stored in a double-linked list. */
 	struct file *next;
 
-	/** Files are stored in a double-linked list. */
+	/** Files of a namespace shard are stored in a double-linked list. */
 	struct file *prev;
 
+	/** Namespace shard the file belongs to. */
+	struct namespace_shard *shard;
+
+	/** Descriptors opened on the file. Changed under the exclusive lock. */
+	struct filedesc *descriptors;
+
+	/**
+	 * Protects the blocks, the size and positions of the descriptors
+	 * of the file. Readers share it, writers take it exclusively.
+	 */
+	pthread_rwlock_t lock;
+
 	/** True if the file is logically deleted but still opened. */
 	bool is_deleted;
 
 	/** Current size of the file in bytes. */
 	size_t size;
+
+	/** Index of the file's inode in the image. Valid in image mode. */
+	uint32_t inode;
+
+	/**
+	 * True if the block list is not built yet. Files of a mounted image
+	 * get their blocks attached on the first open, so the mount does not
+	 * depend on the amount of stored data.
+	 */
+	bool is_lazy;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+struct namespace_shard
+{
+	/**
+	 * Protects the file list, and refs and is_deleted of the files in
+	 * it.
+	 */
+	pthread_mutex_t lock;
+
+	/** Files whose names hash to this shard. */
+	struct file *file_list;
+};
+
+/**
+ * All files, split by name hash, so opens and deletions of different
+ * files rarely contend on the same lock.
+ */
+static struct namespace_shard namespace_shards[NAMESPACE_SHARD_COUNT] = {
+	[0 ... NAMESPACE_SHARD_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
 
 struct filedesc
 {
@@ -72,52 +134,371 @@ struct filedesc
 
 	/** Access flags for this descriptor (read/write mode). */
 	int flags;
+
+	/**
+	 * Buffer of a UFS_BUFFERED descriptor, NULL otherwise. It holds
+	 * either written but not applied data, which goes to the file at
+	 * the descriptor offset, or data prefetched by a read. Only the
+	 * descriptor owner touches the buffer, so it is used without the
+	 * file lock.
+	 */
+	char *buffer;
+
+	/** How many bytes are in the buffer. */
+	size_t buffer_size;
+
+	/** Next prefetched byte to return. */
+	size_t buffer_pos;
+
+	/** True if the buffer holds prefetched data. */
+	bool is_prefetched;
+
+	/**
+	 * File offset of the prefetched data. The descriptor offset is
+	 * behind the prefetched data, and resize can move it.
+	 */
+	size_t prefetch_offset;
+
+	/** Descriptors of the file are stored in a double-linked list. */
+	struct filedesc *next;
+
+	/** Descriptors of the file are stored in a double-linked list. */
+	struct filedesc *prev;
+};
+
+/**
+ * A table of file descriptors split into chunks. When a file
+ * descriptor is created, its pointer drops here. When a file
+ * descriptor is closed, its place is set to NULL and can be taken by
+ * next ufs_open() call. Chunks are never moved or freed before
+ * ufs_destroy(), so a lookup is two atomic loads without any locks.
+ */
+static struct filedesc **descriptor_chunks[DESCRIPTOR_CHUNK_COUNT];
+
+/** Serializes installation and removal of descriptors. */
+static pthread_mutex_t descriptor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Lowest descriptor which can be free. */
+static int descriptor_free_hint = 0;
+
+/** How many descriptors are opened. */
+static int descriptor_count = 0;
+
+enum
+{
+	IMAGE_MAGIC = 0x55465349,
+	IMAGE_VERSION = 3,
+	IMAGE_NAME_MAX = 108,
+	IMAGE_INODE_USED = 1,
+	IMAGE_INODE_DELETED = 2,
+	/** Each this many blocks of the image get one inode. */
+	IMAGE_BLOCKS_PER_INODE = 64,
+	IMAGE_MIN_INODES = 16,
+	IMAGE_ALIGN = 4096,
 };
 
+/** Terminates a block chain in the image link table. */
+#define IMAGE_BLOCK_END UINT32_MAX
+
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * Image header. Lies at the very beginning of the image file. The
+ * rest of the image consists of the inode table, the next and the
+ * previous block link tables, the block position table, the
+ * free-space bitmap and the data blocks, in this order.
  */
-static struct filedesc **file_descriptors = NULL;
+struct image_super
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t inode_count;
+	/** Where to start the search of a free block. */
+	uint32_t free_hint;
+	uint64_t image_size;
+	uint64_t inode_offset;
+	uint64_t link_offset;
+	uint64_t prev_link_offset;
+	uint64_t position_offset;
+	uint64_t bitmap_offset;
+	uint64_t data_offset;
+};
+
+/** Persistent part of struct file. */
+struct image_inode
+{
+	/** Zero-terminated file name. */
+	char name[IMAGE_NAME_MAX];
+
+	/** Bitwise combination of IMAGE_INODE_* flags. */
+	uint32_t flags;
+
+	/**
+	 * First block of the chain of the file, or IMAGE_BLOCK_END. The
+	 * chain has only the blocks with data, in any order. The holes
+	 * take no blocks.
+	 */
+	uint32_t first_block;
+
+	/** File size in bytes. */
+	uint64_t size;
+};
+
+/** A mounted image. NULL when the FS lives on the heap. */
+struct image
+{
+	/** Image file descriptor. */
+	int fd;
+
+	/** Protects the bitmap and the inode table allocation. */
+	pthread_mutex_t lock;
+
+	/** Mapped memory of the whole image. */
+	char *memory;
+
+	/** Size of the mapping. */
+	size_t size;
+
+	struct image_super *super;
+	struct image_inode *inodes;
 
-static int file_descriptor_count = 0;
+	/** Next block of each block, indexed by block number. */
+	uint32_t *links;
 
-static int file_descriptor_capacity = 0;
+	/** Previous block of each block, indexed by block number. */
+	uint32_t *prev_links;
+
+	/** Number of each block in its file, indexed by block number. */
+	uint32_t *positions;
+
+	/** One bit per block, set if the block is used. */
+	uint64_t *bitmap;
+
+	/** Beginning of the data blocks. */
+	char *data;
+};
+
+static struct image *image = NULL;
 
 enum ufs_error_code ufs_errno()
 {
 	return ufs_error_code;
 }
 
-static struct file *find_file(const char *filename)
+static struct namespace_shard *namespace_shard(const char *filename)
+{
+	/* FNV-1a. */
+	uint32_t hash = 2166136261u;
+	for (const char *c = filename; *c != 0; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+
+	return &namespace_shards[hash % NAMESPACE_SHARD_COUNT];
+}
+
+/** Find a not deleted file. The shard must be locked. */
+static struct file *find_file(struct namespace_shard *shard, const char *filename)
 {
-	for (struct file *file = file_list; file; file = file->next)
+	for (struct file *file = shard->file_list; file; file = file->next)
 		if (!file->is_deleted && strcmp(file->name, filename) == 0)
 			return file;
 
 	return NULL;
 }
 
-static struct block *allocate_block(void)
+static void add_file_to_shard(struct namespace_shard *shard, struct file *file)
+{
+	file->shard = shard;
+	file->prev = NULL;
+	file->next = shard->file_list;
+	if (shard->file_list)
+		shard->file_list->prev = file;
+
+	shard->file_list = file;
+}
+
+static inline char *image_block_memory(uint32_t index)
+{
+	return image->data + (size_t)index * BLOCK_SIZE;
+}
+
+static uint32_t image_alloc_block(void)
+{
+	struct image_super *super = image->super;
+	uint32_t word_count = (super->block_count + 63) / 64;
+	uint32_t start = super->free_hint / 64;
+	for (uint32_t i = 0; i < word_count; i++)
+	{
+		uint32_t word_index = (start + i) % word_count;
+		uint64_t word = image->bitmap[word_index];
+		if (word == UINT64_MAX)
+			continue;
+
+		uint32_t bit = __builtin_ctzll(~word);
+		uint32_t index = word_index * 64 + bit;
+		image->bitmap[word_index] = word | (1ULL << bit);
+		image->links[index] = IMAGE_BLOCK_END;
+		super->free_hint = index;
+		return index;
+	}
+
+	return IMAGE_BLOCK_END;
+}
+
+static void image_free_block(uint32_t index)
+{
+	image->bitmap[index / 64] &= ~(1ULL << (index % 64));
+	if (index < image->super->free_hint)
+		image->super->free_hint = index;
+}
+
+/** Free the chain of a file. A corrupted chain is freed up to the first bad link. */
+static void image_free_chain(uint32_t index)
+{
+	for (uint32_t i = 0; i < image->super->block_count && index < image->super->block_count; i++)
+	{
+		uint32_t next = image->links[index];
+		image_free_block(index);
+		index = next;
+	}
+}
+
+static uint32_t image_alloc_inode(const char *filename)
+{
+	size_t len = strlen(filename);
+	if (len >= IMAGE_NAME_MAX)
+		return IMAGE_BLOCK_END;
+
+	for (uint32_t i = 0; i < image->super->inode_count; i++)
+	{
+		struct image_inode *inode = &image->inodes[i];
+		if (inode->flags != 0)
+			continue;
+
+		memcpy(inode->name, filename, len + 1);
+		inode->flags = IMAGE_INODE_USED;
+		inode->first_block = IMAGE_BLOCK_END;
+		inode->size = 0;
+		return i;
+	}
+
+	return IMAGE_BLOCK_END;
+}
+
+/**
+ * Add the block to the head of the chain of the file. The file must
+ * be locked exclusively.
+ */
+static void image_link_block(struct file *file, uint32_t index, size_t position)
+{
+	struct image_inode *inode = &image->inodes[file->inode];
+	image->positions[index] = position;
+	image->prev_links[index] = IMAGE_BLOCK_END;
+	image->links[index] = inode->first_block;
+	if (inode->first_block != IMAGE_BLOCK_END)
+		image->prev_links[inode->first_block] = index;
+
+	inode->first_block = index;
+}
+
+/** Remove the block from the chain of the file. The file must be locked exclusively. */
+static void image_unlink_block(struct file *file, uint32_t index)
+{
+	uint32_t prev = image->prev_links[index];
+	uint32_t next = image->links[index];
+	if (prev != IMAGE_BLOCK_END)
+		image->links[prev] = next;
+	else
+		image->inodes[file->inode].first_block = next;
+
+	if (next != IMAGE_BLOCK_END)
+		image->prev_links[next] = prev;
+}
+
+static void file_set_size(struct file *file, size_t size)
+{
+	file->size = size;
+	if (image != NULL)
+		image->inodes[file->inode].size = size;
+}
+
+/**
+ * Allocate a block. The memory of a not hole block is not zeroed -
+ * the bytes past the file size are never read before file_grow()
+ * clears them.
+ */
+static struct block *allocate_block(bool is_hole)
 {
 	struct block *block = malloc(sizeof(*block));
 	if (!block)
 		return NULL;
 
-	block->memory = malloc(BLOCK_SIZE);
-	if (!block->memory)
+	block->memory = NULL;
+	block->index = IMAGE_BLOCK_END;
+	if (image != NULL && !is_hole)
 	{
-		free(block);
-		return NULL;
+		pthread_mutex_lock(&image->lock);
+		block->index = image_alloc_block();
+		pthread_mutex_unlock(&image->lock);
+		if (block->index == IMAGE_BLOCK_END)
+		{
+			free(block);
+			return NULL;
+		}
+
+		block->memory = image_block_memory(block->index);
+	}
+	else if (!is_hole)
+	{
+		block->memory = malloc(BLOCK_SIZE);
+		if (!block->memory)
+		{
+			free(block);
+			return NULL;
+		}
 	}
 
-	block->occupied = 0;
 	block->next = block->prev = NULL;
 	return block;
 }
 
+/** Give zeroed memory to a hole, which is the block @a position of the file. */
+static int block_materialize(struct file *file, struct block *block, size_t position)
+{
+	if (image != NULL)
+	{
+		pthread_mutex_lock(&image->lock);
+		block->index = image_alloc_block();
+		pthread_mutex_unlock(&image->lock);
+		if (block->index == IMAGE_BLOCK_END)
+			return -1;
+
+		image_link_block(file, block->index, position);
+		block->memory = image_block_memory(block->index);
+		memset(block->memory, 0, BLOCK_SIZE);
+		return 0;
+	}
+
+	block->memory = calloc(1, BLOCK_SIZE);
+	return block->memory != NULL ? 0 : -1;
+}
+
+/** Turn the block into a hole and release its memory. */
+static void block_release(struct file *file, struct block *block)
+{
+	if (image != NULL)
+	{
+		image_unlink_block(file, block->index);
+		pthread_mutex_lock(&image->lock);
+		image_free_block(block->index);
+		pthread_mutex_unlock(&image->lock);
+		block->index = IMAGE_BLOCK_END;
+	}
+	else
+		free(block->memory);
+
+	block->memory = NULL;
+}
+
 static void append_block(struct file *file, struct block *block)
 {
 	if (file->last_block)
@@ -129,6 +510,121 @@ static void append_block(struct file *file, struct block *block)
 		file->block_list = block;
 
 	file->last_block = block;
+	file->block_count++;
+
+	if (image != NULL && block->index != IMAGE_BLOCK_END)
+		image_link_block(file, block->index, file->block_count - 1);
+}
+
+/**
+ * Check that the chain of the file has only valid blocks, each linked
+ * back to the previous one and lying inside the file size. A cycle
+ * would need more links than there are blocks.
+ */
+static int image_check_chain(const struct file *file)
+{
+	size_t max_count = (file->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t prev = IMAGE_BLOCK_END;
+	uint32_t index = image->inodes[file->inode].first_block;
+	for (uint32_t i = 0; index != IMAGE_BLOCK_END; i++)
+	{
+		if (i >= image->super->block_count || index >= image->super->block_count ||
+			image->prev_links[index] != prev || image->positions[index] >= max_count)
+			return -1;
+
+		prev = index;
+		index = image->links[index];
+	}
+
+	return 0;
+}
+
+/**
+ * Build the block list of a file stored in the image. The blocks of
+ * the chain take their places by position, the gaps become holes.
+ */
+static int file_load_blocks(struct file *file)
+{
+	if (image_check_chain(file) != 0)
+	{
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+
+	uint32_t first = image->inodes[file->inode].first_block;
+	size_t count = 0;
+	for (uint32_t index = first; index != IMAGE_BLOCK_END; index = image->links[index])
+		if (image->positions[index] >= count)
+			count = image->positions[index] + 1;
+
+	if (count == 0)
+	{
+		file->is_lazy = false;
+		return 0;
+	}
+
+	struct block **blocks = calloc(count, sizeof(*blocks));
+	if (!blocks)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	enum ufs_error_code error = UFS_ERR_NO_MEM;
+
+	for (uint32_t index = first; index != IMAGE_BLOCK_END; index = image->links[index])
+	{
+		struct block *block = malloc(sizeof(*block));
+		if (!block)
+			goto error;
+
+		/* Two blocks at one place would be leaked or freed twice. */
+		if (blocks[image->positions[index]] != NULL)
+		{
+			free(block);
+			error = UFS_ERR_IO;
+			goto error;
+		}
+
+		block->memory = image_block_memory(index);
+		block->index = index;
+		blocks[image->positions[index]] = block;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (blocks[i])
+			continue;
+
+		blocks[i] = malloc(sizeof(*blocks[i]));
+		if (!blocks[i])
+			goto error;
+
+		blocks[i]->memory = NULL;
+		blocks[i]->index = IMAGE_BLOCK_END;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		blocks[i]->prev = i > 0 ? blocks[i - 1] : NULL;
+		blocks[i]->next = i + 1 < count ? blocks[i + 1] : NULL;
+	}
+
+	file->block_list = blocks[0];
+	file->last_block = blocks[count - 1];
+	file->block_count = count;
+	file->is_lazy = false;
+	free(blocks);
+	return 0;
+
+error:
+	/* The file stays lazy, the next open loads it again. */
+	for (size_t i = 0; i < count; i++)
+		free(blocks[i]);
+
+	free(blocks);
+	ufs_error_code = error;
+	return -1;
 }
 
 static struct block *find_block_by_offset(struct block *start, size_t offset)
@@ -144,289 +640,838 @@ static struct block *find_block_by_offset(struct block *start, size_t offset)
 	return block;
 }
 
-static void free_file_blocks(struct block *block)
+/** Free the blocks of the file from @a block to the end. */
+static void free_file_blocks(struct file *file, struct block *block)
 {
+	if (image != NULL)
+		pthread_mutex_lock(&image->lock);
+
 	while (block)
 	{
 		struct block *next = block->next;
-		free(block->memory);
+		if (image == NULL)
+			free(block->memory);
+		else if (block->index != IMAGE_BLOCK_END)
+		{
+			image_unlink_block(file, block->index);
+			image_free_block(block->index);
+		}
+
 		free(block);
 		block = next;
 	}
+
+	if (image != NULL)
+		pthread_mutex_unlock(&image->lock);
 }
 
 static void free_file(struct file *file)
 {
-	free_file_blocks(file->block_list);
+	free_file_blocks(file, file->block_list);
+	if (image != NULL)
+	{
+		pthread_mutex_lock(&image->lock);
+		if (file->is_lazy)
+			image_free_chain(image->inodes[file->inode].first_block);
+
+		memset(&image->inodes[file->inode], 0, sizeof(struct image_inode));
+		pthread_mutex_unlock(&image->lock);
+	}
+
+	pthread_rwlock_destroy(&file->lock);
+	free(file->name);
+	free(file);
+}
+
+/** Free the memory of an image file, but keep it in the image. */
+static void unload_file(struct file *file)
+{
+	struct block *block = file->block_list;
+	while (block)
+	{
+		struct block *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	pthread_rwlock_destroy(&file->lock);
 	free(file->name);
 	free(file);
 }
 
+/** Unlink the file from its shard. The shard must be locked. */
 static void remove_file_from_list(struct file *file)
 {
 	if (file->prev)
 		file->prev->next = file->next;
 	else
-		file_list = file->next;
+		file->shard->file_list = file->next;
 
 	if (file->next)
 		file->next->prev = file->prev;
 }
 
-static void update_descriptor_block(struct filedesc *descriptor)
+/** Drop a reference to the file and free it if it was the last one. */
+static void file_unref(struct file *file)
 {
-	if (!descriptor->block || descriptor->offset == 0)
-		descriptor->block = find_block_by_offset(descriptor->file->block_list, descriptor->offset);
+	struct namespace_shard *shard = file->shard;
+	pthread_mutex_lock(&shard->lock);
+	bool need_free = --file->refs == 0 && file->is_deleted;
+	if (need_free)
+		remove_file_from_list(file);
+
+	pthread_mutex_unlock(&shard->lock);
+	if (need_free)
+		free_file(file);
 }
 
-int ufs_open(const char *filename, int flags)
+static struct filedesc *get_descriptor(int file_descriptor)
 {
-	struct file *file = find_file(filename);
-	if (!file)
+	struct filedesc **chunk = NULL;
+	if (file_descriptor >= 0 && file_descriptor < MAX_DESCRIPTORS)
 	{
-		if (!(flags & UFS_CREATE))
-		{
-			ufs_error_code = UFS_ERR_NO_FILE;
-			return -1;
-		}
-
-		file = calloc(1, sizeof(*file));
-		if (!file)
-		{
-			ufs_error_code = UFS_ERR_NO_MEM;
-			return -1;
-		}
-
-		file->name = strdup(filename);
-		file->next = file_list;
-
-		if (file_list)
-			file_list->prev = file;
-
-		file_list = file;
+		chunk = __atomic_load_n(&descriptor_chunks[file_descriptor / DESCRIPTOR_CHUNK_SIZE],
+								__ATOMIC_ACQUIRE);
 	}
 
-	struct filedesc *descriptor = malloc(sizeof(struct filedesc));
-	if (!descriptor)
+	struct filedesc *descriptor = NULL;
+	if (chunk)
 	{
-		ufs_error_code = UFS_ERR_NO_MEM;
-		return -1;
+		descriptor = __atomic_load_n(&chunk[file_descriptor % DESCRIPTOR_CHUNK_SIZE],
+									 __ATOMIC_ACQUIRE);
 	}
 
-	descriptor->file = file;
-	descriptor->block = file->block_list;
-	descriptor->offset = 0;
-
-	int access_flags = flags & ~(UFS_CREATE);
-	descriptor->flags = access_flags ? access_flags : UFS_READ_WRITE;
+	if (!descriptor)
+		ufs_error_code = UFS_ERR_NO_FILE;
 
-	file->refs++;
+	return descriptor;
+}
 
-	if (file_descriptor_count == file_descriptor_capacity)
+/** Put the descriptor into the lowest free slot of the table. */
+static int install_descriptor(struct filedesc *descriptor)
+{
+	pthread_mutex_lock(&descriptor_lock);
+	for (int i = descriptor_free_hint; i < MAX_DESCRIPTORS; i++)
 	{
-		int new_capacity = file_descriptor_capacity ? file_descriptor_capacity * 2 : 4;
-		struct filedesc **new_array = realloc(file_descriptors, new_capacity * sizeof(*new_array));
-		if (!new_array)
+		struct filedesc ***chunk_ptr = &descriptor_chunks[i / DESCRIPTOR_CHUNK_SIZE];
+		if (!*chunk_ptr)
 		{
-			free(descriptor);
-			ufs_error_code = UFS_ERR_NO_MEM;
-			return -1;
-		}
-
-		for (int i = file_descriptor_capacity; i < new_capacity; i++)
-			new_array[i] = NULL;
+			struct filedesc **chunk = calloc(DESCRIPTOR_CHUNK_SIZE, sizeof(*chunk));
+			if (!chunk)
+				break;
 
-		file_descriptors = new_array;
-		file_descriptor_capacity = new_capacity;
-	}
+			__atomic_store_n(chunk_ptr, chunk, __ATOMIC_RELEASE);
+		}
 
-	for (int i = 0; i < file_descriptor_capacity; i++)
-	{
-		if (!file_descriptors[i])
+		struct filedesc **slot = &(*chunk_ptr)[i % DESCRIPTOR_CHUNK_SIZE];
+		if (!*slot)
 		{
-			file_descriptors[i] = descriptor;
-			file_descriptor_count++;
+			__atomic_store_n(slot, descriptor, __ATOMIC_RELEASE);
+			descriptor_free_hint = i + 1;
+			descriptor_count++;
+			pthread_mutex_unlock(&descriptor_lock);
 			return i;
 		}
 	}
 
-	free(descriptor);
-	ufs_error_code = UFS_ERR_NO_MEM;
+	pthread_mutex_unlock(&descriptor_lock);
 	return -1;
 }
 
-ssize_t ufs_write(int file_descriptor, const char *buffer, size_t size)
+static struct filedesc *remove_descriptor(int file_descriptor)
 {
-	if (file_descriptor < 0 || file_descriptor >= file_descriptor_capacity ||
-		!file_descriptors[file_descriptor])
+	pthread_mutex_lock(&descriptor_lock);
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (descriptor)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
-	}
+		struct filedesc **chunk = descriptor_chunks[file_descriptor / DESCRIPTOR_CHUNK_SIZE];
+		__atomic_store_n(&chunk[file_descriptor % DESCRIPTOR_CHUNK_SIZE], NULL,
+						 __ATOMIC_RELEASE);
+		if (file_descriptor < descriptor_free_hint)
+			descriptor_free_hint = file_descriptor;
 
-	struct filedesc *descriptor = file_descriptors[file_descriptor];
-	if (!(descriptor->flags & UFS_WRITE_ONLY) && !(descriptor->flags & UFS_READ_WRITE))
-	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
+		descriptor_count--;
 	}
 
-	struct file *file = descriptor->file;
-	update_descriptor_block(descriptor);
+	pthread_mutex_unlock(&descriptor_lock);
+	return descriptor;
+}
+
+/** Unlink the descriptor from its file. The file must be locked exclusively. */
+static void remove_descriptor_from_file(struct filedesc *descriptor)
+{
+	if (descriptor->prev)
+		descriptor->prev->next = descriptor->next;
+	else
+		descriptor->file->descriptors = descriptor->next;
+
+	if (descriptor->next)
+		descriptor->next->prev = descriptor->prev;
+}
+
+/** Find a block for a positional access. Appends hit the last block. */
+static struct block *file_find_block(const struct file *file, size_t offset)
+{
+	size_t index = offset / BLOCK_SIZE;
+	if (index >= file->block_count)
+		return NULL;
+
+	if (index == file->block_count - 1)
+		return file->last_block;
+
+	return find_block_by_offset(file->block_list, offset);
+}
+
+static void update_descriptor_block(struct filedesc *descriptor)
+{
+	if (!descriptor->block || descriptor->offset == 0)
+		descriptor->block = file_find_block(descriptor->file, descriptor->offset);
+}
+
+int ufs_open(const char *filename, int flags)
+{
+	struct namespace_shard *shard = namespace_shard(filename);
+	pthread_mutex_lock(&shard->lock);
+	struct file *file = find_file(shard, filename);
+	if (!file)
+	{
+		if (!(flags & UFS_CREATE))
+		{
+			pthread_mutex_unlock(&shard->lock);
+			ufs_error_code = UFS_ERR_NO_FILE;
+			return -1;
+		}
+
+		file = calloc(1, sizeof(*file));
+		if (!file)
+		{
+			pthread_mutex_unlock(&shard->lock);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+
+		if (image != NULL)
+		{
+			pthread_mutex_lock(&image->lock);
+			file->inode = image_alloc_inode(filename);
+			pthread_mutex_unlock(&image->lock);
+			if (file->inode == IMAGE_BLOCK_END)
+			{
+				pthread_mutex_unlock(&shard->lock);
+				free(file);
+				ufs_error_code = UFS_ERR_NO_MEM;
+				return -1;
+			}
+		}
+
+		file->name = strdup(filename);
+		pthread_rwlock_init(&file->lock, NULL);
+		add_file_to_shard(shard, file);
+	}
+	else if (file->is_lazy && file_load_blocks(file) != 0)
+	{
+		/* Nobody else sees the blocks of a lazy file, it has no descriptors. */
+		pthread_mutex_unlock(&shard->lock);
+		return -1;
+	}
+
+	file->refs++;
+	pthread_mutex_unlock(&shard->lock);
+
+	struct filedesc *descriptor = malloc(sizeof(struct filedesc));
+	if (!descriptor)
+	{
+		file_unref(file);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	descriptor->file = file;
+	descriptor->offset = 0;
+	descriptor->buffer = NULL;
+	descriptor->buffer_size = descriptor->buffer_pos = 0;
+	descriptor->is_prefetched = false;
+	if ((flags & UFS_BUFFERED) &&
+		(descriptor->buffer = malloc(DESCRIPTOR_BUFFER_SIZE)) == NULL)
+	{
+		free(descriptor);
+		file_unref(file);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+
+	int access_flags = flags & ~(UFS_CREATE | UFS_BUFFERED);
+	descriptor->flags = access_flags ? access_flags : UFS_READ_WRITE;
+
+	pthread_rwlock_wrlock(&file->lock);
+	descriptor->block = file->block_list;
+	descriptor->prev = NULL;
+	descriptor->next = file->descriptors;
+	if (file->descriptors)
+		file->descriptors->prev = descriptor;
+
+	file->descriptors = descriptor;
+	pthread_rwlock_unlock(&file->lock);
+
+	int file_descriptor = install_descriptor(descriptor);
+	if (file_descriptor < 0)
+	{
+		pthread_rwlock_wrlock(&file->lock);
+		remove_descriptor_from_file(descriptor);
+		pthread_rwlock_unlock(&file->lock);
+		free(descriptor->buffer);
+		free(descriptor);
+		file_unref(file);
+		ufs_error_code = UFS_ERR_NO_MEM;
+	}
 
+	return file_descriptor;
+}
+
+static bool descriptor_can_write(const struct filedesc *descriptor)
+{
+	if (!(descriptor->flags & UFS_WRITE_ONLY) && !(descriptor->flags & UFS_READ_WRITE))
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return false;
+	}
+
+	return true;
+}
+
+static bool descriptor_can_read(const struct filedesc *descriptor)
+{
+	if (!(descriptor->flags & UFS_READ_ONLY) && !(descriptor->flags & UFS_READ_WRITE))
+	{
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Extend the block list up to the block number @a index. The blocks
+ * in between are holes, the last one gets memory.
+ */
+static struct block *file_append_blocks(struct file *file, size_t index)
+{
+	while (file->block_count <= index)
+	{
+		struct block *block = allocate_block(file->block_count < index);
+		if (!block)
+			return NULL;
+
+		append_block(file, block);
+	}
+
+	/* The block was a part of the implicit hole, so it must read as zeros. */
+	if (index * BLOCK_SIZE < file->size)
+		memset(file->last_block->memory, 0, BLOCK_SIZE);
+
+	return file->last_block;
+}
+
+/**
+ * Grow the file with zeros. Only the tail of the last block needs
+ * clearing, the rest becomes an implicit hole.
+ */
+static void file_grow(struct file *file, size_t new_size)
+{
+	size_t tail = file->size % BLOCK_SIZE;
+	struct block *last = file->last_block;
+	if (tail != 0 && last && last->memory &&
+		file->block_count == (file->size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+		memset(last->memory + tail, 0, BLOCK_SIZE - tail);
+
+	file_set_size(file, new_size);
+}
+
+/**
+ * Write into the file from the position given by @a block_ptr and
+ * @a offset_ptr. The position is advanced by the written size.
+ */
+static ssize_t file_write(struct file *file, struct block **block_ptr, size_t *offset_ptr,
+						  const char *buffer, size_t size)
+{
 	size_t bytes_written = 0;
 	while (bytes_written < size)
 	{
-		if (descriptor->offset >= MAX_FILE_SIZE)
+		if (*offset_ptr >= MAX_FILE_SIZE)
 		{
 			ufs_error_code = UFS_ERR_NO_MEM;
 			return -1;
 		}
 
-		struct block *block = descriptor->block;
+		struct block *block = *block_ptr;
 		if (!block)
 		{
-			block = allocate_block();
+			block = file_append_blocks(file, *offset_ptr / BLOCK_SIZE);
 			if (!block)
 			{
 				ufs_error_code = UFS_ERR_NO_MEM;
 				return -1;
 			}
 
-			append_block(file, block);
-			descriptor->block = block;
+			*block_ptr = block;
+		}
+		else if (!block->memory && block_materialize(file, block, *offset_ptr / BLOCK_SIZE) != 0)
+		{
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
 		}
 
-		size_t block_offset = descriptor->offset % BLOCK_SIZE;
+		size_t block_offset = *offset_ptr % BLOCK_SIZE;
 		size_t to_copy = size - bytes_written < BLOCK_SIZE - block_offset
 							 ? size - bytes_written
 							 : BLOCK_SIZE - block_offset;
 
 		memcpy(block->memory + block_offset, buffer + bytes_written, to_copy);
 
-		int new_occupied = block_offset + to_copy;
-		if (new_occupied > block->occupied)
-			block->occupied = new_occupied;
-
-		descriptor->offset += to_copy;
-		if (descriptor->offset > file->size)
-			file->size = descriptor->offset;
+		*offset_ptr += to_copy;
+		if (*offset_ptr > file->size)
+			file_set_size(file, *offset_ptr);
 
 		bytes_written += to_copy;
 
-		if (descriptor->offset % BLOCK_SIZE == 0)
+		if (*offset_ptr % BLOCK_SIZE == 0)
+			*block_ptr = block->next;
+	}
+
+	return (ssize_t)bytes_written;
+}
+
+/**
+ * Read from the file starting at the position given by @a block_ptr
+ * and @a offset_ptr. The position is advanced by the read size.
+ */
+static ssize_t file_read(const struct file *file, struct block **block_ptr, size_t *offset_ptr,
+						 char *buffer, size_t size)
+{
+	size_t bytes_read = 0;
+	size_t current_offset = *offset_ptr;
+	struct block *block = *block_ptr;
+
+	while (bytes_read < size && current_offset < file->size)
+	{
+		size_t block_offset = current_offset % BLOCK_SIZE;
+		size_t available = BLOCK_SIZE - block_offset;
+		size_t remaining_file = file->size - current_offset;
+		size_t to_copy = available < remaining_file ? available : remaining_file;
+		size_t remaining_buffer = size - bytes_read;
+
+		if (to_copy > remaining_buffer)
+			to_copy = remaining_buffer;
+
+		/* No block means the implicit hole at the end of the file. */
+		if (block && block->memory)
+			memcpy(buffer + bytes_read, block->memory + block_offset, to_copy);
+		else
+			memset(buffer + bytes_read, 0, to_copy);
+
+		current_offset += to_copy;
+		bytes_read += to_copy;
+
+		if (block && block_offset + to_copy >= BLOCK_SIZE)
+			block = block->next;
+	}
+
+	*offset_ptr = current_offset;
+	*block_ptr = block;
+
+	return (ssize_t)bytes_read;
+}
+
+/**
+ * Return the not read prefetched bytes back to the file: move the
+ * descriptor to the first of them. The file must be locked.
+ */
+static void descriptor_drop_prefetch(struct filedesc *descriptor)
+{
+	if (!descriptor->is_prefetched)
+		return;
+
+	struct file *file = descriptor->file;
+	size_t position = descriptor->prefetch_offset + descriptor->buffer_pos;
+	size_t end = descriptor->prefetch_offset + descriptor->buffer_size;
+	if (descriptor->offset != end || position > file->size)
+	{
+		/* Resize has moved the descriptor. */
+		if (position > file->size)
+			position = file->size;
+
+		descriptor->block = NULL;
+	}
+	else
+	{
+		/* Step back over the blocks of the buffer instead of a lookup. */
+		struct block *block = descriptor->block;
+		size_t index = end / BLOCK_SIZE;
+		size_t target = position / BLOCK_SIZE;
+		if (!block && file->block_count > 0 && index >= file->block_count)
 		{
-			if (!block->next)
-			{
-				struct block *new_block = allocate_block();
-				if (!new_block)
-				{
-					ufs_error_code = UFS_ERR_NO_MEM;
-					return -1;
-				}
-
-				block->next = new_block;
-				new_block->prev = block;
-				file->last_block = new_block;
-			}
+			block = file->last_block;
+			index = file->block_count - 1;
+		}
 
-			descriptor->block = block->next;
+		if (block && target <= index)
+		{
+			for (; index > target; index--)
+				block = block->prev;
 		}
+		else
+			block = NULL;
+
+		descriptor->block = block;
 	}
 
-	return (ssize_t)bytes_written;
+	descriptor->offset = position;
+	descriptor->buffer_size = descriptor->buffer_pos = 0;
+	descriptor->is_prefetched = false;
 }
 
-ssize_t ufs_read(int file_descriptor, char *buffer, size_t size)
+/**
+ * Apply the buffered writes or drop the prefetched data. The file
+ * must be locked exclusively if there are buffered writes.
+ */
+static int descriptor_flush_locked(struct filedesc *descriptor)
 {
-	if (file_descriptor < 0 || file_descriptor >= file_descriptor_capacity ||
-		!file_descriptors[file_descriptor])
+	if (descriptor->is_prefetched)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+		descriptor_drop_prefetch(descriptor);
+		return 0;
 	}
 
-	struct filedesc *descriptor = file_descriptors[file_descriptor];
-	if (!(descriptor->flags & UFS_READ_ONLY) && !(descriptor->flags & UFS_READ_WRITE))
+	if (descriptor->buffer == NULL || descriptor->buffer_size == 0)
+		return 0;
+
+	update_descriptor_block(descriptor);
+	ssize_t rc = file_write(descriptor->file, &descriptor->block, &descriptor->offset,
+							descriptor->buffer, descriptor->buffer_size);
+	descriptor->buffer_size = 0;
+	return rc < 0 ? -1 : 0;
+}
+
+/** Flush the buffer before an access which bypasses it. */
+static int descriptor_sync(struct filedesc *descriptor)
+{
+	if (descriptor->buffer == NULL || descriptor->buffer_size == 0)
+		return 0;
+
+	struct file *file = descriptor->file;
+	pthread_rwlock_wrlock(&file->lock);
+	int rc = descriptor_flush_locked(descriptor);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+static ssize_t descriptor_buffered_write(struct filedesc *descriptor, const char *buffer,
+										 size_t size)
+{
+	if (!descriptor->is_prefetched && size <= DESCRIPTOR_BUFFER_SIZE - descriptor->buffer_size)
 	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
+		memcpy(descriptor->buffer + descriptor->buffer_size, buffer, size);
+		descriptor->buffer_size += size;
+		return (ssize_t)size;
 	}
 
 	struct file *file = descriptor->file;
+	ssize_t rc = -1;
+	pthread_rwlock_wrlock(&file->lock);
+	if (descriptor_flush_locked(descriptor) == 0)
+	{
+		if (size >= DESCRIPTOR_BUFFER_SIZE)
+		{
+			update_descriptor_block(descriptor);
+			rc = file_write(file, &descriptor->block, &descriptor->offset, buffer, size);
+		}
+		else
+		{
+			memcpy(descriptor->buffer, buffer, size);
+			descriptor->buffer_size = size;
+			rc = (ssize_t)size;
+		}
+	}
 
-	if (descriptor->offset >= file->size)
-		return 0;
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
 
-	update_descriptor_block(descriptor);
+static ssize_t descriptor_buffered_read(struct filedesc *descriptor, char *buffer, size_t size)
+{
+	if (!descriptor->is_prefetched && descriptor_sync(descriptor) != 0)
+		return -1;
 
 	size_t bytes_read = 0;
-	size_t current_offset = descriptor->offset;
-	struct block *block = descriptor->block;
-
-	while (block && bytes_read < size && current_offset < file->size)
+	while (bytes_read < size)
 	{
-		size_t block_offset = current_offset % BLOCK_SIZE;
-		size_t available = block->occupied > (int)block_offset ? block->occupied - block_offset : 0;
-		size_t remaining_file = file->size - current_offset;
-		size_t to_copy = available < remaining_file ? available : remaining_file;
-		size_t remaining_buffer = size - bytes_read;
+		size_t available = descriptor->buffer_size - descriptor->buffer_pos;
+		if (available > 0)
+		{
+			size_t to_copy = size - bytes_read < available ? size - bytes_read : available;
+			memcpy(buffer + bytes_read, descriptor->buffer + descriptor->buffer_pos, to_copy);
+			descriptor->buffer_pos += to_copy;
+			bytes_read += to_copy;
+			continue;
+		}
 
-		if (to_copy > remaining_buffer)
-			to_copy = remaining_buffer;
+		struct file *file = descriptor->file;
+		ssize_t rc = 0;
+		pthread_rwlock_rdlock(&file->lock);
+		descriptor_drop_prefetch(descriptor);
+		if (descriptor->offset < file->size)
+		{
+			update_descriptor_block(descriptor);
+			if (size - bytes_read >= DESCRIPTOR_BUFFER_SIZE)
+			{
+				/* Big reads go directly. */
+				rc = file_read(file, &descriptor->block, &descriptor->offset,
+							   buffer + bytes_read, size - bytes_read);
+				bytes_read += rc;
+				rc = 0;
+			}
+			else
+			{
+				descriptor->prefetch_offset = descriptor->offset;
+				rc = file_read(file, &descriptor->block, &descriptor->offset,
+							   descriptor->buffer, DESCRIPTOR_BUFFER_SIZE);
+				descriptor->buffer_size = rc;
+				descriptor->is_prefetched = true;
+			}
+		}
 
-		if (to_copy == 0)
+		pthread_rwlock_unlock(&file->lock);
+		if (rc == 0)
 			break;
+	}
 
-		memcpy(buffer + bytes_read, block->memory + block_offset, to_copy);
+	return (ssize_t)bytes_read;
+}
 
-		current_offset += to_copy;
-		bytes_read += to_copy;
+ssize_t ufs_write(int file_descriptor, const char *buffer, size_t size)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_write(descriptor))
+		return -1;
 
-		if (block_offset + to_copy >= BLOCK_SIZE)
-			block = block->next;
+	if (descriptor->buffer != NULL)
+		return descriptor_buffered_write(descriptor, buffer, size);
+
+	struct file *file = descriptor->file;
+	pthread_rwlock_wrlock(&file->lock);
+	update_descriptor_block(descriptor);
+	ssize_t rc = file_write(file, &descriptor->block, &descriptor->offset, buffer, size);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+ssize_t ufs_read(int file_descriptor, char *buffer, size_t size)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_read(descriptor))
+		return -1;
+
+	if (descriptor->buffer != NULL)
+		return descriptor_buffered_read(descriptor, buffer, size);
+
+	struct file *file = descriptor->file;
+	ssize_t rc = 0;
+	pthread_rwlock_rdlock(&file->lock);
+	if (descriptor->offset < file->size)
+	{
+		update_descriptor_block(descriptor);
+		rc = file_read(file, &descriptor->block, &descriptor->offset, buffer, size);
 	}
 
-	descriptor->offset = current_offset;
-	descriptor->block = block;
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
 
-	return (ssize_t)bytes_read;
+ssize_t ufs_writev(int file_descriptor, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_write(descriptor) || descriptor_sync(descriptor) != 0)
+		return -1;
+
+	struct file *file = descriptor->file;
+	ssize_t total = 0;
+	pthread_rwlock_wrlock(&file->lock);
+	update_descriptor_block(descriptor);
+	size_t start = descriptor->offset;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		ssize_t rc = file_write(file, &descriptor->block, &descriptor->offset,
+								iov[i].iov_base, iov[i].iov_len);
+		if (rc < 0)
+		{
+			/* Like writev(2), the written part is reported, not the error. */
+			total = descriptor->offset > start ? (ssize_t)(descriptor->offset - start) : -1;
+			break;
+		}
+
+		total += rc;
+	}
+
+	pthread_rwlock_unlock(&file->lock);
+	return total;
 }
 
-int ufs_close(int file_descriptor)
+ssize_t ufs_readv(int file_descriptor, const struct iovec *iov, int iovcnt)
 {
-	if (file_descriptor < 0 || file_descriptor >= file_descriptor_capacity ||
-		!file_descriptors[file_descriptor])
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_read(descriptor) || descriptor_sync(descriptor) != 0)
+		return -1;
+
+	struct file *file = descriptor->file;
+	ssize_t total = 0;
+	pthread_rwlock_rdlock(&file->lock);
+	if (descriptor->offset < file->size)
 	{
-		ufs_error_code = UFS_ERR_NO_FILE;
+		update_descriptor_block(descriptor);
+		for (int i = 0; i < iovcnt; i++)
+		{
+			ssize_t rc = file_read(file, &descriptor->block, &descriptor->offset,
+								   iov[i].iov_base, iov[i].iov_len);
+			total += rc;
+			if ((size_t)rc < iov[i].iov_len)
+				break;
+		}
+	}
+
+	pthread_rwlock_unlock(&file->lock);
+	return total;
+}
+
+ssize_t ufs_pwrite(int file_descriptor, const char *buffer, size_t size, size_t offset)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_write(descriptor) || descriptor_sync(descriptor) != 0)
+		return -1;
+
+	if (offset > MAX_FILE_SIZE)
+	{
+		ufs_error_code = UFS_ERR_NO_MEM;
 		return -1;
 	}
 
-	struct filedesc *descriptor = file_descriptors[file_descriptor];
 	struct file *file = descriptor->file;
+	pthread_rwlock_wrlock(&file->lock);
+	if (offset > file->size)
+		file_grow(file, offset);
+
+	struct block *block = file_find_block(file, offset);
+	ssize_t rc = file_write(file, &block, &offset, buffer, size);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
 
-	free(descriptor);
-	file_descriptors[file_descriptor] = NULL;
-	file_descriptor_count--;
-	file->refs--;
+ssize_t ufs_pread(int file_descriptor, char *buffer, size_t size, size_t offset)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_read(descriptor) || descriptor_sync(descriptor) != 0)
+		return -1;
 
-	if (file->refs == 0 && file->is_deleted)
+	struct file *file = descriptor->file;
+	ssize_t rc = 0;
+	pthread_rwlock_rdlock(&file->lock);
+	if (offset < file->size)
 	{
-		remove_file_from_list(file);
-		free_file(file);
+		struct block *block = file_find_block(file, offset);
+		rc = file_read(file, &block, &offset, buffer, size);
 	}
 
-	return 0;
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
 }
 
-int ufs_delete(const char *filename)
+ssize_t ufs_read_map(int file_descriptor, size_t size, struct iovec *iov, int *iovcnt)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_read(descriptor) || descriptor_sync(descriptor) != 0)
+		return -1;
+
+	struct file *file = descriptor->file;
+	int count = 0;
+	size_t bytes_mapped = 0;
+	pthread_rwlock_rdlock(&file->lock);
+	if (descriptor->offset < file->size)
+		update_descriptor_block(descriptor);
+
+	/* Holes are mapped to a shared block of zeros. */
+	static const char zero_block[BLOCK_SIZE];
+	struct block *block = descriptor->block;
+	while (bytes_mapped < size && descriptor->offset < file->size)
+	{
+		size_t block_offset = descriptor->offset % BLOCK_SIZE;
+		size_t to_map = file->size - descriptor->offset;
+		if (to_map > BLOCK_SIZE - block_offset)
+			to_map = BLOCK_SIZE - block_offset;
+
+		if (to_map > size - bytes_mapped)
+			to_map = size - bytes_mapped;
+
+		char *memory = block && block->memory ? block->memory : (char *)zero_block;
+		memory += block_offset;
+		/* Blocks of an image are often adjacent. */
+		if (count > 0 && (char *)iov[count - 1].iov_base + iov[count - 1].iov_len == memory)
+			iov[count - 1].iov_len += to_map;
+		else if (count < *iovcnt)
+		{
+			iov[count].iov_base = memory;
+			iov[count].iov_len = to_map;
+			count++;
+		}
+		else
+			break;
+
+		descriptor->offset += to_map;
+		bytes_mapped += to_map;
+		if (block && block_offset + to_map >= BLOCK_SIZE)
+			block = block->next;
+	}
+
+	descriptor->block = block;
+	pthread_rwlock_unlock(&file->lock);
+	*iovcnt = count;
+	return (ssize_t)bytes_mapped;
+}
+
+int ufs_close(int file_descriptor)
 {
-	struct file *file = file_list;
-	while (file && strcmp(file->name, filename) != 0)
-		file = file->next;
+	struct filedesc *descriptor = remove_descriptor(file_descriptor);
+	if (!descriptor)
+		return -1;
+
+	/* Resize walks the descriptors of the file under its exclusive lock. */
+	struct file *file = descriptor->file;
+	pthread_rwlock_wrlock(&file->lock);
+	int rc = descriptor_flush_locked(descriptor);
+	remove_descriptor_from_file(descriptor);
+	pthread_rwlock_unlock(&file->lock);
+	free(descriptor->buffer);
+	free(descriptor);
+	file_unref(file);
+
+	return rc;
+}
 
+int ufs_flush(int file_descriptor)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor)
+		return -1;
+
+	return descriptor_sync(descriptor);
+}
+
+int ufs_delete(const char *filename)
+{
+	struct namespace_shard *shard = namespace_shard(filename);
+	pthread_mutex_lock(&shard->lock);
+	struct file *file = find_file(shard, filename);
 	if (!file)
 	{
+		pthread_mutex_unlock(&shard->lock);
 		ufs_error_code = UFS_ERR_NO_FILE;
 		return -1;
 	}
@@ -434,10 +1479,15 @@ int ufs_delete(const char *filename)
 	if (file->refs > 0)
 	{
 		file->is_deleted = true;
+		if (image != NULL)
+			image->inodes[file->inode].flags |= IMAGE_INODE_DELETED;
+
+		pthread_mutex_unlock(&shard->lock);
 		return 0;
 	}
 
 	remove_file_from_list(file);
+	pthread_mutex_unlock(&shard->lock);
 	free_file(file);
 
 	return 0;
@@ -445,24 +1495,8 @@ int ufs_delete(const char *filename)
 
 #if NEED_RESIZE
 
-int ufs_resize(int file_descriptor, size_t new_size)
+static int file_resize(struct file *file, size_t new_size)
 {
-	if (file_descriptor < 0 || file_descriptor >= file_descriptor_capacity ||
-		!file_descriptors[file_descriptor])
-	{
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
-	}
-
-	struct filedesc *descriptor = file_descriptors[file_descriptor];
-	struct file *file = descriptor->file;
-
-	if (!(descriptor->flags & UFS_WRITE_ONLY) && !(descriptor->flags & UFS_READ_WRITE))
-	{
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
-	}
-
 	if (new_size > MAX_FILE_SIZE)
 	{
 		ufs_error_code = UFS_ERR_NO_MEM;
@@ -472,128 +1506,372 @@ int ufs_resize(int file_descriptor, size_t new_size)
 	// Увеличение размера файла
 	if (new_size > file->size)
 	{
-		size_t to_allocate = new_size - file->size;
-		struct block *last = file->last_block;
+		file_grow(file, new_size);
+		return 0;
+	}
 
-		if (!last)
+	// Уменьшение размера файла
+	size_t block_count = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (block_count < file->block_count)
+	{
+		if (block_count > 0)
 		{
-			last = allocate_block();
-			if (!last)
-			{
-				ufs_error_code = UFS_ERR_NO_MEM;
-				return -1;
-			}
+			struct block *last_needed = find_block_by_offset(file->block_list,
+															 (block_count - 1) * BLOCK_SIZE);
+			struct block *to_free = last_needed->next;
+			last_needed->next = NULL;
+			file->last_block = last_needed;
 
-			file->block_list = file->last_block = last;
+			free_file_blocks(file, to_free);
 		}
-
-		while (to_allocate > 0)
+		else
 		{
-			size_t available = BLOCK_SIZE - last->occupied;
-			size_t to_grow = to_allocate < available ? to_allocate : available;
+			free_file_blocks(file, file->block_list);
 
-			last->occupied += (int)to_grow;
-			file->size += to_grow;
-			to_allocate -= to_grow;
-
-			if (to_allocate > 0)
-			{
-				struct block *new_block = allocate_block();
-				if (!new_block)
-				{
-					ufs_error_code = UFS_ERR_NO_MEM;
-					return -1;
-				}
-
-				last->next = new_block;
-				new_block->prev = last;
-				file->last_block = new_block;
-				last = new_block;
-			}
+			file->block_list = file->last_block = NULL;
 		}
-		return 0;
+
+		file->block_count = block_count;
 	}
 
-	// Уменьшение размера файла
-	struct block *block = file->block_list;
-	struct block *last_needed = NULL;
-	size_t position = 0;
+	file_set_size(file, new_size);
 
-	while (block)
+	// Обновить все дескрипторы файла
+	for (struct filedesc *descriptor = file->descriptors; descriptor; descriptor = descriptor->next)
 	{
-		size_t block_start = position;
-		size_t block_end = position + BLOCK_SIZE;
+		if (descriptor->offset > new_size)
+			descriptor->offset = new_size;
 
-		if (new_size > block_start)
-			last_needed = block;
+		if (descriptor->offset == new_size || file->block_list == NULL)
+			descriptor->block = NULL;
+		else
+			descriptor->block = find_block_by_offset(file->block_list, descriptor->offset);
+	}
 
-		if (block_end >= new_size)
-			break;
+	return 0;
+}
+
+int ufs_resize(int file_descriptor, size_t new_size)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_write(descriptor) || descriptor_sync(descriptor) != 0)
+		return -1;
+
+	struct file *file = descriptor->file;
+	pthread_rwlock_wrlock(&file->lock);
+	int rc = file_resize(file, new_size);
+	pthread_rwlock_unlock(&file->lock);
+	return rc;
+}
+
+#endif
+
+int ufs_punch_hole(int file_descriptor, size_t offset, size_t size)
+{
+	struct filedesc *descriptor = get_descriptor(file_descriptor);
+	if (!descriptor || !descriptor_can_write(descriptor) || descriptor_sync(descriptor) != 0)
+		return -1;
 
-		position = block_end;
+	struct file *file = descriptor->file;
+	pthread_rwlock_wrlock(&file->lock);
+	size_t end = size < file->size - offset ? offset + size : file->size;
+	struct block *block = offset < file->size ? file_find_block(file, offset) : NULL;
+	size_t position = offset;
+	while (block && position < end)
+	{
+		size_t block_offset = position % BLOCK_SIZE;
+		size_t to_clear = end - position < BLOCK_SIZE - block_offset
+							  ? end - position
+							  : BLOCK_SIZE - block_offset;
+		/* Bytes past the file end do not matter, file_grow() clears them. */
+		if (block->memory && block_offset == 0 &&
+			(to_clear == BLOCK_SIZE || position + to_clear == file->size))
+			block_release(file, block);
+		else if (block->memory)
+			memset(block->memory + block_offset, 0, to_clear);
+
+		position += to_clear;
 		block = block->next;
 	}
 
-	if (last_needed)
-	{
-		struct block *to_free = last_needed->next;
-		last_needed->next = NULL;
-		file->last_block = last_needed;
+	pthread_rwlock_unlock(&file->lock);
+	return 0;
+}
 
-		free_file_blocks(to_free);
-	}
-	else
+static size_t align_up(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * Lay out a new image. The image file is freshly truncated, so it is
+ * all zeros, which already means no used inodes and no used blocks.
+ */
+static int image_format(char *memory, size_t size)
+{
+	struct image_super super;
+	memset(&super, 0, sizeof(super));
+	super.magic = IMAGE_MAGIC;
+	super.version = IMAGE_VERSION;
+	super.block_size = BLOCK_SIZE;
+	super.image_size = size;
+	super.inode_count = size / BLOCK_SIZE / IMAGE_BLOCKS_PER_INODE;
+	if (super.inode_count < IMAGE_MIN_INODES)
+		super.inode_count = IMAGE_MIN_INODES;
+
+	super.inode_offset = align_up(sizeof(super), 64);
+	super.link_offset = super.inode_offset +
+						(size_t)super.inode_count * sizeof(struct image_inode);
+	if (super.link_offset + IMAGE_ALIGN >= size)
+		return -1;
+
+	/* Each block costs its data, two links, a position and a bit in the bitmap. */
+	size_t block_count = (size - super.link_offset - IMAGE_ALIGN) * 8 /
+						 (8 * BLOCK_SIZE + 3 * 8 * sizeof(uint32_t) + 1);
+	if (block_count > IMAGE_BLOCK_END - 1)
+		block_count = IMAGE_BLOCK_END - 1;
+
+	while (block_count > 0)
 	{
-		free_file_blocks(file->block_list);
+		size_t table_size = block_count * sizeof(uint32_t);
+		super.prev_link_offset = super.link_offset + table_size;
+		super.position_offset = super.prev_link_offset + table_size;
+		super.bitmap_offset = align_up(super.position_offset + table_size, 8);
+		super.data_offset = align_up(super.bitmap_offset + (block_count + 63) / 64 * 8,
+									 IMAGE_ALIGN);
+		if (super.data_offset + block_count * BLOCK_SIZE <= size)
+			break;
 
-		file->block_list = file->last_block = NULL;
+		block_count--;
 	}
 
-	file->size = new_size;
+	if (block_count == 0)
+		return -1;
+
+	super.block_count = block_count;
+	memcpy(memory, &super, sizeof(super));
+
+	/* Bits past the last block are never free. */
+	uint64_t *bitmap = (uint64_t *)(memory + super.bitmap_offset);
+	if (block_count % 64 != 0)
+		bitmap[block_count / 64] = ~0ULL << (block_count % 64);
+
+	return 0;
+}
+
+/** Check that a table of @a count items lies inside the image and is aligned. */
+static bool image_check_table(uint64_t offset, uint64_t count, uint64_t item_size,
+							  uint64_t align, size_t size)
+{
+	return offset % align == 0 && offset <= size && count * item_size <= size - offset;
+}
+
+static int image_check(const struct image_super *super, size_t size)
+{
+	if (size < sizeof(*super) || super->magic != IMAGE_MAGIC ||
+		super->version != IMAGE_VERSION || super->block_size != BLOCK_SIZE ||
+		super->image_size != size)
+		return -1;
+
+	uint32_t block_count = super->block_count;
+	if (block_count == 0 || block_count >= IMAGE_BLOCK_END || super->inode_offset < sizeof(*super))
+		return -1;
+
+	if (!image_check_table(super->inode_offset, super->inode_count, sizeof(struct image_inode),
+						   8, size) ||
+		!image_check_table(super->link_offset, block_count, sizeof(uint32_t), 4, size) ||
+		!image_check_table(super->prev_link_offset, block_count, sizeof(uint32_t), 4, size) ||
+		!image_check_table(super->position_offset, block_count, sizeof(uint32_t), 4, size) ||
+		!image_check_table(super->bitmap_offset, (block_count + 63) / 64, sizeof(uint64_t), 8,
+						   size) ||
+		!image_check_table(super->data_offset, block_count, BLOCK_SIZE, 1, size))
+		return -1;
+
+	return 0;
+}
 
-	// Обновить все дескрипторы
-	for (int i = 0; i < file_descriptor_capacity; i++)
+/**
+ * Create in-memory files for all the image inodes. Blocks are not
+ * touched, they are attached lazily. Files deleted while being opened
+ * are reclaimed here.
+ */
+static int image_load_files(void)
+{
+	for (uint32_t i = 0; i < image->super->inode_count; i++)
 	{
-		struct filedesc *descriptor = file_descriptors[i];
-		if (descriptor && descriptor->file == file)
+		struct image_inode *inode = &image->inodes[i];
+		if (!(inode->flags & IMAGE_INODE_USED))
+			continue;
+
+		if (inode->flags & IMAGE_INODE_DELETED)
 		{
-			if (descriptor->offset > new_size)
-				descriptor->offset = new_size;
+			image_free_chain(inode->first_block);
+			memset(inode, 0, sizeof(*inode));
+			continue;
+		}
 
-			if (descriptor->offset == new_size || file->block_list == NULL)
-				descriptor->block = NULL;
-			else
-				descriptor->block = find_block_by_offset(file->block_list, descriptor->offset);
+		/* The chain itself is checked on the first open. */
+		uint32_t first = inode->first_block;
+		if (inode->size > MAX_FILE_SIZE ||
+			(first != IMAGE_BLOCK_END && first >= image->super->block_count))
+		{
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+
+		struct file *file = calloc(1, sizeof(*file));
+		if (!file)
+		{
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
 		}
+
+		file->name = strndup(inode->name, IMAGE_NAME_MAX - 1);
+		if (!file->name)
+		{
+			free(file);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+
+		file->size = inode->size;
+		file->inode = i;
+		file->is_lazy = true;
+		pthread_rwlock_init(&file->lock, NULL);
+		add_file_to_shard(namespace_shard(file->name), file);
 	}
 
 	return 0;
 }
 
-#endif
+int ufs_mount(const char *path, size_t size)
+{
+	bool is_empty = descriptor_count == 0;
+	for (int i = 0; i < NAMESPACE_SHARD_COUNT && is_empty; i++)
+		is_empty = namespace_shards[i].file_list == NULL;
+
+	if (image != NULL || !is_empty)
+	{
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+	{
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		goto error_close;
+
+	bool is_new = st.st_size == 0;
+	if (is_new)
+	{
+		if (ftruncate(fd, size) != 0)
+			goto error_close;
+	}
+	else
+		size = st.st_size;
+
+	char *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (memory == MAP_FAILED)
+		goto error_close;
+
+	if (is_new && image_format(memory, size) != 0)
+		goto error_unmap;
+
+	struct image_super *super = (struct image_super *)memory;
+	if (image_check(super, size) != 0)
+		goto error_unmap;
+
+	image = malloc(sizeof(*image));
+	if (!image)
+		goto error_unmap;
+
+	image->fd = fd;
+	pthread_mutex_init(&image->lock, NULL);
+	image->memory = memory;
+	image->size = size;
+	image->super = super;
+	image->inodes = (struct image_inode *)(memory + super->inode_offset);
+	image->links = (uint32_t *)(memory + super->link_offset);
+	image->prev_links = (uint32_t *)(memory + super->prev_link_offset);
+	image->positions = (uint32_t *)(memory + super->position_offset);
+	image->bitmap = (uint64_t *)(memory + super->bitmap_offset);
+	image->data = memory + super->data_offset;
+
+	if (image_load_files() != 0)
+	{
+		ufs_destroy();
+		return -1;
+	}
+
+	return 0;
+
+error_unmap:
+	munmap(memory, size);
+error_close:
+	close(fd);
+	ufs_error_code = UFS_ERR_IO;
+	return -1;
+}
+
+int ufs_checkpoint(void)
+{
+	if (image != NULL && msync(image->memory, image->size, MS_SYNC) != 0)
+	{
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+
+	return 0;
+}
 
 void ufs_destroy(void)
 {
-	for (int i = 0; i < file_descriptor_capacity; i++)
+	for (int c = 0; c < DESCRIPTOR_CHUNK_COUNT && descriptor_chunks[c]; c++)
 	{
-		if (file_descriptors && file_descriptors[i])
+		for (int i = 0; i < DESCRIPTOR_CHUNK_SIZE; i++)
 		{
-			free(file_descriptors[i]);
-			file_descriptors[i] = NULL;
+			if (descriptor_chunks[c][i])
+				free(descriptor_chunks[c][i]->buffer);
+
+			free(descriptor_chunks[c][i]);
 		}
+
+		free(descriptor_chunks[c]);
+		descriptor_chunks[c] = NULL;
 	}
 
-	free(file_descriptors);
-	file_descriptors = NULL;
-	file_descriptor_capacity = file_descriptor_count = 0;
+	descriptor_free_hint = descriptor_count = 0;
 
-	struct file *file = file_list;
-	while (file)
+	for (int i = 0; i < NAMESPACE_SHARD_COUNT; i++)
 	{
-		struct file *next_file = file->next;
-		free_file(file);
-		file = next_file;
+		struct file *file = namespace_shards[i].file_list;
+		while (file)
+		{
+			struct file *next_file = file->next;
+			if (image != NULL && !file->is_deleted)
+				unload_file(file);
+			else
+				free_file(file);
+
+			file = next_file;
+		}
+
+		namespace_shards[i].file_list = NULL;
 	}
 
-	file_list = NULL;
-}
\ No newline at end of file
+	if (image != NULL)
+	{
+		msync(image->memory, image->size, MS_SYNC);
+		munmap(image->memory, image->size);
+		close(image->fd);
+		pthread_mutex_destroy(&image->lock);
+		free(image);
+		image = NULL;
+	}
+}
@@ -1,12 +1,19 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
  * has an unique file name, and there are no directories, so the
  * FS is a monolithic flat contiguous folder.
+ *
+ * All the functions can be called from multiple threads. Different
+ * descriptors, even of the same file, can be used in parallel. Reads
+ * of one file do not block each other, writes are exclusive. One
+ * descriptor must not be used by multiple threads at once. Mount and
+ * destruction must not run in parallel with anything else.
  */
 
 /**
@@ -55,6 +62,14 @@ enum open_flags
 	UFS_READ_WRITE = 8,
 
 #endif
+
+	/**
+	 * Buffer the descriptor. Small writes are collected and applied
+	 * in bulk, reads prefetch the next blocks. The buffered writes
+	 * are not seen by other descriptors until ufs_flush() or
+	 * ufs_close(), and the prefetched data can be stale.
+	 */
+	UFS_BUFFERED = 16,
 };
 
 /** Possible errors from all functions. */
@@ -69,9 +84,10 @@ enum ufs_error_code
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_IO,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error happened in the calling thread. */
 enum ufs_error_code ufs_errno();
 
 /**
@@ -113,11 +129,99 @@ ssize_t ufs_write(int fd, const char *buf, size_t size);
 ssize_t ufs_read(int fd, char *buf, size_t size);
 
 /**
- * Close a file.
+ * Write data from multiple buffers to the file, like ufs_write()
+ * called for each of them in turn.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval >= 0 How many bytes were written. Can be less than the
+ *     total size, if an error occurred after some data was written.
+ * @retval -1 Error occurred before anything was written. The same
+ *     codes as in ufs_write().
+ */
+ssize_t ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data from the file into multiple buffers, filling them one
+ * after another. Stops at the file end.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. The same codes as in ufs_read().
+ */
+ssize_t ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write data to the file at the given offset. The descriptor position
+ * is not used and not changed. If @a offset is beyond the file end,
+ * the gap is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Position in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. The same codes as in ufs_write().
+ */
+ssize_t ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * position is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. The same codes as in ufs_read().
+ */
+ssize_t ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file without copying. Instead of filling a
+ * buffer, @a iov is filled with pointers right to the file blocks,
+ * starting at the descriptor position, which is then advanced like
+ * in ufs_read(). The memory must not be changed. It stays valid until
+ * the file is written, resized, deleted or has a hole punched.
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to map.
+ * @param iov Array to fill.
+ * @param[in,out] iovcnt Capacity of @a iov on input, count of the
+ *     filled items on output.
+ *
+ * @retval > 0 How many bytes were mapped. Can be less than @a size
+ *     when @a iov is full.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. The same codes as in ufs_read().
+ */
+ssize_t ufs_read_map(int fd, size_t size, struct iovec *iov, int *iovcnt);
+
+/**
+ * Apply the buffered writes of a UFS_BUFFERED descriptor and drop
+ * its prefetched data. Does nothing for other descriptors.
+ * @param fd File descriptor from ufs_open().
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory for the buffered data,
+ *       which is dropped then.
+ */
+int ufs_flush(int fd);
+
+/**
+ * Close a file. The buffered writes are flushed.
  * @param fd File descriptor from ufs_open().
  * @retval 0 Success.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - the buffered writes could not be applied.
+ *       The descriptor is closed anyway.
  */
 int ufs_close(int fd);
 
@@ -139,11 +243,13 @@ int ufs_delete(const char *filename);
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
- * changed. If the current size is bigger than @a new_size, then
- * the blocks are truncated. Opened file descriptors behind the
- * new file size should proceed from the new file end.
+ * file size is less than @a new_size, then the file is extended
+ * with zeros and positions of opened file descriptors are not
+ * changed. The extension is sparse: no memory is taken until the
+ * new part is written. If the current size is bigger than
+ * @a new_size, then the blocks are truncated. Opened file
+ * descriptors behind the new file size should proceed from the new
+ * file end.
  *
  * @param fd File descriptor from ufs_open().
  * @param new_size New file size.
@@ -159,6 +265,58 @@ int ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Zero @a size bytes of a file starting from @a offset and release
+ * the memory of the blocks fully inside the range. The file size
+ * and descriptor positions are not changed, the range past the file
+ * end is ignored.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param offset Start of the range.
+ * @param size Size of the range.
+ * @retval 0 Success.
+ * @retval -1 Error occurred.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - descriptor should have been opened with
+ *       UFS_WRITE_ONLY or UFS_READ_WRITE permissions.
+ */
+int ufs_punch_hole(int fd, size_t offset, size_t size);
+
+/**
+ * Mount an image file and keep all the files in it instead of the
+ * heap. The image is a single file mapped into the memory. It
+ * consists of a superblock, an inode table, block link and position
+ * tables, a free-space bitmap and the data blocks. The holes of the
+ * files take no blocks. Mount of an existing image does not read
+ * the data, so it takes the same time regardless of how much is
+ * stored. ufs_destroy() unmounts the image, keeping the files in it.
+ *
+ * @param path Path to the image file. Created if does not exist.
+ * @param size Size of a new image. Ignored when the image exists.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image can not be created or mapped, or it is
+ *       corrupted, or the FS is not empty.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *
+ * In image mode ufs_open() fails with UFS_ERR_NO_MEM when the image
+ * has no free inodes or the file name is too long for an inode, and
+ * with UFS_ERR_IO when the blocks of the file in the image are
+ * corrupted.
+ */
+int ufs_mount(const char *path, size_t size);
+
+/**
+ * Flush all the changes of the mounted image to the disk.
+ * Without a mounted image it does nothing.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - msync() failed.
+ */
+int ufs_checkpoint(void);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
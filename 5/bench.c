@@ -0,0 +1,183 @@
+#include "chat.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <malloc.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Broadcast benchmark. A child process connects the peers. The first
+ * one sends messages, the others do not read at first, so the
+ * messages pile up in the server's output queues. Then the peers
+ * start reading and the queues are flushed. Reported are the server
+ * CPU time of the broadcast, the heap held by the queues and the
+ * speed of the whole delivery. Build with -DCHAT_COPY_OUTPUT to
+ * compare with a copy of each message per peer.
+ *
+ * A loopback socket takes about 1MB before it is full, so the queues
+ * grow only when more than that is sent to each peer.
+ *
+ * Usage: ./bench [peer_count] [msg_size] [msg_count]
+ */
+
+static double
+now(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+peers_drain(int *socks, int count)
+{
+	int ep = epoll_create1(0);
+	for (int i = 0; i < count; ++i) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &socks[i];
+		epoll_ctl(ep, EPOLL_CTL_ADD, socks[i], &ev);
+	}
+	char buf[64 * 1024];
+	struct epoll_event events[256];
+	while (true) {
+		int n = epoll_wait(ep, events, 256, -1);
+		for (int i = 0; i < n; ++i) {
+			int *sock = events[i].data.ptr;
+			while (recv(*sock, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+				;
+		}
+	}
+}
+
+static void
+peers_run(const struct sockaddr_in *addr, int peer_count, uint32_t msg_size,
+	  int msg_count, int ready_fd, int cmd_fd)
+{
+	int *socks = malloc(peer_count * sizeof(socks[0]));
+	for (int i = 0; i < peer_count; ++i) {
+		socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+		/* Small buffers make the server queue the messages itself. */
+		int size = 4096;
+		setsockopt(socks[i], SOL_SOCKET, SO_RCVBUF, &size,
+			   sizeof(size));
+		if (connect(socks[i], (const struct sockaddr *)addr,
+			    sizeof(*addr)) != 0) {
+			perror("connect");
+			exit(-1);
+		}
+	}
+	write(ready_fd, "r", 1);
+	/* Wait until the server accepts all, then send. */
+	char c;
+	read(cmd_fd, &c, 1);
+
+	char *msg = malloc(msg_size + 1);
+	memset(msg, 'm', msg_size);
+	msg[msg_size] = '\n';
+	for (int i = 0; i < msg_count; ++i) {
+		for (uint32_t sent = 0; sent < msg_size + 1;) {
+			ssize_t rc = send(socks[0], msg + sent,
+					  msg_size + 1 - sent, 0);
+			if (rc < 0) {
+				perror("send");
+				exit(-1);
+			}
+			sent += rc;
+		}
+	}
+	read(cmd_fd, &c, 1);
+	peers_drain(socks + 1, peer_count - 1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int peer_count = argc > 1 ? atoi(argv[1]) : 20;
+	uint32_t msg_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+	int msg_count = argc > 3 ? atoi(argv[3]) : 10000;
+	if (peer_count < 2 || msg_size == 0 || msg_count <= 0) {
+		printf("Invalid arguments\n");
+		return -1;
+	}
+	struct chat_server *server = chat_server_new();
+	if (chat_server_listen(server, 0) != 0) {
+		printf("Couldn't listen\n");
+		return -1;
+	}
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(chat_server_get_socket(server), (void *)&addr, &len);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int ready_pipe[2];
+	int cmd_pipe[2];
+	if (pipe(ready_pipe) != 0 || pipe(cmd_pipe) != 0) {
+		perror("pipe");
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		chat_server_delete(server);
+		peers_run(&addr, peer_count, msg_size, msg_count,
+			  ready_pipe[1], cmd_pipe[0]);
+		return 0;
+	}
+	/* Accept everyone until the child says all are connected. */
+	struct pollfd fds[2];
+	fds[0].fd = ready_pipe[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = chat_server_get_descriptor(server);
+	fds[1].events = POLLIN;
+	do {
+		poll(fds, 2, -1);
+		chat_server_update(server, 0);
+	} while (fds[0].revents == 0);
+	char c;
+	read(ready_pipe[0], &c, 1);
+	while (chat_server_update(server, 0) == 0)
+		;
+
+	size_t heap_before = mallinfo2().uordblks;
+	double cpu_start = now(CLOCK_PROCESS_CPUTIME_ID);
+	double start = now(CLOCK_MONOTONIC);
+	write(cmd_pipe[1], "s", 1);
+	for (int received = 0; received < msg_count;) {
+		chat_server_update(server, -1);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(server)) != NULL) {
+			++received;
+			chat_message_delete(msg);
+		}
+	}
+	double cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	size_t heap = mallinfo2().uordblks - heap_before;
+	printf("%d msgs of %u bytes to %d stalled peers: %.3f s CPU, "
+	       "%.1f MB held by output queues\n", msg_count, msg_size,
+	       peer_count - 1, cpu, heap / 1024.0 / 1024);
+
+	write(cmd_pipe[1], "d", 1);
+	while ((chat_server_get_events(server) & CHAT_EVENT_OUTPUT) != 0)
+		chat_server_update(server, -1);
+	double duration = now(CLOCK_MONOTONIC) - start;
+	double total_mb = (double)(peer_count - 1) * msg_count *
+			  (msg_size + 1) / 1024 / 1024;
+	printf("all delivered: %.3f s, %.1f MB/s\n", duration,
+	       total_mb / duration);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	chat_server_delete(server);
+	return 0;
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include "chat.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * The server on epoll or on io_uring, whichever it is built with, on
+ * a load like test_stress scaled up: many clients, each sends its
+ * messages and reads the messages of all the others. A child process
+ * runs the clients. Reported are the messages per second received by
+ * the app, the deliveries per second to the clients, and the system
+ * calls of the server per message: all of them counted by ptrace(),
+ * and the network I/O ones counted by the server itself.
+ *
+ * The system calls are counted in a second run, under ptrace() from
+ * one more child. Tracing slows the server down, so it finds more
+ * data per call than in the first run, for both backends alike.
+ *
+ * Usage: ./bench_backend [client_count] [msg_count] [msg_size]
+ */
+
+struct bench_client {
+	int socket;
+	/** Bytes of the measured messages left to send. */
+	size_t send_left;
+	/** Bytes received, including the hellos. */
+	size_t recv_size;
+	size_t hello_count;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+clients_run(const struct sockaddr_in *addr, int client_count, int msg_count,
+	    uint32_t msg_size, int ready_fd, int cmd_fd)
+{
+	struct bench_client *clients = calloc(client_count, sizeof(*clients));
+	int ep = epoll_create1(0);
+	for (int i = 0; i < client_count; ++i) {
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(sock, (const struct sockaddr *)addr,
+			    sizeof(*addr)) != 0) {
+			perror("connect");
+			exit(-1);
+		}
+		send(sock, "h\n", 2, 0);
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+		clients[i].socket = sock;
+		clients[i].send_left = (size_t)msg_count * (msg_size + 1);
+	}
+	write(ready_fd, "r", 1);
+	char c;
+	read(cmd_fd, &c, 1);
+
+	/* All the messages of a client, it sends them as they fit. */
+	size_t data_size = (size_t)msg_count * (msg_size + 1);
+	char *data = malloc(data_size);
+	memset(data, 'm', data_size);
+	for (int i = 0; i < msg_count; ++i)
+		data[(size_t)i * (msg_size + 1) + msg_size] = '\n';
+	for (int i = 0; i < client_count; ++i) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.ptr = &clients[i];
+		epoll_ctl(ep, EPOLL_CTL_ADD, clients[i].socket, &ev);
+	}
+	size_t expected = (size_t)msg_count * (client_count - 1) *
+			  (msg_size + 1);
+	int done_count = 0;
+	char buf[64 * 1024];
+	struct epoll_event events[256];
+	while (done_count < client_count) {
+		int n = epoll_wait(ep, events, 256, -1);
+		for (int i = 0; i < n; ++i) {
+			struct bench_client *cli = events[i].data.ptr;
+			if ((events[i].events & EPOLLOUT) != 0 &&
+			    cli->send_left > 0) {
+				ssize_t rc = send(cli->socket, data + data_size -
+						  cli->send_left,
+						  cli->send_left, 0);
+				if (rc > 0)
+					cli->send_left -= rc;
+				if (cli->send_left == 0) {
+					struct epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.ptr = cli;
+					epoll_ctl(ep, EPOLL_CTL_MOD,
+						  cli->socket, &ev);
+				}
+			}
+			if ((events[i].events & EPOLLIN) == 0)
+				continue;
+			ssize_t rc;
+			while ((rc = recv(cli->socket, buf, sizeof(buf),
+					  MSG_DONTWAIT)) > 0) {
+				bool was_done = cli->recv_size -
+						2 * cli->hello_count == expected;
+				cli->recv_size += rc;
+				for (char *h = buf; (h = memchr(h, 'h',
+						buf + rc - h)) != NULL; ++h)
+					++cli->hello_count;
+				if (!was_done && cli->recv_size -
+				    2 * cli->hello_count == expected)
+					++done_count;
+			}
+		}
+	}
+	write(ready_fd, "d", 1);
+	/* Keep the sockets until the server is deleted. */
+	read(cmd_fd, &c, 1);
+}
+
+/**
+ * Count the system calls of the process @a pid, from the start until
+ * its getpid(). The start is reported into @a ready_fd, the count
+ * into @a result_fd.
+ */
+static void
+tracer_run(pid_t pid, int ready_fd, int result_fd)
+{
+	if (ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_TRACESYSGOOD) != 0 ||
+	    ptrace(PTRACE_INTERRUPT, pid, 0, 0) != 0) {
+		perror("ptrace");
+		exit(-1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	ptrace(PTRACE_SYSCALL, pid, 0, 0);
+	write(ready_fd, "t", 1);
+	long count = 0;
+	while (waitpid(pid, &status, 0) == pid && WIFSTOPPED(status)) {
+		int sig = WSTOPSIG(status);
+		if (sig == (SIGTRAP | 0x80)) {
+			struct __ptrace_syscall_info info;
+			ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info),
+			       &info);
+			if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				if (info.entry.nr == SYS_getpid) {
+					ptrace(PTRACE_DETACH, pid, 0, 0);
+					break;
+				}
+				++count;
+			}
+			sig = 0;
+		} else if (sig == SIGTRAP || (status >> 16) != 0) {
+			sig = 0;
+		}
+		ptrace(PTRACE_SYSCALL, pid, 0, sig);
+	}
+	write(result_fd, &count, sizeof(count));
+}
+
+/** Pop and count all the messages. */
+static void
+server_drain(struct chat_server *server, long *count)
+{
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(server)) != NULL) {
+		++*count;
+		chat_message_delete(msg);
+	}
+}
+
+/**
+ * Run the server until the pipe is readable and the app gets at least
+ * @a min_count messages.
+ */
+static void
+server_run_until(struct chat_server *server, int fd, long *count,
+		 long min_count)
+{
+	struct pollfd fds[2];
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = chat_server_get_descriptor(server);
+	bool is_signaled = false;
+	while (!is_signaled || *count < min_count) {
+		fds[1].events = chat_events_to_poll_events(
+			chat_server_get_events(server));
+		poll(fds, 2, -1);
+		if (fds[0].revents != 0)
+			is_signaled = true;
+		while (chat_server_update(server, 0) == 0)
+			server_drain(server, count);
+		fds[0].fd = is_signaled ? -1 : fd;
+	}
+	char c;
+	read(fd, &c, 1);
+}
+
+/**
+ * Run the load once. With @a syscalls not NULL the server's system
+ * calls are counted. The I/O ones by the server's statistics go to
+ * @a io_syscalls.
+ */
+static double
+bench_run(int client_count, int msg_count, uint32_t msg_size, long *syscalls,
+	  long *io_syscalls)
+{
+	struct chat_server *server = chat_server_new();
+	if (chat_server_listen(server, 0) != 0) {
+		printf("Couldn't listen\n");
+		exit(-1);
+	}
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(chat_server_get_socket(server), (void *)&addr, &len);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int ready_pipe[2];
+	int cmd_pipe[2];
+	if (pipe(ready_pipe) != 0 || pipe(cmd_pipe) != 0) {
+		perror("pipe");
+		exit(-1);
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		clients_run(&addr, client_count, msg_count, msg_size,
+			    ready_pipe[1], cmd_pipe[0]);
+		exit(0);
+	}
+	/* All are accepted when all the hellos are received. */
+	long received = 0;
+	server_run_until(server, ready_pipe[0], &received, client_count);
+
+	pid_t tracer = -1;
+	int trace_pipe[2];
+	if (syscalls != NULL) {
+		if (pipe(trace_pipe) != 0) {
+			perror("pipe");
+			exit(-1);
+		}
+		pid_t self = getpid();
+		tracer = fork();
+		if (tracer == 0) {
+			tracer_run(self, trace_pipe[1], trace_pipe[1]);
+			exit(0);
+		}
+		char c;
+		read(trace_pipe[0], &c, 1);
+	}
+	received = 0;
+	struct chat_server_stat stat;
+	chat_server_get_stat(server, &stat);
+	*io_syscalls = -stat.syscall_count;
+	double start = now();
+	write(cmd_pipe[1], "s", 1);
+	long total = (long)client_count * msg_count;
+	server_run_until(server, ready_pipe[0], &received, total);
+	double duration = now() - start;
+	chat_server_get_stat(server, &stat);
+	*io_syscalls += stat.syscall_count;
+	if (syscalls != NULL) {
+		/* The end mark for the tracer. */
+		syscall(SYS_getpid);
+		read(trace_pipe[0], syscalls, sizeof(*syscalls));
+		waitpid(tracer, NULL, 0);
+		close(trace_pipe[0]);
+		close(trace_pipe[1]);
+	}
+
+	write(cmd_pipe[1], "e", 1);
+	waitpid(pid, NULL, 0);
+	chat_server_delete(server);
+	close(ready_pipe[0]);
+	close(ready_pipe[1]);
+	close(cmd_pipe[0]);
+	close(cmd_pipe[1]);
+	return duration;
+}
+
+int
+main(int argc, char **argv)
+{
+	int client_count = argc > 1 ? atoi(argv[1]) : 1000;
+	int msg_count = argc > 2 ? atoi(argv[2]) : 2;
+	uint32_t msg_size = argc > 3 ? strtoul(argv[3], NULL, 10) : 1024;
+	if (client_count < 2 || msg_count <= 0 || msg_size == 0) {
+		printf("Invalid arguments\n");
+		return -1;
+	}
+	printf("%s: %d clients, %d msgs of %u bytes each\n",
+	       CHAT_USE_URING ? "io_uring" : "epoll", client_count, msg_count,
+	       msg_size);
+	long total = (long)client_count * msg_count;
+	long io_syscalls;
+	double duration = bench_run(client_count, msg_count, msg_size, NULL,
+				    &io_syscalls);
+	long syscalls;
+	long traced_io_syscalls;
+	bench_run(client_count, msg_count, msg_size, &syscalls,
+		  &traced_io_syscalls);
+	printf("%.0f msgs/s, %.0f deliveries/s, %.2f server syscalls/msg\n",
+	       total / duration, (double)total * (client_count - 1) / duration,
+	       (double)syscalls / total);
+	printf("I/O syscalls/msg by the server's stat: %.2f, %.2f traced\n",
+	       (double)io_syscalls / total, (double)traced_io_syscalls / total);
+	return 0;
+}
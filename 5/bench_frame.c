@@ -0,0 +1,143 @@
+#include "chat.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Speed of cutting the received data into trimmed messages. The data
+ * comes in pieces of a read size, like from a socket. Compared are
+ * chat_input with chat_trim() and the previous way: a memmove() of the
+ * rest of the buffer after each read and isspace() per byte.
+ *
+ * Usage: ./bench_frame [total_mb]
+ */
+
+enum {
+	BENCH_READ_SIZE = 64 * 1024,
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Messages with a space on each side, to be trimmed. */
+static char *
+bench_data_new(size_t msg_size, size_t total, size_t *size)
+{
+	size_t count = total / (msg_size + 1);
+	*size = count * (msg_size + 1);
+	char *data = malloc(*size);
+	memset(data, 'm', *size);
+	for (size_t i = 0; i < count; ++i) {
+		char *msg = data + i * (msg_size + 1);
+		msg[0] = ' ';
+		msg[msg_size - 1] = ' ';
+		msg[msg_size] = '\n';
+	}
+	return data;
+}
+
+static size_t
+bench_input(const char *data, size_t size)
+{
+	struct chat_input in;
+	memset(&in, 0, sizeof(in));
+	size_t sum = 0;
+	for (size_t pos = 0; pos < size; pos += BENCH_READ_SIZE) {
+		size_t part = size - pos < BENCH_READ_SIZE ?
+			      size - pos : BENCH_READ_SIZE;
+		chat_input_reserve(&in, BENCH_READ_SIZE);
+		memcpy(in.buf + in.size, data + pos, part);
+		in.size += part;
+		char *msg;
+		size_t msg_size;
+		while ((msg = chat_input_next(&in, &msg_size)) != NULL) {
+			msg = chat_trim(msg, &msg_size);
+			sum += msg_size;
+		}
+	}
+	chat_input_destroy(&in);
+	return sum;
+}
+
+static size_t
+bench_legacy(const char *data, size_t size)
+{
+	char *buf = NULL;
+	size_t buf_size = 0;
+	size_t capacity = 0;
+	size_t scanned = 0;
+	size_t sum = 0;
+	for (size_t pos = 0; pos < size; pos += BENCH_READ_SIZE) {
+		size_t part = size - pos < BENCH_READ_SIZE ?
+			      size - pos : BENCH_READ_SIZE;
+		if (capacity - buf_size < BENCH_READ_SIZE) {
+			capacity = buf_size + BENCH_READ_SIZE;
+			buf = realloc(buf, capacity);
+		}
+		memcpy(buf + buf_size, data + pos, part);
+		buf_size += part;
+		size_t done = 0;
+		char *end;
+		while ((end = memchr(buf + scanned, '\n',
+				     buf_size - scanned)) != NULL) {
+			char *begin = buf + done;
+			done = end - buf + 1;
+			scanned = done;
+			while (begin < end && isspace((unsigned char)*begin))
+				++begin;
+			while (end > begin && isspace((unsigned char)end[-1]))
+				--end;
+			sum += end - begin;
+		}
+		buf_size -= done;
+		memmove(buf, buf + done, buf_size);
+		scanned = buf_size;
+	}
+	free(buf);
+	return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t total = (argc > 1 ? atoi(argv[1]) : 256) * 1024 * 1024;
+	const size_t msg_sizes[] = {16, 1024, 64 * 1024};
+	for (int i = 0; i < 3; ++i) {
+		size_t size;
+		char *data = bench_data_new(msg_sizes[i], total, &size);
+		/* The best of several runs, the first one warms the heap. */
+		size_t sum = 0;
+		size_t legacy_sum = 0;
+		double input_time = 1e9;
+		double legacy_time = 1e9;
+		for (int run = 0; run < 3; ++run) {
+			double start = now();
+			sum = bench_input(data, size);
+			double t = now() - start;
+			input_time = t < input_time ? t : input_time;
+			start = now();
+			legacy_sum = bench_legacy(data, size);
+			t = now() - start;
+			legacy_time = t < legacy_time ? t : legacy_time;
+		}
+		if (sum != legacy_sum) {
+			printf("Different results: %zu and %zu\n", sum,
+			       legacy_sum);
+			return -1;
+		}
+		double gb = size / 1024.0 / 1024 / 1024;
+		printf("%6zu byte msgs: chat_input %.2f GB/s, "
+		       "memmove and isspace %.2f GB/s\n", msg_sizes[i],
+		       gb / input_time, gb / legacy_time);
+		free(data);
+	}
+	return 0;
+}
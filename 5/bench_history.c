@@ -0,0 +1,143 @@
+#include "chat.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Replay of the history to the late clients. A writer fills the
+ * history of the server, then the readers connect and the server
+ * sends each of them the whole history. Reported are the memory of
+ * the history and the speed of the replay, in messages per second
+ * to all the readers together.
+ *
+ * The server and the readers run in one thread, so the time of the
+ * readers is counted too.
+ *
+ * Usage: ./bench_history [msg_count] [msg_size] [reader_count]
+ */
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+get_rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	long pages = 0;
+	if (f != NULL) {
+		if (fscanf(f, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+static int
+raw_connect(const struct sockaddr_in *addr)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) != 0) {
+		perror("connect");
+		exit(-1);
+	}
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	return sock;
+}
+
+int
+main(int argc, char **argv)
+{
+	int msg_count = argc > 1 ? atoi(argv[1]) : 100000;
+	uint32_t msg_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+	int reader_count = argc > 3 ? atoi(argv[3]) : 1;
+	if (msg_count <= 0 || msg_size == 0 || reader_count <= 0) {
+		printf("Invalid arguments\n");
+		return -1;
+	}
+	printf("%s: history of %d msgs of %u bytes, %d readers\n",
+	       CHAT_USE_URING ? "io_uring" : "epoll", msg_count, msg_size,
+	       reader_count);
+	struct chat_server *server = chat_server_new();
+	chat_server_set_history(server, msg_count, SIZE_MAX);
+	if (chat_server_listen(server, 0) != 0) {
+		printf("Couldn't listen\n");
+		return -1;
+	}
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(chat_server_get_socket(server), (void *)&addr, &len);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	size_t data_size = (size_t)msg_count * (msg_size + 1);
+	char *data = malloc(data_size);
+	memset(data, 'm', data_size);
+	for (int i = 0; i < msg_count; ++i)
+		data[(size_t)i * (msg_size + 1) + msg_size] = '\n';
+	size_t rss = get_rss();
+	int writer = raw_connect(&addr);
+	size_t sent = 0;
+	int received = 0;
+	while (received < msg_count) {
+		if (sent < data_size) {
+			ssize_t rc = send(writer, data + sent, data_size - sent,
+					  0);
+			if (rc > 0)
+				sent += rc;
+		}
+		chat_server_update(server, 0);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(server)) != NULL) {
+			++received;
+			chat_message_delete(msg);
+		}
+	}
+	printf("history takes %.1f MB\n", (get_rss() - rss) / 1e6);
+
+	int *readers = malloc(reader_count * sizeof(readers[0]));
+	size_t *left = malloc(reader_count * sizeof(left[0]));
+	double start = now();
+	for (int i = 0; i < reader_count; ++i) {
+		readers[i] = raw_connect(&addr);
+		left[i] = data_size;
+	}
+	int done_count = 0;
+	char buf[64 * 1024];
+	while (done_count < reader_count) {
+		chat_server_update(server, 0);
+		for (int i = 0; i < reader_count; ++i) {
+			ssize_t rc;
+			while (left[i] > 0 &&
+			       (rc = recv(readers[i], buf, sizeof(buf), 0)) > 0) {
+				left[i] -= rc;
+				if (left[i] == 0)
+					++done_count;
+			}
+		}
+	}
+	double duration = now() - start;
+	double total = (double)msg_count * reader_count;
+	printf("replay %.3f s, %.0f msgs/s, %.1f MB/s\n", duration,
+	       total / duration, total * (msg_size + 1) / duration / 1e6);
+
+	for (int i = 0; i < reader_count; ++i)
+		close(readers[i]);
+	close(writer);
+	free(readers);
+	free(left);
+	free(data);
+	chat_server_delete(server);
+	return 0;
+}
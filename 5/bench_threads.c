@@ -0,0 +1,243 @@
+#include "chat.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Throughput of the server with different counts of threads. A child
+ * process connects the clients, each of them sends its messages and
+ * reads the messages of all the others. Reported are the messages
+ * per second received by the app and the deliveries per second to
+ * the clients, until the last one got everything.
+ *
+ * The clients say "h" first, so the server has accepted all of them
+ * before the measured messages go. The hellos are skipped by the
+ * counting of the received bytes.
+ *
+ * Usage: ./bench_threads [client_count] [msg_count] [max_threads]
+ */
+
+enum {
+	BENCH_MSG_SIZE = 64,
+	/** Messages in one send() of a client. */
+	BENCH_SEND_BATCH = 64,
+};
+
+struct bench_client {
+	int socket;
+	/** Bytes of the measured messages left to send. */
+	size_t send_left;
+	/** Bytes received, including the hellos. */
+	size_t recv_size;
+	size_t hello_count;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+clients_run(const struct sockaddr_in *addr, int client_count, int msg_count,
+	    int ready_fd, int cmd_fd)
+{
+	struct bench_client *clients = calloc(client_count, sizeof(*clients));
+	int ep = epoll_create1(0);
+	for (int i = 0; i < client_count; ++i) {
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(sock, (const struct sockaddr *)addr,
+			    sizeof(*addr)) != 0) {
+			perror("connect");
+			exit(-1);
+		}
+		send(sock, "h\n", 2, 0);
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+		clients[i].socket = sock;
+		clients[i].send_left = (size_t)msg_count *
+				       (BENCH_MSG_SIZE + 1);
+	}
+	write(ready_fd, "r", 1);
+	char c;
+	read(cmd_fd, &c, 1);
+
+	char batch[BENCH_SEND_BATCH * (BENCH_MSG_SIZE + 1)];
+	memset(batch, 'm', sizeof(batch));
+	for (int i = 0; i < BENCH_SEND_BATCH; ++i)
+		batch[i * (BENCH_MSG_SIZE + 1) + BENCH_MSG_SIZE] = '\n';
+	for (int i = 0; i < client_count; ++i) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.ptr = &clients[i];
+		epoll_ctl(ep, EPOLL_CTL_ADD, clients[i].socket, &ev);
+	}
+	size_t expected = (size_t)msg_count * (client_count - 1) *
+			  (BENCH_MSG_SIZE + 1);
+	int done_count = 0;
+	char buf[64 * 1024];
+	struct epoll_event events[256];
+	while (done_count < client_count) {
+		int n = epoll_wait(ep, events, 256, -1);
+		for (int i = 0; i < n; ++i) {
+			struct bench_client *cli = events[i].data.ptr;
+			if ((events[i].events & EPOLLOUT) != 0) {
+				/* Whole messages go from the batch's start. */
+				size_t size = cli->send_left % sizeof(batch);
+				if (size == 0)
+					size = sizeof(batch);
+				size_t offset = sizeof(batch) - size;
+				ssize_t rc = send(cli->socket, batch + offset,
+						  size, 0);
+				if (rc > 0)
+					cli->send_left -= rc;
+				if (cli->send_left == 0) {
+					struct epoll_event ev;
+					ev.events = EPOLLIN;
+					ev.data.ptr = cli;
+					epoll_ctl(ep, EPOLL_CTL_MOD,
+						  cli->socket, &ev);
+				}
+			}
+			if ((events[i].events & EPOLLIN) == 0)
+				continue;
+			ssize_t rc;
+			while ((rc = recv(cli->socket, buf, sizeof(buf),
+					  MSG_DONTWAIT)) > 0) {
+				bool was_done = cli->recv_size -
+						2 * cli->hello_count == expected;
+				cli->recv_size += rc;
+				for (char *h = buf; (h = memchr(h, 'h',
+						buf + rc - h)) != NULL; ++h)
+					++cli->hello_count;
+				if (!was_done && cli->recv_size -
+				    2 * cli->hello_count == expected)
+					++done_count;
+			}
+		}
+	}
+	write(ready_fd, "d", 1);
+	/* Keep the sockets until the server is deleted. */
+	read(cmd_fd, &c, 1);
+}
+
+/** Pop and count all the messages. */
+static void
+server_drain(struct chat_server *server, long *count)
+{
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(server)) != NULL) {
+		++*count;
+		chat_message_delete(msg);
+	}
+}
+
+/**
+ * Run the server until the pipe is readable, if it is not -1, and
+ * the app gets at least @a min_count messages.
+ */
+static void
+server_run_until(struct chat_server *server, int fd, long *count,
+		 long min_count)
+{
+	struct pollfd fds[2];
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = chat_server_get_descriptor(server);
+	bool is_signaled = fd < 0;
+	while (!is_signaled || *count < min_count) {
+		fds[1].events = chat_events_to_poll_events(
+			chat_server_get_events(server));
+		poll(fds, 2, -1);
+		if (fds[0].revents != 0)
+			is_signaled = true;
+		while (chat_server_update(server, 0) == 0)
+			server_drain(server, count);
+		fds[0].fd = is_signaled ? -1 : fd;
+	}
+	char c;
+	if (fd >= 0)
+		read(fd, &c, 1);
+}
+
+static void
+bench_run(int thread_count, int client_count, int msg_count)
+{
+	struct chat_server *server = chat_server_new();
+	chat_server_set_thread_count(server, thread_count);
+	if (chat_server_listen(server, 0) != 0) {
+		printf("Couldn't listen\n");
+		exit(-1);
+	}
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(chat_server_get_socket(server), (void *)&addr, &len);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int ready_pipe[2];
+	int cmd_pipe[2];
+	if (pipe(ready_pipe) != 0 || pipe(cmd_pipe) != 0) {
+		perror("pipe");
+		exit(-1);
+	}
+	/* The child must not print the parent's buffered output again. */
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		clients_run(&addr, client_count, msg_count, ready_pipe[1],
+			    cmd_pipe[0]);
+		exit(0);
+	}
+	/* All are accepted when all the hellos are received. */
+	long received = 0;
+	server_run_until(server, ready_pipe[0], &received, client_count);
+
+	received = 0;
+	double start = now();
+	write(cmd_pipe[1], "s", 1);
+	long total = (long)client_count * msg_count;
+	server_run_until(server, ready_pipe[0], &received, total);
+	double duration = now() - start;
+	printf("%d threads: %.0f msgs/s, %.0f deliveries/s\n",
+	       thread_count, received / duration,
+	       (double)total * (client_count - 1) / duration);
+
+	write(cmd_pipe[1], "e", 1);
+	waitpid(pid, NULL, 0);
+	chat_server_delete(server);
+	close(ready_pipe[0]);
+	close(ready_pipe[1]);
+	close(cmd_pipe[0]);
+	close(cmd_pipe[1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	int client_count = argc > 1 ? atoi(argv[1]) : 20;
+	int msg_count = argc > 2 ? atoi(argv[2]) : 2000;
+	int max_threads = argc > 3 ? atoi(argv[3]) : 4;
+	if (client_count < 2 || msg_count <= 0 || max_threads < 0) {
+		printf("Invalid arguments\n");
+		return -1;
+	}
+	printf("%d clients, %d msgs of %d bytes each, %ld CPUs\n",
+	       client_count, msg_count, BENCH_MSG_SIZE,
+	       sysconf(_SC_NPROCESSORS_ONLN));
+	for (int threads = 0; threads <= max_threads;
+	     threads = threads == 0 ? 1 : threads * 2)
+		bench_run(threads, client_count, msg_count);
+	return 0;
+}
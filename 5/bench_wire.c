@@ -0,0 +1,245 @@
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * The text protocol against the binary one. A child process runs the
+ * clients: one sends the messages, the others receive them. Reported
+ * are the TCP payload bytes per message sent to the server and per
+ * message delivered to a receiver, and the CPU time per message of
+ * the server and of all the clients.
+ *
+ * Usage: ./bench_wire [receiver_count] [msg_size] [msg_count]
+ */
+
+enum {
+	/** Messages fed to the sender at once, when it has sent the rest. */
+	BENCH_FEED_BATCH = 16,
+};
+
+/** What the clients report to the parent. */
+struct bench_result {
+	double cpu;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+};
+
+static double
+now(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Add the payload bytes sent and received by the client's socket. */
+static void
+client_add_bytes(struct chat_client *cli, uint64_t *sent, uint64_t *received)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	getsockopt(chat_client_get_descriptor(cli), IPPROTO_TCP, TCP_INFO,
+		   &info, &len);
+	*sent += info.tcpi_bytes_acked;
+	*received += info.tcpi_bytes_received;
+}
+
+static void
+clients_run(const char *addr, enum chat_protocol protocol,
+	    int receiver_count, uint32_t msg_size, int msg_count,
+	    int ready_fd, int cmd_fd)
+{
+	int count = receiver_count + 1;
+	struct chat_client **clis = malloc(count * sizeof(clis[0]));
+	struct pollfd *fds = malloc(count * sizeof(fds[0]));
+	for (int i = 0; i < count; ++i) {
+		clis[i] = chat_client_new(i == 0 ? "sender" : "receiver");
+		chat_client_set_protocol(clis[i], protocol);
+		if (chat_client_connect(clis[i], addr) != 0) {
+			perror("connect");
+			exit(-1);
+		}
+		fds[i].fd = chat_client_get_descriptor(clis[i]);
+	}
+	/* Send the hellos before the start. */
+	for (int i = 0; i < count; ++i) {
+		while ((chat_client_get_events(clis[i]) &
+			CHAT_EVENT_OUTPUT) != 0)
+			chat_client_update(clis[i], -1);
+	}
+	write(ready_fd, "r", 1);
+	char c;
+	read(cmd_fd, &c, 1);
+
+	char *batch = malloc(BENCH_FEED_BATCH * (msg_size + 1));
+	memset(batch, 'm', BENCH_FEED_BATCH * (msg_size + 1));
+	for (int i = 0; i < BENCH_FEED_BATCH; ++i)
+		batch[i * (msg_size + 1) + msg_size] = '\n';
+	double cpu_start = now(CLOCK_PROCESS_CPUTIME_ID);
+	int fed = 0;
+	int done_count = 0;
+	int *received = calloc(count, sizeof(received[0]));
+	while (done_count < receiver_count) {
+		struct chat_client *sender = clis[0];
+		if (fed < msg_count && (chat_client_get_events(sender) &
+					CHAT_EVENT_OUTPUT) == 0) {
+			int n = msg_count - fed < BENCH_FEED_BATCH ?
+				msg_count - fed : BENCH_FEED_BATCH;
+			chat_client_feed(sender, batch, n * (msg_size + 1));
+			fed += n;
+		}
+		for (int i = 0; i < count; ++i) {
+			fds[i].events = chat_events_to_poll_events(
+				chat_client_get_events(clis[i]));
+		}
+		poll(fds, count, -1);
+		for (int i = 0; i < count; ++i) {
+			if (fds[i].revents == 0)
+				continue;
+			if (chat_client_update(clis[i], 0) == CHAT_ERR_SYS) {
+				perror("update");
+				exit(-1);
+			}
+			struct chat_message *msg;
+			while ((msg = chat_client_pop_next(clis[i])) != NULL) {
+				chat_message_delete(msg);
+				if (++received[i] == msg_count)
+					++done_count;
+			}
+		}
+	}
+	struct bench_result res;
+	memset(&res, 0, sizeof(res));
+	res.cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	uint64_t unused = 0;
+	client_add_bytes(clis[0], &res.bytes_up, &unused);
+	for (int i = 1; i < count; ++i)
+		client_add_bytes(clis[i], &unused, &res.bytes_down);
+	write(ready_fd, &res, sizeof(res));
+	/* Keep the connections until the server is deleted. */
+	read(cmd_fd, &c, 1);
+}
+
+/** Pop and count all the messages. */
+static void
+server_drain(struct chat_server *server, long *count)
+{
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(server)) != NULL) {
+		++*count;
+		chat_message_delete(msg);
+	}
+}
+
+/** Run the server until the pipe is readable. */
+static void
+server_run_until(struct chat_server *server, int fd, long *count)
+{
+	struct pollfd fds[2];
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = chat_server_get_descriptor(server);
+	fds[0].revents = 0;
+	while (fds[0].revents == 0) {
+		fds[1].events = chat_events_to_poll_events(
+			chat_server_get_events(server));
+		poll(fds, 2, -1);
+		while (chat_server_update(server, 0) == 0)
+			server_drain(server, count);
+	}
+}
+
+static void
+bench_run(enum chat_protocol protocol, int receiver_count, uint32_t msg_size,
+	  int msg_count)
+{
+	struct chat_server *server = chat_server_new();
+	if (chat_server_listen(server, 0) != 0) {
+		printf("Couldn't listen\n");
+		exit(-1);
+	}
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(chat_server_get_socket(server), (void *)&addr, &len);
+	char addr_str[64];
+	sprintf(addr_str, "127.0.0.1:%u", ntohs(addr.sin_port));
+
+	int ready_pipe[2];
+	int cmd_pipe[2];
+	if (pipe(ready_pipe) != 0 || pipe(cmd_pipe) != 0) {
+		perror("pipe");
+		exit(-1);
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		clients_run(addr_str, protocol, receiver_count, msg_size,
+			    msg_count, ready_pipe[1], cmd_pipe[0]);
+		exit(0);
+	}
+	long received = 0;
+	server_run_until(server, ready_pipe[0], &received);
+	char c;
+	read(ready_pipe[0], &c, 1);
+	/* The hellos are sent, accept and answer them before the start. */
+	while (chat_server_update(server, 0) == 0)
+		;
+
+	double cpu_start = now(CLOCK_PROCESS_CPUTIME_ID);
+	write(cmd_pipe[1], "s", 1);
+	server_run_until(server, ready_pipe[0], &received);
+	double cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	struct bench_result res;
+	read(ready_pipe[0], &res, sizeof(res));
+	if (received != msg_count) {
+		printf("Server got %ld messages instead of %d\n", received,
+		       msg_count);
+		exit(-1);
+	}
+	long deliveries = (long)msg_count * receiver_count;
+	printf("%-6s: %5.1f B/msg up, %5.1f B/msg down, server %.3f us/msg, "
+	       "clients %.3f us/msg\n",
+	       protocol == CHAT_PROTOCOL_TEXT ? "text" : "binary",
+	       (double)res.bytes_up / msg_count,
+	       (double)res.bytes_down / deliveries, cpu * 1e6 / msg_count,
+	       res.cpu * 1e6 / msg_count);
+
+	write(cmd_pipe[1], "e", 1);
+	waitpid(pid, NULL, 0);
+	chat_server_delete(server);
+	close(ready_pipe[0]);
+	close(ready_pipe[1]);
+	close(cmd_pipe[0]);
+	close(cmd_pipe[1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	int receiver_count = argc > 1 ? atoi(argv[1]) : 10;
+	uint32_t msg_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+	int msg_count = argc > 3 ? atoi(argv[3]) : 200000;
+	if (receiver_count < 1 || msg_size == 0 || msg_count <= 0) {
+		printf("Invalid arguments\n");
+		return -1;
+	}
+	printf("%d receivers, %d msgs of %u bytes\n", receiver_count,
+	       msg_count, msg_size);
+	bench_run(CHAT_PROTOCOL_TEXT, receiver_count, msg_size, msg_count);
+	bench_run(CHAT_PROTOCOL_BINARY, receiver_count, msg_size, msg_count);
+	return 0;
+}
@@ -2,11 +2,28 @@
 
 #include <poll.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct chat_message *
+chat_message_new(const char *data, uint32_t size)
+{
+	struct chat_message *msg = malloc(sizeof(*msg) + size + 1);
+	if (msg == NULL)
+		abort();
+	msg->data = (char *)(msg + 1);
+	memcpy(msg->data, data, size);
+	msg->data[size] = 0;
+	msg->next = NULL;
+	return msg;
+}
 
 void
 chat_message_delete(struct chat_message *msg)
 {
-	free(msg->data);
 	free(msg);
 }
 
@@ -20,3 +37,192 @@ chat_events_to_poll_events(int mask)
 		res |= POLLOUT;
 	return res;
 }
+
+void
+chat_input_destroy(struct chat_input *in)
+{
+	free(in->buf);
+	in->buf = NULL;
+	in->pos = 0;
+	in->size = 0;
+	in->capacity = 0;
+	in->scanned = 0;
+	in->mask = 0;
+}
+
+void
+chat_input_reserve(struct chat_input *in, size_t size)
+{
+	if (in->mask != 0) {
+		/* Forget the found '\n', they are found again after a move. */
+		in->scanned = in->mask_pos + __builtin_ctzll(in->mask);
+		in->mask = 0;
+	}
+	if (in->capacity - in->size >= size)
+		return;
+	if (in->pos > 0) {
+		/* Only an incomplete message is left, move it. */
+		in->size -= in->pos;
+		in->scanned -= in->pos;
+		memmove(in->buf, in->buf + in->pos, in->size);
+		in->pos = 0;
+		if (in->capacity - in->size >= size)
+			return;
+	}
+	size_t capacity = in->capacity * 2;
+	if (capacity < in->size + size)
+		capacity = in->size + size;
+	in->buf = realloc(in->buf, capacity);
+	if (in->buf == NULL)
+		abort();
+	in->capacity = capacity;
+}
+
+#if defined(__SSE2__)
+
+/** Mask of the '\n' in 64 bytes, a bit per byte. */
+static inline uint64_t
+chat_newline_mask(const char *pos)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	uint64_t mask = 0;
+	for (int i = 0; i < 4; ++i) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(pos + i * 16));
+		uint64_t bits = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		mask |= bits << (i * 16);
+	}
+	return mask;
+}
+
+#endif
+
+bool
+chat_input_scan(struct chat_input *in)
+{
+	size_t left = in->size - in->scanned;
+#if defined(__SSE2__)
+	/*
+	 * A block at once gives all the short messages in it. Then the
+	 * messages are cut without a search each.
+	 */
+	if (left >= 64) {
+		in->mask = chat_newline_mask(in->buf + in->scanned);
+		in->mask_pos = in->scanned;
+		in->scanned += 64;
+		if (in->mask != 0)
+			return true;
+		left -= 64;
+	}
+#endif
+	/* A long message, memchr() is vectorized by libc the widest way. */
+	char *end = memchr(in->buf + in->scanned, '\n', left);
+	if (end != NULL) {
+		in->mask = 1;
+		in->mask_pos = end - in->buf;
+		in->scanned = in->mask_pos + 1;
+		return true;
+	}
+	in->scanned = in->size;
+	if (in->pos == in->size) {
+		/* Nothing to keep, the next read goes to the start. */
+		in->pos = 0;
+		in->size = 0;
+		in->scanned = 0;
+	}
+	return false;
+}
+
+char *
+chat_input_next_frame(struct chat_input *in, size_t max_size, size_t *size)
+{
+	*size = 0;
+	size_t left = in->size - in->pos;
+	if (left < CHAT_FRAME_HEAD_SIZE)
+		goto incomplete;
+	const uint8_t *head = (const uint8_t *)in->buf + in->pos;
+	uint32_t frame_size = head[0] | head[1] << 8 | head[2] << 16 |
+			      (uint32_t)head[3] << 24;
+	if (frame_size > max_size) {
+		*size = frame_size;
+		return NULL;
+	}
+	if (left - CHAT_FRAME_HEAD_SIZE < frame_size)
+		goto incomplete;
+	char *begin = in->buf + in->pos + CHAT_FRAME_HEAD_SIZE;
+	in->pos += CHAT_FRAME_HEAD_SIZE + frame_size;
+	in->scanned = in->pos;
+	*size = frame_size;
+	return begin;
+
+incomplete:
+	if (in->pos == in->size) {
+		in->pos = 0;
+		in->size = 0;
+		in->scanned = 0;
+	}
+	return NULL;
+}
+
+void
+chat_author_map_destroy(struct chat_author_map *map)
+{
+	for (uint32_t i = 0; i < map->capacity; ++i)
+		free(map->names[i]);
+	free(map->keys);
+	free(map->names);
+	memset(map, 0, sizeof(*map));
+}
+
+/** Slot of the ID or of the free place for it. */
+static inline uint32_t
+chat_author_map_find(const struct chat_author_map *map, uint32_t key)
+{
+	uint32_t mask = map->capacity - 1;
+	uint32_t pos = (key * 2654435761u) & mask;
+	while (map->keys[pos] != 0 && map->keys[pos] != key)
+		pos = (pos + 1) & mask;
+	return pos;
+}
+
+bool
+chat_author_map_get(const struct chat_author_map *map, uint32_t id,
+		    const char **name)
+{
+	if (map->count == 0)
+		return false;
+	uint32_t pos = chat_author_map_find(map, id + 1);
+	if (map->keys[pos] == 0)
+		return false;
+	if (name != NULL)
+		*name = map->names[pos];
+	return true;
+}
+
+void
+chat_author_map_put(struct chat_author_map *map, uint32_t id, char *name)
+{
+	if ((map->count + 1) * 2 > map->capacity) {
+		struct chat_author_map old = *map;
+		map->capacity = old.capacity == 0 ? 16 : old.capacity * 2;
+		map->keys = calloc(map->capacity, sizeof(map->keys[0]));
+		map->names = calloc(map->capacity, sizeof(map->names[0]));
+		if (map->keys == NULL || map->names == NULL)
+			abort();
+		for (uint32_t i = 0; i < old.capacity; ++i) {
+			if (old.keys[i] == 0)
+				continue;
+			uint32_t pos = chat_author_map_find(map, old.keys[i]);
+			map->keys[pos] = old.keys[i];
+			map->names[pos] = old.names[i];
+		}
+		free(old.keys);
+		free(old.names);
+	}
+	uint32_t pos = chat_author_map_find(map, id + 1);
+	if (map->keys[pos] == 0) {
+		map->keys[pos] = id + 1;
+		++map->count;
+	}
+	free(map->names[pos]);
+	map->names[pos] = name;
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 /**
  * Here you should specify which features do you want to implement via macros:
  * If you want to enable author name support, do:
@@ -16,6 +20,15 @@
 #define NEED_AUTHOR 0
 #define NEED_SERVER_FEED 0
 
+/**
+ * The server and the client run their sockets on io_uring instead of
+ * epoll and poll(), when built with CHAT_USE_URING=1 (make URING=1).
+ * The API is the same, the descriptor to wait on is the ring's.
+ */
+#ifndef CHAT_USE_URING
+#define CHAT_USE_URING 0
+#endif
+
 enum chat_errcode {
 	CHAT_ERR_INVALID_ARGUMENT = 1,
 	CHAT_ERR_TIMEOUT,
@@ -32,6 +45,49 @@ enum chat_events {
 	CHAT_EVENT_OUTPUT = 2,
 };
 
+/**
+ * Wire protocol of a client. The text one sends messages delimited
+ * by '\n'. The binary one is negotiated with a hello: the client
+ * sends
+ *
+ *     0, version, varint name size, name
+ *
+ * and the server answers with 0, version. A text message can't be
+ * the first thing sent, if it starts with 0. Then both sides send
+ * frames: a 4 byte little-endian size and the records. A frame of
+ * the client takes up to CHAT_CLIENT_FRAME_MAX bytes. The records
+ * of the client are
+ *
+ *     varint size, message
+ *
+ * The records of the server are
+ *
+ *     varint id << 1, varint size, message
+ *     varint id << 1 | 1, varint size, author name
+ *
+ * The second one defines the author of the ID, once per connection
+ * before the first message of the author. So the names are not sent
+ * with each message, and no byte of the messages is searched for the
+ * delimiters.
+ */
+enum chat_protocol {
+	CHAT_PROTOCOL_TEXT,
+	CHAT_PROTOCOL_BINARY,
+};
+
+enum {
+	CHAT_BINARY_VERSION = 1,
+	/** Size of the size of a binary frame. */
+	CHAT_FRAME_HEAD_SIZE = 4,
+	/** Max size of an ID and a size of a record, as varints. */
+	CHAT_RECORD_HEAD_MAX = 10,
+	/**
+	 * Max size of a frame of a client. The server closes a client
+	 * sending a bigger one, instead of buffering it whole.
+	 */
+	CHAT_CLIENT_FRAME_MAX = 64 * 1024 * 1024,
+};
+
 struct chat_message {
 #if NEED_AUTHOR
 	/** Author's name. */
@@ -39,10 +95,17 @@ struct chat_message {
 #endif
 	/** 0-terminate text. */
 	char *data;
-
-	/* PUT HERE OTHER MEMBERS */
+	/** Next message in a queue of received messages. */
+	struct chat_message *next;
 };
 
+/**
+ * Create a message with a copy of @a size bytes of @a data. The text
+ * is stored in the same allocation as the message.
+ */
+struct chat_message *
+chat_message_new(const char *data, uint32_t size);
+
 /** Free message's memory. */
 void
 chat_message_delete(struct chat_message *msg);
@@ -50,3 +113,185 @@ chat_message_delete(struct chat_message *msg);
 /** Convert chat_events mask to events suitable for poll(). */
 int
 chat_events_to_poll_events(int mask);
+
+/**
+ * Input of a connection, cut into messages by '\n'. The data is read
+ * right into the buffer and the messages are returned as its slices.
+ * Only an incomplete message at the end of the buffer is moved to
+ * its beginning, when there is no space for the next read. So a
+ * message is copied only when it straddles reads.
+ */
+struct chat_input {
+	char *buf;
+	/** Start of the first message not returned yet. */
+	size_t pos;
+	/** End of the received data. */
+	size_t size;
+	size_t capacity;
+	/** Data up to here is searched for '\n'. */
+	size_t scanned;
+	/**
+	 * The found '\n' not returned yet, a bit per byte starting from
+	 * mask_pos. The search goes by blocks, so several short messages
+	 * are found at once.
+	 */
+	uint64_t mask;
+	size_t mask_pos;
+};
+
+/** Free the input's buffer. */
+void
+chat_input_destroy(struct chat_input *in);
+
+/**
+ * Ensure at least @a size free bytes after in->size to read into.
+ * The slices returned before become invalid.
+ */
+void
+chat_input_reserve(struct chat_input *in, size_t size);
+
+/**
+ * Search for the next '\n' in the input and put it into the mask.
+ *
+ * @retval true Found.
+ * @retval false No complete messages.
+ */
+bool
+chat_input_scan(struct chat_input *in);
+
+/**
+ * Cut the next complete message out of the input. Inline, because it
+ * is called for each message, and usually only takes a bit of the
+ * mask.
+ *
+ * @param in Input.
+ * @param[out] size Size of the message without '\n'.
+ *
+ * @retval not-NULL Start of the message in the input's buffer.
+ * @retval NULL No complete messages.
+ */
+static inline char *
+chat_input_next(struct chat_input *in, size_t *size)
+{
+	if (in->mask == 0 && !chat_input_scan(in))
+		return NULL;
+	char *end = in->buf + in->mask_pos + __builtin_ctzll(in->mask);
+	in->mask &= in->mask - 1;
+	char *begin = in->buf + in->pos;
+	*size = end - begin;
+	in->pos = end - in->buf + 1;
+	return begin;
+}
+
+/**
+ * Cut the next complete binary frame out of the input.
+ *
+ * @param in Input.
+ * @param max_size Max size of a frame without its head.
+ * @param[out] size Size of the frame without its head. When NULL is
+ *     returned, it is the size of a frame above @a max_size, or 0.
+ *
+ * @retval not-NULL Start of the records of the frame.
+ * @retval NULL No complete frames, or the next one is too big.
+ */
+char *
+chat_input_next_frame(struct chat_input *in, size_t max_size, size_t *size);
+
+/**
+ * Encode @a value as a varint, 7 bits per byte, the lowest first.
+ *
+ * @return Position after the varint.
+ */
+static inline char *
+chat_varint_encode(char *pos, uint32_t value)
+{
+	while (value >= 0x80) {
+		*pos++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*pos++ = (char)value;
+	return pos;
+}
+
+/**
+ * Decode a varint, not reading past @a end.
+ *
+ * @retval not-NULL Position after the varint.
+ * @retval NULL The varint is incomplete or too long.
+ */
+static inline const char *
+chat_varint_decode(const char *pos, const char *end, uint32_t *value)
+{
+	uint32_t res = 0;
+	for (int shift = 0; pos < end && shift < 35; shift += 7) {
+		uint8_t byte = *pos++;
+		res |= (uint32_t)(byte & 0x7f) << shift;
+		if (byte < 0x80) {
+			*value = res;
+			return pos;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Map of the author IDs to their names, an open addressing hash
+ * table. The server keeps there the authors known by a peer, without
+ * names.
+ */
+struct chat_author_map {
+	/** IDs plus 1, 0 for a free slot. */
+	uint32_t *keys;
+	char **names;
+	uint32_t count;
+	/** A power of 2. */
+	uint32_t capacity;
+};
+
+/** Free the map and the names in it. */
+void
+chat_author_map_destroy(struct chat_author_map *map);
+
+/**
+ * Find the author.
+ *
+ * @retval true Found, @a name is set if not NULL.
+ * @retval false Not found.
+ */
+bool
+chat_author_map_get(const struct chat_author_map *map, uint32_t id,
+		    const char **name);
+
+/** Add or replace the author. The map takes the name, can be NULL. */
+void
+chat_author_map_put(struct chat_author_map *map, uint32_t id, char *name);
+
+/** Check if the character is isspace() in the "C" locale. */
+static inline bool
+chat_is_space(char c)
+{
+	return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+/**
+ * Trim isspace() characters on both sides of the message. Inline and
+ * without a call of isspace() for each character, since most of the
+ * messages have at most one space on the ends.
+ *
+ * @param data Message.
+ * @param[in][out] size Size of the message.
+ *
+ * @return Start of the trimmed message.
+ */
+static inline char *
+chat_trim(char *data, size_t *size)
+{
+	char *begin = data;
+	char *end = data + *size;
+	while (begin < end && chat_is_space(*begin))
+		++begin;
+	while (end > begin && chat_is_space(end[-1]))
+		--end;
+	*size = end - begin;
+	return begin;
+}
@@ -1,81 +1,618 @@
 #include "chat.h"
 #include "chat_client.h"
+#if CHAT_USE_URING
+#include "chat_uring.h"
+#endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+enum {
+	/** Free space ensured in the input buffer before each read. */
+	CHAT_CLIENT_READ_SIZE = 64 * 1024,
+#if CHAT_USE_URING
+	/** Provided buffers of the ring for the receive. */
+	CHAT_CLIENT_BUF_COUNT = 8,
+	CHAT_CLIENT_BUF_SIZE = 16 * 1024,
+#endif
+};
+
+#if CHAT_USE_URING
+/** Operations of the client, the tag in the low bits of the user_data. */
+enum chat_client_op {
+	CHAT_CLIENT_OP_RECV = 1,
+	CHAT_CLIENT_OP_SEND,
+	CHAT_CLIENT_OP_MASK = 7,
+};
+#endif
+
 struct chat_client {
 	/** Socket connected to the server. */
 	int socket;
-	/** Array of received messages. */
-	/* ... */
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Received messages. */
+	struct chat_message *msg_first;
+	struct chat_message *msg_last;
+	/** Received data not yet cut into messages. */
+	struct chat_input input;
+	/** Output buffer. Bytes from out_pos to out_size are not sent. */
+	char *out_buf;
+	size_t out_pos;
+	size_t out_size;
+	size_t out_capacity;
+	enum chat_protocol protocol;
+	/** The server has answered the binary hello, the input is frames. */
+	bool is_binary_input;
+	/** Name for the binary hello. */
+	char *name;
+	/** Fed data not yet cut into messages, in the binary protocol. */
+	struct chat_input feed;
+	/**
+	 * Start of the last frame in the output buffer, while it is not
+	 * sent and can take more records. SIZE_MAX if there is none.
+	 */
+	size_t frame_pos;
+	/** Names of the authors defined by the server. */
+	struct chat_author_map authors;
+#if CHAT_USE_URING
+	/** Ring with the receive and the sends, its descriptor is polled. */
+	struct chat_uring ring;
+	/** The multishot receive is not complete. */
+	bool is_recv_armed;
+	/**
+	 * Buffer being sent by the ring. It is swapped with the output
+	 * buffer for the send, so the new output never moves the data
+	 * the kernel is sending.
+	 */
+	char *send_buf;
+	size_t send_pos;
+	size_t send_size;
+	size_t send_capacity;
+	bool is_sending;
+#endif
 };
 
 struct chat_client *
 chat_client_new(const char *name)
 {
-	/* Ignore 'name' param if don't want to support it for +5 points. */
-	(void)name;
-
 	struct chat_client *client = calloc(1, sizeof(*client));
+	if (client == NULL)
+		abort();
 	client->socket = -1;
-
-	/* IMPLEMENT THIS FUNCTION */
-
+	client->name = strdup(name != NULL ? name : "");
+	if (client->name == NULL)
+		abort();
+	client->frame_pos = SIZE_MAX;
+#if CHAT_USE_URING
+	client->ring.fd = -1;
+#endif
 	return client;
 }
 
 void
 chat_client_delete(struct chat_client *client)
 {
+#if CHAT_USE_URING
+	chat_uring_destroy(&client->ring);
+	free(client->send_buf);
+#endif
 	if (client->socket >= 0)
 		close(client->socket);
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(client)) != NULL)
+		chat_message_delete(msg);
+	chat_input_destroy(&client->input);
+	chat_input_destroy(&client->feed);
+	chat_author_map_destroy(&client->authors);
+	free(client->out_buf);
+	free(client->name);
+	free(client);
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+int
+chat_client_set_protocol(struct chat_client *client,
+			 enum chat_protocol protocol)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	client->protocol = protocol;
+	return 0;
+}
 
-	free(client);
+/**
+ * Ensure @a size free bytes in the end of the output buffer.
+ *
+ * @return Position to append at.
+ */
+static char *
+chat_client_reserve_output(struct chat_client *client, size_t size)
+{
+	if (client->out_size + size > client->out_capacity &&
+	    client->out_pos > 0) {
+		/* Drop the sent part before growing. */
+		memmove(client->out_buf, client->out_buf + client->out_pos,
+			client->out_size - client->out_pos);
+		client->out_size -= client->out_pos;
+		if (client->frame_pos != SIZE_MAX)
+			client->frame_pos -= client->out_pos;
+		client->out_pos = 0;
+	}
+	if (client->out_size + size > client->out_capacity) {
+		size_t capacity = client->out_capacity * 2;
+		if (capacity < client->out_size + size)
+			capacity = client->out_size + size;
+		client->out_buf = realloc(client->out_buf, capacity);
+		if (client->out_buf == NULL)
+			abort();
+		client->out_capacity = capacity;
+	}
+	return client->out_buf + client->out_size;
+}
+
+/**
+ * Connect a non-blocking socket and wait for the result, so the
+ * errors are reported by chat_client_connect() itself.
+ */
+static int
+chat_client_connect_to(const struct addrinfo *ai)
+{
+	int sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+			  SOCK_CLOEXEC, ai->ai_protocol);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+		return sock;
+	if (errno != EINPROGRESS)
+		goto error;
+	struct pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLOUT;
+	int rc;
+	while ((rc = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+		;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (rc < 0 || getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+		goto error;
+	if (err == 0)
+		return sock;
+	errno = err;
+error:
+	err = errno;
+	close(sock);
+	errno = err;
+	return -1;
 }
 
 int
 chat_client_connect(struct chat_client *client, const char *addr)
 {
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+
+	const char *sep = strrchr(addr, ':');
+	if (sep == NULL)
+		return CHAT_ERR_NO_ADDR;
+	char host[256];
+	size_t host_len = sep - addr;
+	if (host_len >= sizeof(host))
+		return CHAT_ERR_NO_ADDR;
+	memcpy(host, addr, host_len);
+	host[host_len] = 0;
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *list;
+	if (getaddrinfo(host, sep + 1, &hints, &list) != 0)
+		return CHAT_ERR_NO_ADDR;
+	int sock = -1;
+	for (struct addrinfo *ai = list; ai != NULL && sock < 0;
+	     ai = ai->ai_next)
+		sock = chat_client_connect_to(ai);
+	freeaddrinfo(list);
+	if (sock < 0)
+		return CHAT_ERR_SYS;
+#if CHAT_USE_URING
 	/*
-	 * 1) Use getaddrinfo() to resolve addr to struct sockaddr_in.
-	 * 2) Create a client socket (function socket()).
-	 * 3) Connect it by the found address (function connect()).
+	 * The ring waits for the socket itself. A non-blocking one
+	 * would fail its operations with EAGAIN. The receive is
+	 * submitted right away, so the ring's descriptor can be waited
+	 * on before the first update.
 	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)addr;
-
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) != 0 ||
+	    chat_uring_create(&client->ring, 4, 64, CHAT_CLIENT_BUF_COUNT,
+			      CHAT_CLIENT_BUF_SIZE) != 0)
+		goto error;
+	client->is_recv_armed = true;
+	chat_uring_prep_recv(&client->ring, sock,
+			     (uintptr_t)client | CHAT_CLIENT_OP_RECV);
+	if (chat_uring_submit(&client->ring) != 0) {
+		chat_uring_destroy(&client->ring);
+		goto error;
+	}
+#endif
+	client->socket = sock;
+	if (client->protocol == CHAT_PROTOCOL_BINARY) {
+		/*
+		 * The frames are sent right after the hello, without
+		 * waiting for the answer. The server learns the protocol
+		 * from the first byte.
+		 */
+		uint32_t name_size = strlen(client->name);
+		char *pos = chat_client_reserve_output(client, 2 + 5 +
+						       name_size);
+		*pos++ = 0;
+		*pos++ = CHAT_BINARY_VERSION;
+		pos = chat_varint_encode(pos, name_size);
+		memcpy(pos, client->name, name_size);
+		client->out_size = pos + name_size - client->out_buf;
+	}
+	return 0;
+#if CHAT_USE_URING
+error: {
+	int err = errno;
+	close(sock);
+	errno = err;
+	return CHAT_ERR_SYS;
+}
+#endif
 }
 
 struct chat_message *
 chat_client_pop_next(struct chat_client *client)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	return NULL;
+	struct chat_message *msg = client->msg_first;
+	if (msg == NULL)
+		return NULL;
+	client->msg_first = msg->next;
+	if (client->msg_first == NULL)
+		client->msg_last = NULL;
+	msg->next = NULL;
+	return msg;
+}
+
+/** Append a received message to the queue. */
+static void
+chat_client_push_message(struct chat_client *client, const char *data,
+			 size_t size, const char *author)
+{
+	struct chat_message *msg = chat_message_new(data, size);
+#if NEED_AUTHOR
+	/* The names live in the client's map. */
+	msg->author = author != NULL ? author : "";
+#else
+	(void)author;
+#endif
+	if (client->msg_last != NULL)
+		client->msg_last->next = msg;
+	else
+		client->msg_first = msg;
+	client->msg_last = msg;
+}
+
+/** Cut the messages out of the complete frames of the input buffer. */
+static int
+chat_client_parse_frames(struct chat_client *client)
+{
+	char *frame;
+	size_t frame_size;
+	/* The frames of the server are trusted. */
+	while ((frame = chat_input_next_frame(&client->input, UINT32_MAX,
+					      &frame_size)) != NULL) {
+		const char *pos = frame;
+		const char *end = frame + frame_size;
+		while (pos < end) {
+			uint32_t tag;
+			uint32_t size;
+			pos = chat_varint_decode(pos, end, &tag);
+			if (pos != NULL)
+				pos = chat_varint_decode(pos, end, &size);
+			if (pos == NULL || (size_t)(end - pos) < size)
+				goto error;
+			uint32_t id = tag >> 1;
+			if ((tag & 1) != 0) {
+				char *name = malloc(size + 1);
+				if (name == NULL)
+					abort();
+				memcpy(name, pos, size);
+				name[size] = 0;
+				chat_author_map_put(&client->authors, id, name);
+			} else {
+				const char *name;
+				if (!chat_author_map_get(&client->authors, id,
+							 &name))
+					goto error;
+				chat_client_push_message(client, pos, size,
+							 name);
+			}
+			pos += size;
+		}
+	}
+	return 0;
+
+error:
+	errno = EPROTO;
+	return -1;
+}
+
+/**
+ * Cut the complete messages out of the input buffer. In the binary
+ * protocol the server sends text until the answer to the hello. The
+ * answer starts with 0, which can't start a text message.
+ */
+static int
+chat_client_parse_input(struct chat_client *client)
+{
+	if (client->is_binary_input)
+		return chat_client_parse_frames(client);
+	struct chat_input *in = &client->input;
+	while (true) {
+		if (client->protocol == CHAT_PROTOCOL_BINARY &&
+		    in->pos < in->size && in->buf[in->pos] == 0) {
+			if (in->size - in->pos < 2)
+				return 0;
+			if (in->buf[in->pos + 1] != CHAT_BINARY_VERSION) {
+				errno = EPROTO;
+				return -1;
+			}
+			/* The lines found in the frames are not lines. */
+			in->pos += 2;
+			in->scanned = in->pos;
+			in->mask = 0;
+			client->is_binary_input = true;
+			return chat_client_parse_frames(client);
+		}
+		char *data;
+		size_t size;
+		if ((data = chat_input_next(in, &size)) == NULL)
+			return 0;
+		chat_client_push_message(client, data, size, NULL);
+	}
+}
+
+#if CHAT_USE_URING
+
+/** Send the rest of the send buffer. */
+static void
+chat_client_send(struct chat_client *client)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&client->ring,
+		(uintptr_t)client | CHAT_CLIENT_OP_SEND);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = client->socket;
+	sqe->addr = (uintptr_t)(client->send_buf + client->send_pos);
+	sqe->len = client->send_size - client->send_pos;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	client->is_sending = true;
+}
+
+/**
+ * Send the output buffer, if there is no send in progress. The buffer
+ * goes to the ring as is, and the free send buffer takes its place.
+ */
+static void
+chat_client_write(struct chat_client *client)
+{
+	if (client->is_sending || client->out_pos == client->out_size)
+		return;
+	/* The sent frame can't take more records. */
+	client->frame_pos = SIZE_MAX;
+	char *buf = client->send_buf;
+	size_t capacity = client->send_capacity;
+	client->send_buf = client->out_buf;
+	client->send_capacity = client->out_capacity;
+	client->send_pos = client->out_pos;
+	client->send_size = client->out_size;
+	client->out_buf = buf;
+	client->out_capacity = capacity;
+	client->out_pos = 0;
+	client->out_size = 0;
+	chat_client_send(client);
+}
+
+/** Handle a completion of the receive. */
+static int
+chat_client_complete_recv(struct chat_client *client,
+			  const struct io_uring_cqe *cqe)
+{
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+		client->is_recv_armed = false;
+	if (cqe->res > 0) {
+		struct chat_input *in = &client->input;
+		chat_input_reserve(in, cqe->res);
+		memcpy(in->buf + in->size, chat_uring_buf(&client->ring, cqe),
+		       cqe->res);
+		in->size += cqe->res;
+	}
+	if ((cqe->flags & IORING_CQE_F_BUFFER) != 0)
+		chat_uring_recycle(&client->ring, cqe);
+	if (cqe->res == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	/* No free buffers is not an error, the receive is started again. */
+	if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+		errno = -cqe->res;
+		return -1;
+	}
+	if (cqe->res > 0 && chat_client_parse_input(client) != 0)
+		return -1;
+	if (!client->is_recv_armed) {
+		client->is_recv_armed = true;
+		chat_uring_prep_recv(&client->ring, client->socket,
+				     (uintptr_t)client | CHAT_CLIENT_OP_RECV);
+	}
+	return 0;
+}
+
+/** Handle a completion of the send, and send the rest or the new output. */
+static int
+chat_client_complete_send(struct chat_client *client,
+			  const struct io_uring_cqe *cqe)
+{
+	client->is_sending = false;
+	if (cqe->res < 0) {
+		errno = -cqe->res;
+		return -1;
+	}
+	client->send_pos += cqe->res;
+	if (client->send_pos < client->send_size)
+		chat_client_send(client);
+	else
+		chat_client_write(client);
+	return 0;
 }
 
 int
 chat_client_update(struct chat_client *client, double timeout)
 {
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+
+	chat_client_write(client);
+	struct chat_uring *ring = &client->ring;
+	if (chat_uring_wait(ring, timeout) != 0)
+		goto error;
+	int rc = CHAT_ERR_TIMEOUT;
+	struct io_uring_cqe *cqe;
+	while ((cqe = chat_uring_peek(ring)) != NULL) {
+		int err = 0;
+		switch (cqe->user_data & CHAT_CLIENT_OP_MASK) {
+		case CHAT_CLIENT_OP_RECV:
+			err = chat_client_complete_recv(client, cqe);
+			break;
+		case CHAT_CLIENT_OP_SEND:
+			err = chat_client_complete_send(client, cqe);
+			break;
+		}
+		chat_uring_advance(ring);
+		if (err != 0)
+			goto error;
+		rc = 0;
+	}
+	if (chat_uring_submit(ring) != 0)
+		goto error;
+	return rc;
+
+error:
+	/* The connection is lost, the received messages stay available. */
+	rc = errno;
+	chat_uring_destroy(ring);
+	close(client->socket);
+	client->socket = -1;
+	errno = rc;
+	return CHAT_ERR_SYS;
+}
+
+int
+chat_client_get_descriptor(const struct chat_client *client)
+{
+	if (client->socket < 0)
+		return -1;
 	/*
-	 * The easiest way to wait for updates on a single socket with a timeout
-	 * is to use poll(). Epoll is good for many sockets, poll is good for a
-	 * few.
-	 *
-	 * You create one struct pollfd, fill it, call poll() on it, handle the
-	 * events (do read/write).
+	 * The ring's descriptor is readable when an operation completes,
+	 * and writable when a new one can be submitted.
 	 */
-	(void)client;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	return client->ring.fd;
+}
+
+int
+chat_client_get_events(const struct chat_client *client)
+{
+	if (client->socket < 0)
+		return 0;
+	/* The output of a send in progress goes after its completion. */
+	if (!client->is_sending && client->out_pos < client->out_size)
+		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
+	return CHAT_EVENT_INPUT;
+}
+
+#else /* !CHAT_USE_URING */
+
+/** Read the socket until EAGAIN. */
+static int
+chat_client_read(struct chat_client *client)
+{
+	while (true) {
+		struct chat_input *in = &client->input;
+		chat_input_reserve(in, CHAT_CLIENT_READ_SIZE);
+		ssize_t rc = recv(client->socket, in->buf + in->size,
+				  in->capacity - in->size, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (rc == 0)
+			errno = ECONNRESET;
+		if (rc <= 0)
+			return -1;
+		in->size += rc;
+		if (chat_client_parse_input(client) != 0)
+			return -1;
+	}
+}
+
+/** Send the output buffer until it is empty or the socket is full. */
+static int
+chat_client_write(struct chat_client *client)
+{
+	/* The sent frame can't take more records. */
+	client->frame_pos = SIZE_MAX;
+	while (client->out_pos < client->out_size) {
+		ssize_t rc = send(client->socket,
+				  client->out_buf + client->out_pos,
+				  client->out_size - client->out_pos,
+				  MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (rc < 0)
+			return -1;
+		client->out_pos += rc;
+	}
+	client->out_pos = 0;
+	client->out_size = 0;
+	return 0;
+}
+
+int
+chat_client_update(struct chat_client *client, double timeout)
+{
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+
+	struct pollfd pfd;
+	pfd.fd = client->socket;
+	pfd.events = chat_events_to_poll_events(chat_client_get_events(client));
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	int rc = poll(&pfd, 1, timeout_ms);
+	if (rc < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (rc == 0)
+		return CHAT_ERR_TIMEOUT;
+	if ((pfd.revents & POLLOUT) != 0 && chat_client_write(client) != 0)
+		goto error;
+	if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) != 0 &&
+	    chat_client_read(client) != 0)
+		goto error;
+	return 0;
+
+error:
+	/* The connection is lost, the received messages stay available. */
+	rc = errno;
+	close(client->socket);
+	client->socket = -1;
+	errno = rc;
+	return CHAT_ERR_SYS;
 }
 
 int
@@ -87,20 +624,74 @@ chat_client_get_descriptor(const struct chat_client *client)
 int
 chat_client_get_events(const struct chat_client *client)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer.
-	 */
-	(void)client;
+	if (client->socket < 0)
+		return 0;
+	if (client->out_pos < client->out_size)
+		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
 	return CHAT_EVENT_INPUT;
 }
 
+#endif /* !CHAT_USE_URING */
+
+/**
+ * Append a record to the frame in the end of the output buffer, or
+ * to a new one. So all the messages fed between two sends go in one
+ * frame.
+ */
+static void
+chat_client_append_record(struct chat_client *client, const char *data,
+			  uint32_t size)
+{
+	char *pos = chat_client_reserve_output(client,
+					       CHAT_FRAME_HEAD_SIZE + 5 + size);
+	uint8_t *head = NULL;
+	uint32_t frame_size = 0;
+	if (client->frame_pos != SIZE_MAX) {
+		head = (uint8_t *)client->out_buf + client->frame_pos;
+		frame_size = head[0] | head[1] << 8 | head[2] << 16 |
+			     (uint32_t)head[3] << 24;
+		if (frame_size + 5ULL + size > CHAT_CLIENT_FRAME_MAX)
+			head = NULL;
+	}
+	if (head == NULL) {
+		client->frame_pos = client->out_size;
+		head = (uint8_t *)pos;
+		pos += CHAT_FRAME_HEAD_SIZE;
+		frame_size = 0;
+	}
+	char *end = chat_varint_encode(pos, size);
+	memcpy(end, data, size);
+	end += size;
+	frame_size += end - pos;
+	head[0] = frame_size;
+	head[1] = frame_size >> 8;
+	head[2] = frame_size >> 16;
+	head[3] = frame_size >> 24;
+	client->out_size = end - client->out_buf;
+}
+
 int
 chat_client_feed(struct chat_client *client, const char *msg, uint32_t msg_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (client->protocol == CHAT_PROTOCOL_TEXT) {
+		char *pos = chat_client_reserve_output(client, msg_size);
+		memcpy(pos, msg, msg_size);
+		client->out_size += msg_size;
+		return 0;
+	}
+	/* The messages are cut and trimmed here, not by the server. */
+	struct chat_input *in = &client->feed;
+	chat_input_reserve(in, msg_size);
+	memcpy(in->buf + in->size, msg, msg_size);
+	in->size += msg_size;
+	char *data;
+	size_t size;
+	while ((data = chat_input_next(in, &size)) != NULL) {
+		data = chat_trim(data, &size);
+		if (size > 0)
+			chat_client_append_record(client, data, size);
+	}
+	return 0;
 }
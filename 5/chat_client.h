@@ -1,5 +1,7 @@
 #pragma once
 
+#include "chat.h"
+
 #include <stdint.h>
 
 struct chat_client;
@@ -15,6 +17,19 @@ chat_client_new(const char *name);
 void
 chat_client_delete(struct chat_client *client);
 
+/**
+ * Choose the wire protocol. The binary one is negotiated with the
+ * server on connect, see enum chat_protocol. The default is text.
+ * With the binary one a message can take up to CHAT_CLIENT_FRAME_MAX
+ * bytes minus its head, the server drops the client on a bigger one.
+ *
+ * @retval 0 Success.
+ * @retval CHAT_ERR_ALREADY_STARTED The client is already connected.
+ */
+int
+chat_client_set_protocol(struct chat_client *client,
+			 enum chat_protocol protocol);
+
 /**
  * Try to connect to the given address.
  *
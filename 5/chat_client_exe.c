@@ -19,6 +19,8 @@ main(int argc, char **argv)
 	const char *addr = argv[1];
 	const char *name = argc >= 3 ? argv[2] : "anon";
 	struct chat_client *cli = chat_client_new(name);
+	if (argc >= 4 && strcmp(argv[3], "binary") == 0)
+		chat_client_set_protocol(cli, CHAT_PROTOCOL_BINARY);
 	int rc = chat_client_connect(cli, addr);
 	if (rc != 0) {
 		printf("Couldn't connect: %d\n", rc);
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Load generator. Connects many chat clients, spread over threads,
+ * and sends messages at a target rate, each message from the next
+ * client. A message carries the time it was due to be sent, so the
+ * receivers measure the end-to-end latency of the broadcast, and a
+ * generator falling behind the rate shows up in it too. Reported are
+ * the percentiles of the latency of all the deliveries, the
+ * throughput, and the memory of the server.
+ *
+ * Without -a the server is started here, in a child process, on a
+ * free port of localhost.
+ */
+
+enum {
+	/** Precision of the latency histogram, 1 / 2^bits. */
+	LOAD_HIST_SUB_BITS = 5,
+	LOAD_HIST_SIZE = 64 << LOAD_HIST_SUB_BITS,
+	/** Period of the sync messages sent before the measurement. */
+	LOAD_SYNC_PERIOD_MS = 100,
+	/** How long to wait for the deliveries after the last send. */
+	LOAD_DRAIN_TIMEOUT_NS = 5 * 1000000000L,
+};
+
+struct load_options {
+	const char *addr;
+	/** Server process to measure, if it is not started here. */
+	pid_t server_pid;
+	int server_thread_count;
+	int client_count;
+	int thread_count;
+	double rate;
+	double duration;
+	uint32_t msg_size;
+	enum chat_protocol protocol;
+};
+
+/** Counts of the latencies by ranges, with the fixed precision. */
+struct load_hist {
+	uint64_t counts[LOAD_HIST_SIZE];
+	uint64_t total;
+	uint64_t max;
+};
+
+static inline int
+load_hist_index(uint64_t value)
+{
+	if (value < (1 << LOAD_HIST_SUB_BITS))
+		return value;
+	int shift = 63 - __builtin_clzll(value) - LOAD_HIST_SUB_BITS;
+	return ((shift + 1) << LOAD_HIST_SUB_BITS) +
+	       ((value >> shift) & ((1 << LOAD_HIST_SUB_BITS) - 1));
+}
+
+/** The least value of the range of the index. */
+static inline uint64_t
+load_hist_value(int index)
+{
+	if (index < (1 << LOAD_HIST_SUB_BITS))
+		return index;
+	int shift = (index >> LOAD_HIST_SUB_BITS) - 1;
+	uint64_t low = index & ((1 << LOAD_HIST_SUB_BITS) - 1);
+	return ((1 << LOAD_HIST_SUB_BITS) + low) << shift;
+}
+
+static inline void
+load_hist_add(struct load_hist *hist, uint64_t value)
+{
+	++hist->counts[load_hist_index(value)];
+	++hist->total;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+static void
+load_hist_merge(struct load_hist *dst, const struct load_hist *src)
+{
+	for (int i = 0; i < LOAD_HIST_SIZE; ++i)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static uint64_t
+load_hist_percentile(const struct load_hist *hist, double percent)
+{
+	uint64_t rank = (uint64_t)(hist->total * percent / 100);
+	uint64_t sum = 0;
+	for (int i = 0; i < LOAD_HIST_SIZE; ++i) {
+		sum += hist->counts[i];
+		if (sum > rank)
+			return load_hist_value(i);
+	}
+	return hist->max;
+}
+
+struct load_ctx;
+
+struct load_thread {
+	struct load_ctx *ctx;
+	pthread_t thread;
+	struct chat_client **clients;
+	struct pollfd *fds;
+	int client_count;
+	/** Interval between the sends of the thread, in nanoseconds. */
+	double send_interval;
+	uint64_t sent;
+	uint64_t errors;
+	struct load_hist hist;
+};
+
+struct load_ctx {
+	const struct load_options *opts;
+	struct load_thread *threads;
+	pthread_barrier_t barrier;
+	/** Clients which got a message since the connect. */
+	int synced_count;
+	/** All the counters below are updated atomically. */
+	uint64_t sent;
+	uint64_t delivered;
+	int sending_thread_count;
+	/** Start and end of the sending, CLOCK_MONOTONIC nanoseconds. */
+	uint64_t start;
+	uint64_t end;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Wait for the clients' events until @a deadline and handle them. */
+static void
+load_thread_poll(struct load_thread *t, uint64_t deadline, bool *is_synced)
+{
+	struct load_ctx *ctx = t->ctx;
+	for (int i = 0; i < t->client_count; ++i) {
+		t->fds[i].fd = chat_client_get_descriptor(t->clients[i]);
+		t->fds[i].events = chat_events_to_poll_events(
+			chat_client_get_events(t->clients[i]));
+	}
+	uint64_t now = now_ns();
+	uint64_t timeout = deadline > now ? deadline - now : 0;
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000000000;
+	ts.tv_nsec = timeout % 1000000000;
+	if (ppoll(t->fds, t->client_count, &ts, NULL) <= 0)
+		return;
+	uint64_t delivered = 0;
+	for (int i = 0; i < t->client_count; ++i) {
+		if (t->fds[i].revents == 0)
+			continue;
+		struct chat_client *cli = t->clients[i];
+		if (chat_client_update(cli, 0) == CHAT_ERR_SYS)
+			++t->errors;
+		struct chat_message *msg;
+		now = now_ns();
+		while ((msg = chat_client_pop_next(cli)) != NULL) {
+			if (!is_synced[i]) {
+				is_synced[i] = true;
+				__atomic_add_fetch(&ctx->synced_count, 1,
+						   __ATOMIC_RELAXED);
+			}
+			/* The sync messages have no time. */
+			uint64_t sent = strtoull(msg->data, NULL, 16);
+			chat_message_delete(msg);
+			if (sent == 0 || sent > now)
+				continue;
+			load_hist_add(&t->hist, now - sent);
+			++delivered;
+		}
+	}
+	__atomic_add_fetch(&ctx->delivered, delivered, __ATOMIC_RELAXED);
+}
+
+static void *
+load_thread_f(void *arg)
+{
+	struct load_thread *t = arg;
+	struct load_ctx *ctx = t->ctx;
+	const struct load_options *opts = ctx->opts;
+	bool *is_synced = calloc(t->client_count, sizeof(is_synced[0]));
+	char *msg = malloc(opts->msg_size + 1);
+	/*
+	 * The server gets the messages only for the clients it has
+	 * accepted. So the first client says "sync" until all the others
+	 * got something, then the measurement starts.
+	 */
+	pthread_barrier_wait(&ctx->barrier);
+	int expected = opts->client_count - 1;
+	while (__atomic_load_n(&ctx->synced_count, __ATOMIC_RELAXED) <
+	       expected) {
+		uint64_t deadline = now_ns() + LOAD_SYNC_PERIOD_MS * 1000000L;
+		if (t == ctx->threads)
+			chat_client_feed(t->clients[0], "sync\n", 5);
+		while (now_ns() < deadline &&
+		       __atomic_load_n(&ctx->synced_count,
+				       __ATOMIC_RELAXED) < expected)
+			load_thread_poll(t, deadline, is_synced);
+	}
+	pthread_barrier_wait(&ctx->barrier);
+
+	/* Each thread starts from the own offset inside the interval. */
+	double next = ctx->start + t->send_interval * (t - ctx->threads) /
+		      opts->thread_count;
+	int next_client = 0;
+	bool is_sending = true;
+	uint64_t drain_end = ctx->end + LOAD_DRAIN_TIMEOUT_NS;
+	while (true) {
+		uint64_t now = now_ns();
+		while (is_sending && next <= now) {
+			if (next >= ctx->end) {
+				is_sending = false;
+				__atomic_sub_fetch(&ctx->sending_thread_count,
+						   1, __ATOMIC_RELAXED);
+				break;
+			}
+			int len = snprintf(msg, opts->msg_size + 1, "%llx ",
+					   (unsigned long long)next);
+			if ((uint32_t)len < opts->msg_size)
+				memset(msg + len, '.', opts->msg_size - len);
+			msg[opts->msg_size - 1] = '\n';
+			chat_client_feed(t->clients[next_client], msg,
+					 opts->msg_size);
+			next_client = (next_client + 1) % t->client_count;
+			++t->sent;
+			__atomic_add_fetch(&ctx->sent, 1, __ATOMIC_RELAXED);
+			next += t->send_interval;
+		}
+		if (!is_sending) {
+			uint64_t total = __atomic_load_n(&ctx->sent,
+							 __ATOMIC_RELAXED);
+			if (now >= drain_end ||
+			    (__atomic_load_n(&ctx->sending_thread_count,
+					     __ATOMIC_RELAXED) == 0 &&
+			     __atomic_load_n(&ctx->delivered,
+					     __ATOMIC_RELAXED) >=
+			     total * expected))
+				break;
+		}
+		uint64_t deadline = is_sending ? (uint64_t)next :
+				    now + LOAD_SYNC_PERIOD_MS * 1000000L;
+		load_thread_poll(t, deadline, is_synced);
+	}
+	free(msg);
+	free(is_synced);
+	return NULL;
+}
+
+/** Resident and peak memory of the process in KB from /proc. */
+static bool
+process_get_rss(pid_t pid, long *rss, long *peak)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	char line[256];
+	*rss = -1;
+	*peak = -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		sscanf(line, "VmRSS: %ld", rss);
+		sscanf(line, "VmHWM: %ld", peak);
+	}
+	fclose(f);
+	return *rss >= 0 && *peak >= 0;
+}
+
+/**
+ * Start the server in a child process. It is stopped by the end of
+ * the pipe, @a stop_fd is the other end.
+ */
+static pid_t
+server_start(int thread_count, uint16_t *port, int *stop_fd)
+{
+	int port_pipe[2];
+	int stop_pipe[2];
+	if (pipe(port_pipe) != 0 || pipe(stop_pipe) != 0) {
+		perror("pipe");
+		exit(-1);
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+	if (pid > 0) {
+		close(port_pipe[1]);
+		close(stop_pipe[0]);
+		if (read(port_pipe[0], port, sizeof(*port)) != sizeof(*port))
+			exit(-1);
+		close(port_pipe[0]);
+		*stop_fd = stop_pipe[1];
+		return pid;
+	}
+	close(port_pipe[0]);
+	close(stop_pipe[1]);
+	struct chat_server *server = chat_server_new();
+	chat_server_set_thread_count(server, thread_count);
+	if (chat_server_listen(server, 0) != 0) {
+		printf("Couldn't listen\n");
+		exit(-1);
+	}
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(chat_server_get_socket(server), (void *)&addr, &len);
+	*port = ntohs(addr.sin_port);
+	write(port_pipe[1], port, sizeof(*port));
+	close(port_pipe[1]);
+	struct pollfd fds[2];
+	fds[0].fd = stop_pipe[0];
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	fds[1].fd = chat_server_get_descriptor(server);
+	while (fds[0].revents == 0) {
+		fds[1].events = chat_events_to_poll_events(
+			chat_server_get_events(server));
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			break;
+		while (chat_server_update(server, 0) == 0) {
+			struct chat_message *msg;
+			while ((msg = chat_server_pop_next(server)) != NULL)
+				chat_message_delete(msg);
+		}
+	}
+	chat_server_delete(server);
+	exit(0);
+}
+
+static void
+usage(void)
+{
+	printf("Usage: ./load [-a host:port [-p server pid]] [-S server "
+	       "threads]\n"
+	       "              [-c clients] [-t threads] [-r msgs/s] "
+	       "[-d seconds]\n"
+	       "              [-m msg size] [-b]\n"
+	       "Defaults: -c 1000 -t 4 -r 100 -d 10 -m 64, the server "
+	       "is started here.\n"
+	       "-b is for the binary protocol.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct load_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.client_count = 1000;
+	opts.thread_count = 4;
+	opts.rate = 100;
+	opts.duration = 10;
+	opts.msg_size = 64;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:S:c:t:r:d:m:bh")) != -1) {
+		switch (opt) {
+		case 'a': opts.addr = optarg; break;
+		case 'p': opts.server_pid = atoi(optarg); break;
+		case 'S': opts.server_thread_count = atoi(optarg); break;
+		case 'c': opts.client_count = atoi(optarg); break;
+		case 't': opts.thread_count = atoi(optarg); break;
+		case 'r': opts.rate = atof(optarg); break;
+		case 'd': opts.duration = atof(optarg); break;
+		case 'm': opts.msg_size = strtoul(optarg, NULL, 10); break;
+		case 'b': opts.protocol = CHAT_PROTOCOL_BINARY; break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+	/* The message has the time, a space and '\n'. */
+	if (opts.client_count < 2 || opts.thread_count < 1 ||
+	    opts.thread_count > opts.client_count || opts.rate <= 0 ||
+	    opts.duration <= 0 || opts.msg_size < 20) {
+		usage();
+		return -1;
+	}
+	/* The server can close a client, its socket must not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+	char addr[256];
+	int stop_fd = -1;
+	pid_t server_pid = opts.server_pid;
+	if (opts.addr == NULL) {
+		uint16_t port;
+		server_pid = server_start(opts.server_thread_count, &port,
+					  &stop_fd);
+		snprintf(addr, sizeof(addr), "127.0.0.1:%u", port);
+		opts.addr = addr;
+	}
+	printf("%d clients in %d threads, %.0f msgs/s of %u bytes for "
+	       "%.1f s\n", opts.client_count, opts.thread_count, opts.rate,
+	       opts.msg_size, opts.duration);
+
+	struct load_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.opts = &opts;
+	ctx.threads = calloc(opts.thread_count, sizeof(ctx.threads[0]));
+	ctx.sending_thread_count = opts.thread_count;
+	pthread_barrier_init(&ctx.barrier, NULL, opts.thread_count + 1);
+	for (int i = 0, first = 0; i < opts.thread_count; ++i) {
+		struct load_thread *t = &ctx.threads[i];
+		t->ctx = &ctx;
+		t->client_count = opts.client_count / opts.thread_count +
+				  (i < opts.client_count % opts.thread_count);
+		t->clients = calloc(t->client_count, sizeof(t->clients[0]));
+		t->fds = calloc(t->client_count, sizeof(t->fds[0]));
+		t->send_interval = 1e9 * opts.thread_count / opts.rate;
+		for (int j = 0; j < t->client_count; ++j) {
+			char name[32];
+			snprintf(name, sizeof(name), "load%d", first + j);
+			struct chat_client *cli = chat_client_new(name);
+			chat_client_set_protocol(cli, opts.protocol);
+			int rc = chat_client_connect(cli, opts.addr);
+			if (rc != 0) {
+				printf("Couldn't connect: %d, %s\n", rc,
+				       strerror(errno));
+				return -1;
+			}
+			t->clients[j] = cli;
+		}
+		first += t->client_count;
+		if (pthread_create(&t->thread, NULL, load_thread_f, t) != 0)
+			abort();
+	}
+	printf("Connected, syncing\n");
+	pthread_barrier_wait(&ctx.barrier);
+	/* All the clients are known to the server after this barrier. */
+	ctx.start = now_ns() + 10000000;
+	ctx.end = ctx.start + (uint64_t)(opts.duration * 1e9);
+	pthread_barrier_wait(&ctx.barrier);
+
+	struct load_hist *hist = calloc(1, sizeof(*hist));
+	uint64_t sent = 0;
+	uint64_t errors = 0;
+	for (int i = 0; i < opts.thread_count; ++i) {
+		struct load_thread *t = &ctx.threads[i];
+		pthread_join(t->thread, NULL);
+		load_hist_merge(hist, &t->hist);
+		sent += t->sent;
+		errors += t->errors;
+	}
+	double duration = (now_ns() - ctx.start) / 1e9;
+	uint64_t expected = sent * (opts.client_count - 1);
+	printf("sent %llu msgs, %.0f msgs/s\n", (unsigned long long)sent,
+	       sent / opts.duration);
+	printf("delivered %llu of %llu, %.0f deliveries/s, %llu client "
+	       "errors\n", (unsigned long long)hist->total,
+	       (unsigned long long)expected, hist->total / duration,
+	       (unsigned long long)errors);
+	printf("latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f "
+	       "ms\n", load_hist_percentile(hist, 50) / 1e6,
+	       load_hist_percentile(hist, 99) / 1e6,
+	       load_hist_percentile(hist, 99.9) / 1e6, hist->max / 1e6);
+	long rss, peak;
+	if (server_pid > 0 && process_get_rss(server_pid, &rss, &peak))
+		printf("server RSS %.1f MB, peak %.1f MB\n", rss / 1024.0,
+		       peak / 1024.0);
+
+	for (int i = 0; i < opts.thread_count; ++i) {
+		struct load_thread *t = &ctx.threads[i];
+		for (int j = 0; j < t->client_count; ++j)
+			chat_client_delete(t->clients[j]);
+		free(t->clients);
+		free(t->fds);
+	}
+	free(ctx.threads);
+	bool is_complete = hist->total == expected;
+	free(hist);
+	pthread_barrier_destroy(&ctx.barrier);
+	if (stop_fd >= 0) {
+		close(stop_fd);
+		waitpid(server_pid, NULL, 0);
+	}
+	return is_complete ? 0 : -1;
+}
@@ -1,133 +1,2025 @@
+#define _GNU_SOURCE
+
 #include "chat.h"
 #include "chat_server.h"
+#include "rlist.h"
+#if CHAT_USE_URING
+#include "chat_uring.h"
+#endif
 
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#if !CHAT_USE_URING
+#include <sys/epoll.h>
+#endif
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+enum {
+	/** Max count of events handled by one update. */
+	CHAT_SERVER_EVENT_BATCH = 256,
+	/** Free space ensured in the input buffer before each read. */
+	CHAT_SERVER_READ_SIZE = 64 * 1024,
+	/** Max count of queued messages sent by one sendmsg(). */
+	CHAT_SERVER_IOV_MAX = 64,
+	/** Output of a replaying peer is topped up from the history to it. */
+	CHAT_SERVER_REPLAY_SIZE = 64 * 1024,
+#if CHAT_USE_URING
+	/** Sizes of the queues of a shard's ring. */
+	CHAT_SERVER_SQ_SIZE = 256,
+	CHAT_SERVER_CQ_SIZE = 4096,
+	/** Provided buffers of a shard's ring for all its peers. */
+	CHAT_SERVER_BUF_COUNT = 256,
+	CHAT_SERVER_BUF_SIZE = 16 * 1024,
+#endif
+};
+
+#if CHAT_USE_URING
+/**
+ * Operations of a shard, the tag in the low bits of the user_data.
+ * The rest is the shard for the accept and the inbox, or the peer.
+ */
+enum chat_op {
+	CHAT_OP_ACCEPT = 1,
+	CHAT_OP_INBOX,
+	CHAT_OP_RECV,
+	CHAT_OP_SEND,
+	CHAT_OP_MASK = 7,
+};
+
+static inline uint64_t
+chat_op_data(const void *owner, enum chat_op op)
+{
+	return (uintptr_t)owner | op;
+}
+#endif
+
+/**
+ * Author of the messages of a peer. Shared by the buffers of its
+ * messages in all the shards, so the counter is atomic. The rest is
+ * never changed.
+ */
+struct chat_author {
+	uint32_t ref_count;
+	/** Unique in the server, the binary peers get it instead of the name. */
+	uint32_t id;
+	uint32_t name_size;
+	char name[];
+};
+
+static inline void
+chat_author_ref(struct chat_author *author)
+{
+	__atomic_add_fetch(&author->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+chat_author_unref(struct chat_author *author)
+{
+	if (__atomic_sub_fetch(&author->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+		free(author);
+}
+
+/**
+ * A message ready for sending in both protocols. One buffer is
+ * shared by the output queues of all the receivers instead of a copy
+ * per peer. The data starts with the head of the binary record,
+ * aligned to the end of CHAT_RECORD_HEAD_MAX bytes, then goes the
+ * message with '\n'. So the text and the record are both in one
+ * piece of memory.
+ */
+struct chat_buffer {
+	/** Link in the inbox of a shard, while posted to it. */
+	struct chat_buffer *next;
+	/** Count of the output queues and other holders of the buffer. */
+	uint32_t ref_count;
+	/** Size of the text, from CHAT_RECORD_HEAD_MAX in data. */
+	uint32_t text_size;
+	/** Start and size of the binary record in data. */
+	uint32_t record_pos;
+	uint32_t record_size;
+	/**
+	 * Author of the message. NULL in the service buffers, which are
+	 * never dropped: the hello answer and the author records.
+	 */
+	struct chat_author *author;
+	char data[];
+};
+
+static struct chat_buffer *
+chat_buffer_alloc(struct chat_author *author, uint32_t size)
+{
+	struct chat_buffer *buf =
+		malloc(sizeof(*buf) + CHAT_RECORD_HEAD_MAX + size);
+	if (buf == NULL)
+		abort();
+	buf->next = NULL;
+	buf->ref_count = 1;
+	buf->text_size = 0;
+	buf->record_pos = CHAT_RECORD_HEAD_MAX;
+	buf->record_size = 0;
+	buf->author = author;
+	if (author != NULL)
+		chat_author_ref(author);
+	return buf;
+}
+
+/** Put the head of a binary record before the data of the buffer. */
+static void
+chat_buffer_set_record(struct chat_buffer *buf, uint32_t tag, uint32_t size)
+{
+	char head[CHAT_RECORD_HEAD_MAX];
+	char *end = chat_varint_encode(head, tag);
+	end = chat_varint_encode(end, size);
+	uint32_t head_size = end - head;
+	buf->record_pos = CHAT_RECORD_HEAD_MAX - head_size;
+	buf->record_size = head_size + size;
+	memcpy(buf->data + buf->record_pos, head, head_size);
+}
+
+static struct chat_buffer *
+chat_buffer_new(struct chat_author *author, const char *data, uint32_t size)
+{
+	struct chat_buffer *buf = chat_buffer_alloc(author, size + 1);
+	char *text = buf->data + CHAT_RECORD_HEAD_MAX;
+	memcpy(text, data, size);
+	text[size] = '\n';
+	buf->text_size = size + 1;
+	chat_buffer_set_record(buf, author->id << 1, size);
+	return buf;
+}
+
+/** Record with the name of the author, only for the binary peers. */
+static struct chat_buffer *
+chat_buffer_new_author_record(const struct chat_author *author)
+{
+	struct chat_buffer *buf = chat_buffer_alloc(NULL, author->name_size);
+	memcpy(buf->data + CHAT_RECORD_HEAD_MAX, author->name,
+	       author->name_size);
+	chat_buffer_set_record(buf, author->id << 1 | 1, author->name_size);
+	return buf;
+}
+
+static inline void
+chat_buffer_ref(struct chat_buffer *buf)
+{
+	++buf->ref_count;
+}
+
+static inline void
+chat_buffer_unref(struct chat_buffer *buf)
+{
+	if (--buf->ref_count != 0)
+		return;
+	if (buf->author != NULL)
+		chat_author_unref(buf->author);
+	free(buf);
+}
+
 struct chat_peer {
-	/** Client's socket. To read/write messages. */
+	/** Client's socket. To read/write messages. -1 when closed. */
 	int socket;
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Received data not yet cut into messages. */
+	struct chat_input input;
+	/** Output queue, a ring of the buffers to send. */
+	struct chat_buffer **out_queue;
+	/** Index of the first buffer in the ring. */
+	uint32_t out_begin;
+	uint32_t out_count;
+	/** Size of the ring, a power of 2. */
+	uint32_t out_capacity;
+	/** Sent bytes of the first buffer. */
+	uint32_t out_pos;
+	/** Bytes in the output queue not sent yet. */
+	size_t out_size;
+	/**
+	 * The output reached the high watermark and was not sent down
+	 * to the low one yet.
+	 */
+	bool is_stalled;
+	/**
+	 * The last send did not hit EAGAIN. Then no EPOLLOUT is coming
+	 * and the new output has to be sent in the end of the update.
+	 */
+	bool is_writable;
+	/** Link in the list of the connected or the closed peers. */
+	struct rlist in_peers;
+	/** Link in the list of the peers not read while reading is stopped. */
+	struct rlist in_paused;
+	/** Link in the list of the peers to flush in the update's end. */
+	struct rlist in_dirty;
+	/** Author of the peer's messages, created with the first one. */
+	struct chat_author *author;
+	/** Protocol of the peer, known after its first bytes. */
+	enum chat_protocol protocol;
+	bool is_protocol_known;
+	/**
+	 * Buffers in the head of the output queue to send as text. They
+	 * were queued before the peer switched to the binary protocol.
+	 */
+	uint32_t out_text_count;
+	/** Records of the binary frame being sent, which are not sent yet. */
+	uint32_t frame_count;
+	/** Head of the frame being sent and how much of it is sent. */
+	char frame_head[CHAT_FRAME_HEAD_SIZE];
+	uint32_t frame_head_pos;
+	/** Authors with the records sent to a binary peer. */
+	struct chat_author_map known_authors;
+	/** The peer gets the history before the new messages. */
+	bool is_replaying;
+	/** Sequence number of the next message from the history. */
+	uint64_t replay_pos;
+	/** The history is replayed up to this sequence number, excluding. */
+	uint64_t replay_end;
+	/**
+	 * Messages broadcast during the replay. They are queued after
+	 * it, so the history can't lose them.
+	 */
+	struct chat_buffer **held;
+	uint32_t held_count;
+	uint32_t held_capacity;
+	/** Size of the held messages, limited with the output. */
+	size_t held_size;
+#if CHAT_USE_URING
+	/** The multishot receive is not complete. */
+	bool is_recv_armed;
+	/** The send is not complete, its message and vector are below. */
+	bool is_sending;
+	/**
+	 * Buffers in the head of the output queue sent as text by the
+	 * send. They can't be dropped until it completes, same as the
+	 * records of the frame.
+	 */
+	uint32_t send_count;
+	struct msghdr send_msg;
+	struct iovec send_iov[CHAT_SERVER_IOV_MAX];
+#endif
 };
 
-struct chat_server {
+/**
+ * One event loop with its own listening socket and peers. Without
+ * threads the server has one shard, run by chat_server_update().
+ * With threads each shard is run by its own thread, and the kernel
+ * spreads the new clients over the shards' sockets bound to the same
+ * port with SO_REUSEPORT. The peers are never moved between shards.
+ */
+struct chat_shard {
+	struct chat_server *server;
 	/** Listening socket. To accept new clients. */
 	int socket;
-	/** Array of peers. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+#if CHAT_USE_URING
+	/** Ring with the operations of the listening socket and the peers. */
+	struct chat_uring ring;
+#else
+	/** Epoll with the listening socket and all the peers, edge-triggered. */
+	int epoll_fd;
+#endif
+	/** Connected peers. */
+	struct rlist peers;
+	/**
+	 * Peers closed during the current update. Their memory is kept
+	 * until the end of the update, because the same batch of events
+	 * can still point at them. With io_uring, until their operations
+	 * complete.
+	 */
+	struct rlist closed_peers;
+	/** Count of the peers with a non-empty output buffer. */
+	int pending_output_count;
+	/**
+	 * Peers with unread input, left while the reading is stopped
+	 * by CHAT_OVERFLOW_STOP_READING.
+	 */
+	struct rlist paused_peers;
+	/**
+	 * Peers with new output, flushed once in the end of the update.
+	 * So all the messages of the update go to a peer with one
+	 * sendmsg(), and in one frame to a binary peer.
+	 */
+	struct rlist dirty_peers;
+	/**
+	 * The last messages for the new peers, a ring of the buffers. A
+	 * message is at its sequence number modulo the capacity, which
+	 * is a power of 2.
+	 */
+	struct chat_buffer **history;
+	uint32_t history_capacity;
+	uint32_t history_count;
+	/** Sequence number of the next message. */
+	uint64_t history_end;
+	/** Memory taken by the buffers of the history. */
+	size_t history_size;
+	/**
+	 * Counters of chat_server_stat, read by chat_server_get_stat()
+	 * from another thread.
+	 */
+	uint64_t msg_count;
+	uint64_t syscall_count;
+	/**
+	 * Messages posted by the other shards, a lock-free stack. The
+	 * newest message is on top.
+	 */
+	struct chat_buffer *inbox;
+	/** Eventfd to wake the shard up when its inbox is not empty. */
+	int inbox_fd;
+	pthread_t thread;
 };
 
+struct chat_server {
+	/** Count of the threads to run the shards, 0 for none. */
+	int thread_count;
+	struct chat_shard *shards;
+	int shard_count;
+	/** Set in the end to stop the threads. */
+	bool is_stopped;
+	/** Received messages for chat_server_pop_next(). */
+	struct chat_message *msg_first;
+	struct chat_message *msg_last;
+	/**
+	 * Messages received by the threads, a lock-free stack. They are
+	 * moved into the list above by chat_server_update().
+	 */
+	struct chat_message *msg_inbox;
+	/** Eventfd readable when the stack above is not empty. */
+	int msg_inbox_fd;
+	/** Output watermarks of a peer in bytes, 0 high for no limit. */
+	size_t out_high;
+	size_t out_low;
+	enum chat_overflow_policy overflow_policy;
+	/**
+	 * Limits of the history, 0 count for no history. Each shard has
+	 * its own copy of every message, so the size is split between
+	 * the shards evenly.
+	 */
+	uint32_t history_count;
+	size_t history_size;
+	/** Send with MSG_MORE all but the last part of a flush. */
+	bool is_corked;
+	/** Updated by all the shards, so only atomically. */
+	struct chat_server_stat stat;
+	/** Count of the authors ever created, for their IDs. */
+	uint32_t author_count;
+};
+
+static struct chat_author *
+chat_author_new(struct chat_server *server, const char *name,
+		uint32_t name_size)
+{
+	struct chat_author *author = malloc(sizeof(*author) + name_size);
+	if (author == NULL)
+		abort();
+	author->ref_count = 1;
+	author->id = __atomic_fetch_add(&server->author_count, 1,
+					__ATOMIC_RELAXED);
+	author->name_size = name_size;
+	memcpy(author->name, name, name_size);
+	return author;
+}
+
 struct chat_server *
 chat_server_new(void)
 {
 	struct chat_server *server = calloc(1, sizeof(*server));
-	server->socket = -1;
+	if (server == NULL)
+		abort();
+	server->msg_inbox_fd = -1;
+	return server;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+int
+chat_server_set_thread_count(struct chat_server *server, int count)
+{
+	if (server->shards != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->thread_count = count > 0 ? count : 0;
+	return 0;
+}
 
-	return server;
+int
+chat_server_set_output_limit(struct chat_server *server, size_t high,
+			     size_t low, enum chat_overflow_policy policy)
+{
+	if (server->shards != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (low > high)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->out_high = high;
+	server->out_low = low;
+	server->overflow_policy = policy;
+	return 0;
+}
+
+int
+chat_server_set_history(struct chat_server *server, uint32_t count,
+			size_t size)
+{
+	if (server->shards != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->history_count = count;
+	server->history_size = size;
+	return 0;
+}
+
+int
+chat_server_set_cork(struct chat_server *server, bool is_corked)
+{
+	if (server->shards != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->is_corked = is_corked;
+	return 0;
 }
 
 void
-chat_server_delete(struct chat_server *server)
+chat_server_get_stat(const struct chat_server *server,
+		     struct chat_server_stat *stat)
+{
+	const struct chat_server_stat *src = &server->stat;
+	stat->dropped_msg_count = __atomic_load_n(&src->dropped_msg_count,
+						  __ATOMIC_RELAXED);
+	stat->stall_count = __atomic_load_n(&src->stall_count,
+					    __ATOMIC_RELAXED);
+	stat->stalled_peer_count = __atomic_load_n(&src->stalled_peer_count,
+						   __ATOMIC_RELAXED);
+	stat->disconnected_peer_count = __atomic_load_n(
+		&src->disconnected_peer_count, __ATOMIC_RELAXED);
+	stat->msg_count = 0;
+	stat->syscall_count = 0;
+	for (int i = 0; i < server->shard_count; ++i) {
+		const struct chat_shard *shard = &server->shards[i];
+		stat->msg_count += __atomic_load_n(&shard->msg_count,
+						   __ATOMIC_RELAXED);
+		stat->syscall_count += __atomic_load_n(&shard->syscall_count,
+						       __ATOMIC_RELAXED);
+#if CHAT_USE_URING
+		stat->syscall_count += __atomic_load_n(&shard->ring.enter_count,
+						       __ATOMIC_RELAXED);
+#endif
+	}
+}
+
+/** Count a system call of the network I/O, see chat_server_stat. */
+static inline void
+chat_shard_count_syscall(struct chat_shard *shard)
+{
+	__atomic_add_fetch(&shard->syscall_count, 1, __ATOMIC_RELAXED);
+}
+
+static void
+chat_peer_delete(struct chat_peer *peer)
+{
+	for (uint32_t i = 0; i < peer->out_count; ++i) {
+		uint32_t pos = (peer->out_begin + i) & (peer->out_capacity - 1);
+		chat_buffer_unref(peer->out_queue[pos]);
+	}
+	for (uint32_t i = 0; i < peer->held_count; ++i)
+		chat_buffer_unref(peer->held[i]);
+	free(peer->held);
+	chat_input_destroy(&peer->input);
+	chat_author_map_destroy(&peer->known_authors);
+	if (peer->author != NULL)
+		chat_author_unref(peer->author);
+	free(peer->out_queue);
+	free(peer);
+}
+
+static struct chat_peer *
+chat_peer_new(int sock)
 {
-	if (server->socket >= 0)
-		close(server->socket);
+	struct chat_peer *peer = calloc(1, sizeof(*peer));
+	if (peer == NULL)
+		abort();
+	peer->socket = sock;
+	peer->is_writable = true;
+	rlist_create(&peer->in_paused);
+	rlist_create(&peer->in_dirty);
+	return peer;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+/** Close all the shard's descriptors and free its peers and inbox. */
+static void
+chat_shard_destroy(struct chat_shard *shard)
+{
+#if CHAT_USE_URING
+	/* The operations write into the peers until they complete. */
+	chat_uring_destroy(&shard->ring);
+#else
+	if (shard->epoll_fd >= 0)
+		close(shard->epoll_fd);
+#endif
+	if (shard->socket >= 0)
+		close(shard->socket);
+	if (shard->inbox_fd >= 0)
+		close(shard->inbox_fd);
+	rlist_splice(&shard->closed_peers, &shard->peers);
+	while (!rlist_empty(&shard->closed_peers)) {
+		struct chat_peer *peer = rlist_shift_entry(
+			&shard->closed_peers, struct chat_peer, in_peers);
+		if (peer->socket >= 0)
+			close(peer->socket);
+		chat_peer_delete(peer);
+	}
+	while (shard->inbox != NULL) {
+		struct chat_buffer *buf = shard->inbox;
+		shard->inbox = buf->next;
+		chat_buffer_unref(buf);
+	}
+	for (uint64_t i = shard->history_end - shard->history_count;
+	     i < shard->history_end; ++i)
+		chat_buffer_unref(shard->history[i &
+						 (shard->history_capacity - 1)]);
+	free(shard->history);
+}
 
+/** Make the eventfd readable. */
+static void
+chat_wakeup(int fd)
+{
+	uint64_t value = 1;
+	while (write(fd, &value, sizeof(value)) < 0 && errno == EINTR)
+		;
+}
+
+void
+chat_server_delete(struct chat_server *server)
+{
+	if (server->thread_count > 0 && server->shards != NULL) {
+		__atomic_store_n(&server->is_stopped, true, __ATOMIC_RELEASE);
+		for (int i = 0; i < server->shard_count; ++i)
+			chat_wakeup(server->shards[i].inbox_fd);
+		for (int i = 0; i < server->shard_count; ++i)
+			pthread_join(server->shards[i].thread, NULL);
+	}
+	for (int i = 0; i < server->shard_count; ++i)
+		chat_shard_destroy(&server->shards[i]);
+	free(server->shards);
+	if (server->msg_inbox_fd >= 0)
+		close(server->msg_inbox_fd);
+	while (server->msg_inbox != NULL) {
+		struct chat_message *msg = server->msg_inbox;
+		server->msg_inbox = msg->next;
+		chat_message_delete(msg);
+	}
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(server)) != NULL)
+		chat_message_delete(msg);
 	free(server);
 }
 
-int
-chat_server_listen(struct chat_server *server, uint16_t port)
+#if CHAT_USE_URING
+
+/** Accept the clients with a multishot accept. */
+static void
+chat_shard_prep_accept(struct chat_shard *shard)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(
+		&shard->ring, chat_op_data(shard, CHAT_OP_ACCEPT));
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard->socket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	/* The ring waits for the sockets, they are blocking. */
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/** Wait for the inbox's eventfd with a multishot poll. */
+static void
+chat_shard_prep_inbox(struct chat_shard *shard)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(
+		&shard->ring, chat_op_data(shard, CHAT_OP_INBOX));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->inbox_fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+}
+
+/**
+ * Create the ring and start accepting the clients. A shard with a
+ * thread submits it in the thread, which gets the completions then.
+ * Without threads it is submitted right away, so the ring's descriptor
+ * can be waited on before the first update.
+ */
+static int
+chat_shard_start(struct chat_shard *shard, bool is_shared)
+{
+	if (chat_uring_create(&shard->ring, CHAT_SERVER_SQ_SIZE,
+			      CHAT_SERVER_CQ_SIZE, CHAT_SERVER_BUF_COUNT,
+			      CHAT_SERVER_BUF_SIZE) != 0)
+		return CHAT_ERR_SYS;
+	chat_shard_prep_accept(shard);
+	if (!is_shared)
+		return chat_uring_submit(&shard->ring) == 0 ? 0 : CHAT_ERR_SYS;
+	shard->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shard->inbox_fd < 0)
+		return CHAT_ERR_SYS;
+	chat_shard_prep_inbox(shard);
+	return 0;
+}
+
+#else /* !CHAT_USE_URING */
+
+/** Create the epoll with the listening socket and the inbox. */
+static int
+chat_shard_start(struct chat_shard *shard, bool is_shared)
+{
+	shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (shard->epoll_fd < 0)
+		return CHAT_ERR_SYS;
+	/* The listening socket is the only one with the shard as data. */
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = shard;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->socket,
+		      &event) != 0)
+		return CHAT_ERR_SYS;
+	if (!is_shared)
+		return 0;
+	shard->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shard->inbox_fd < 0)
+		return CHAT_ERR_SYS;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &shard->inbox_fd;
+	if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->inbox_fd,
+		      &event) != 0)
+		return CHAT_ERR_SYS;
+	return 0;
+}
+
+#endif /* !CHAT_USE_URING */
+
+/**
+ * Create the shard's listening socket and start its event loop. With
+ * @a is_shared the port is bound with SO_REUSEPORT, to be shared by
+ * all the shards.
+ */
+static int
+chat_shard_listen(struct chat_shard *shard, uint16_t port, bool is_shared)
 {
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	/* Listen on all IPs of this machine. */
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	/*
-	 * 1) Create a server socket (function socket()).
-	 * 2) Bind the server socket to addr (function bind()).
-	 * 3) Listen the server socket (function listen()).
-	 * 4) Create epoll/kqueue if needed.
-	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			  0);
+	if (sock < 0)
+		return CHAT_ERR_SYS;
+	int value = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value,
+		       sizeof(value)) != 0)
+		goto error;
+	if (is_shared && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &value,
+				    sizeof(value)) != 0)
+		goto error;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		if (errno == EADDRINUSE) {
+			close(sock);
+			return CHAT_ERR_PORT_BUSY;
+		}
+		goto error;
+	}
+	if (listen(sock, SOMAXCONN) != 0)
+		goto error;
+	shard->socket = sock;
+	return chat_shard_start(shard, is_shared);
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+error:
+	close(sock);
+	return CHAT_ERR_SYS;
+}
+
+static void *
+chat_shard_thread_f(void *arg);
+
+int
+chat_server_listen(struct chat_server *server, uint16_t port)
+{
+	if (server->shards != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+
+	int count = server->thread_count > 0 ? server->thread_count : 1;
+	server->shards = calloc(count, sizeof(server->shards[0]));
+	if (server->shards == NULL)
+		abort();
+	server->shard_count = count;
+	for (int i = 0; i < count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		shard->server = server;
+		shard->socket = -1;
+#if CHAT_USE_URING
+		shard->ring.fd = -1;
+#else
+		shard->epoll_fd = -1;
+#endif
+		shard->inbox_fd = -1;
+		rlist_create(&shard->peers);
+		rlist_create(&shard->closed_peers);
+		rlist_create(&shard->paused_peers);
+		rlist_create(&shard->dirty_peers);
+	}
+	bool is_shared = server->thread_count > 0;
+	int rc = 0;
+	for (int i = 0; i < count && rc == 0; ++i) {
+		rc = chat_shard_listen(&server->shards[i], port, is_shared);
+		if (rc != 0 || port != 0)
+			continue;
+		/* The next shards take the port chosen for the first one. */
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(server->shards[i].socket,
+				(struct sockaddr *)&addr, &len) != 0)
+			rc = CHAT_ERR_SYS;
+		else
+			port = ntohs(addr.sin_port);
+	}
+	if (rc == 0 && is_shared) {
+		server->msg_inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (server->msg_inbox_fd < 0)
+			rc = CHAT_ERR_SYS;
+	}
+	if (rc != 0) {
+		int err = errno;
+		for (int i = 0; i < count; ++i)
+			chat_shard_destroy(&server->shards[i]);
+		free(server->shards);
+		server->shards = NULL;
+		server->shard_count = 0;
+		if (server->msg_inbox_fd >= 0) {
+			close(server->msg_inbox_fd);
+			server->msg_inbox_fd = -1;
+		}
+		errno = err;
+		return rc;
+	}
+	for (int i = 0; i < count && is_shared; ++i) {
+		if (pthread_create(&server->shards[i].thread, NULL,
+				   chat_shard_thread_f,
+				   &server->shards[i]) != 0)
+			abort();
+	}
+	return 0;
 }
 
 struct chat_message *
 chat_server_pop_next(struct chat_server *server)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	struct chat_message *msg = server->msg_first;
+	if (msg == NULL)
+		return NULL;
+	server->msg_first = msg->next;
+	if (server->msg_first == NULL)
+		server->msg_last = NULL;
+	msg->next = NULL;
+	return msg;
+}
+
+/** Append the messages to the list for chat_server_pop_next(). */
+static void
+chat_server_append(struct chat_server *server, struct chat_message *first,
+		   struct chat_message *last)
+{
+	if (server->msg_last != NULL)
+		server->msg_last->next = first;
+	else
+		server->msg_first = first;
+	server->msg_last = last;
+}
+
+/**
+ * Give a received message to the app. A shard thread pushes it into
+ * the lock-free stack and wakes chat_server_update() up, same as
+ * with the shards' inboxes.
+ */
+static void
+chat_server_deliver(struct chat_server *server, struct chat_message *msg)
+{
+	if (server->thread_count == 0) {
+		chat_server_append(server, msg, msg);
+		return;
+	}
+	struct chat_message *top = __atomic_load_n(&server->msg_inbox,
+						   __ATOMIC_RELAXED);
+	do
+		msg->next = top;
+	while (!__atomic_compare_exchange_n(&server->msg_inbox, &top, msg,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED));
+	if (top == NULL)
+		chat_wakeup(server->msg_inbox_fd);
+}
+
+/** Check if the reading is stopped by a stalled peer. */
+static inline bool
+chat_shard_is_reading_stopped(const struct chat_shard *shard)
+{
+	const struct chat_server *server = shard->server;
+	return server->overflow_policy == CHAT_OVERFLOW_STOP_READING &&
+	       __atomic_load_n(&server->stat.stalled_peer_count,
+			       __ATOMIC_RELAXED) > 0;
+}
+
+static void
+chat_shard_stall_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_server_stat *stat = &shard->server->stat;
+	peer->is_stalled = true;
+	__atomic_add_fetch(&stat->stall_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat->stalled_peer_count, 1, __ATOMIC_RELAXED);
+}
+
+static void
+chat_shard_unstall_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_server *server = shard->server;
+	peer->is_stalled = false;
+	if (__atomic_sub_fetch(&server->stat.stalled_peer_count, 1,
+			       __ATOMIC_RELAXED) > 0 ||
+	    server->overflow_policy != CHAT_OVERFLOW_STOP_READING)
+		return;
+	/* The other shards resume reading in the end of their update. */
+	for (int i = 0; i < server->shard_count; ++i) {
+		if (&server->shards[i] != shard &&
+		    server->shards[i].inbox_fd >= 0)
+			chat_wakeup(server->shards[i].inbox_fd);
+	}
+}
+
+/**
+ * Close the peer's socket. The peer is freed in the end of the
+ * update, when no events can point at it anymore. With io_uring its
+ * operations are cancelled, and it is freed after they complete.
+ */
+static void
+chat_shard_close_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->socket < 0)
+		return;
+	if (peer->out_count > 0)
+		--shard->pending_output_count;
+	if (peer->is_stalled)
+		chat_shard_unstall_peer(shard, peer);
+	rlist_del_entry(peer, in_paused);
+	rlist_del_entry(peer, in_dirty);
+#if CHAT_USE_URING
+	if (peer->is_recv_armed)
+		chat_uring_prep_cancel(&shard->ring,
+				       chat_op_data(peer, CHAT_OP_RECV));
+	if (peer->is_sending)
+		chat_uring_prep_cancel(&shard->ring,
+				       chat_op_data(peer, CHAT_OP_SEND));
+#else
+	epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+#endif
+	close(peer->socket);
+	peer->socket = -1;
+	rlist_move_entry(&shard->closed_peers, peer, in_peers);
+}
+
+/**
+ * Get the @a i-th buffer of the output queue and its data as sent to
+ * the peer: the text or the binary record.
+ */
+static inline struct chat_buffer *
+chat_peer_output(const struct chat_peer *peer, uint32_t i, const char **data,
+		 uint32_t *size)
+{
+	struct chat_buffer *buf = peer->out_queue[(peer->out_begin + i) &
+						  (peer->out_capacity - 1)];
+	if (peer->protocol == CHAT_PROTOCOL_TEXT || i < peer->out_text_count) {
+		*data = buf->data + CHAT_RECORD_HEAD_MAX;
+		*size = buf->text_size;
+	} else {
+		*data = buf->data + buf->record_pos;
+		*size = buf->record_size;
+	}
+	return buf;
+}
+
+/** Drop @a size sent bytes from the head of the output queue. */
+static void
+chat_peer_consume_output(struct chat_peer *peer, size_t size)
+{
+	uint32_t mask = peer->out_capacity - 1;
+	while (size > 0) {
+		if (peer->out_text_count == 0 && peer->frame_count > 0 &&
+		    peer->frame_head_pos < CHAT_FRAME_HEAD_SIZE) {
+			/* The frame's head goes before its records. */
+			size_t left = CHAT_FRAME_HEAD_SIZE - peer->frame_head_pos;
+			left = size < left ? size : left;
+			peer->frame_head_pos += left;
+			size -= left;
+			continue;
+		}
+		const char *data;
+		uint32_t buf_size;
+		struct chat_buffer *buf = chat_peer_output(peer, 0, &data,
+							   &buf_size);
+		size_t left = buf_size - peer->out_pos;
+		if (size < left) {
+			peer->out_pos += size;
+			peer->out_size -= size;
+			return;
+		}
+		size -= left;
+		peer->out_size -= left;
+		peer->out_pos = 0;
+		peer->out_begin = (peer->out_begin + 1) & mask;
+		--peer->out_count;
+		if (peer->out_text_count > 0)
+			--peer->out_text_count;
+		else if (peer->frame_count > 0)
+			--peer->frame_count;
+		chat_buffer_unref(buf);
+	}
+}
+
+/** Point @a iov at the not sent part of the @a i-th output buffer. */
+static inline void
+chat_peer_output_iov(const struct chat_peer *peer, uint32_t i,
+		     struct iovec *iov)
+{
+	const char *data;
+	uint32_t size;
+	chat_peer_output(peer, i, &data, &size);
+	uint32_t sent = i == 0 ? peer->out_pos : 0;
+	iov->iov_base = (char *)data + sent;
+	iov->iov_len = size - sent;
+}
+
+/**
+ * Fill the vector with the head of the output queue. The binary
+ * records go in frames. A frame is started when the previous one is
+ * sent whole, and takes the records which fit into the vector, so its
+ * size is known right away.
+ *
+ * @param[out] is_all Set to true if the vector takes all the queue.
+ * @return Count of the filled entries.
+ */
+static int
+chat_peer_fill_output(struct chat_peer *peer, struct iovec *iov,
+		      bool *is_all)
+{
+	int count = 0;
+	uint32_t i = 0;
+	for (; i < peer->out_count && count < CHAT_SERVER_IOV_MAX; ++i) {
+		if (peer->protocol == CHAT_PROTOCOL_BINARY &&
+		    i >= peer->out_text_count)
+			break;
+		chat_peer_output_iov(peer, i, &iov[count++]);
+	}
+	/* A new frame needs a place for its head and a record. */
+	if (i == peer->out_count || count + 2 > CHAT_SERVER_IOV_MAX) {
+		*is_all = i == peer->out_count;
+		return count;
+	}
+	if (peer->frame_count == 0) {
+		uint32_t frame_size = 0;
+		uint32_t n = 0;
+		for (; i + n < peer->out_count &&
+		       count + 1 + n < CHAT_SERVER_IOV_MAX; ++n) {
+			const char *data;
+			uint32_t size;
+			chat_peer_output(peer, i + n, &data, &size);
+			/* A message can be up to 4GB, the frame too. */
+			if (n > 0 && frame_size + (uint64_t)size > UINT32_MAX)
+				break;
+			frame_size += size;
+		}
+		uint8_t *head = (uint8_t *)peer->frame_head;
+		head[0] = frame_size;
+		head[1] = frame_size >> 8;
+		head[2] = frame_size >> 16;
+		head[3] = frame_size >> 24;
+		peer->frame_head_pos = 0;
+		peer->frame_count = n;
+	}
+	if (peer->frame_head_pos < CHAT_FRAME_HEAD_SIZE) {
+		iov[count].iov_base = peer->frame_head + peer->frame_head_pos;
+		iov[count++].iov_len =
+			CHAT_FRAME_HEAD_SIZE - peer->frame_head_pos;
+	}
+	for (uint32_t end = i + peer->frame_count;
+	     i < end && count < CHAT_SERVER_IOV_MAX; ++i)
+		chat_peer_output_iov(peer, i, &iov[count++]);
+	*is_all = i == peer->out_count;
+	return count;
+}
+
+static void
+chat_shard_replay_peer(struct chat_shard *shard, struct chat_peer *peer);
+
+/**
+ * Flags of a send to @a peer. If the vector does not take all the
+ * output, or the history is still replayed, more output follows. Then
+ * with the cork the kernel holds the tail of the send to pack it with
+ * the next one into a full segment, as with TCP_CORK, but without the
+ * system calls to set and drop it.
+ */
+static inline int
+chat_shard_send_flags(const struct chat_shard *shard,
+		      const struct chat_peer *peer, bool is_all)
+{
+	if (shard->server->is_corked && (!is_all || peer->is_replaying))
+		return MSG_NOSIGNAL | MSG_MORE;
+	return MSG_NOSIGNAL;
+}
+
+#if CHAT_USE_URING
+
+/**
+ * Start a send of the head of the output queue, if there is no send
+ * in progress. Several queued messages go out with one sendmsg(),
+ * the rest is sent when it completes. The output of a replaying peer
+ * is topped up from the history first.
+ */
+static void
+chat_shard_flush_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->is_sending)
+		return;
+	chat_shard_replay_peer(shard, peer);
+	if (peer->out_count == 0 || peer->socket < 0)
+		return;
+	bool is_all;
+	uint32_t count = chat_peer_fill_output(peer, peer->send_iov, &is_all);
+	/* All the text buffers go before a frame. */
+	uint32_t text_count = peer->protocol == CHAT_PROTOCOL_TEXT ?
+			      peer->out_count : peer->out_text_count;
+	peer->send_count = count < text_count ? count : text_count;
+	memset(&peer->send_msg, 0, sizeof(peer->send_msg));
+	peer->send_msg.msg_iov = peer->send_iov;
+	peer->send_msg.msg_iovlen = count;
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(
+		&shard->ring, chat_op_data(peer, CHAT_OP_SEND));
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = peer->socket;
+	sqe->addr = (uintptr_t)&peer->send_msg;
+	sqe->msg_flags = chat_shard_send_flags(shard, peer, is_all);
+	peer->is_sending = true;
+}
+
+#else /* !CHAT_USE_URING */
+
+/**
+ * Send the output queue until it is empty or the socket is full.
+ * Several queued messages go out with one sendmsg(). The output of a
+ * replaying peer is topped up from the history before each send.
+ */
+static void
+chat_shard_flush_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct iovec iov[CHAT_SERVER_IOV_MAX];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while (true) {
+		chat_shard_replay_peer(shard, peer);
+		if (peer->out_count == 0 || peer->socket < 0)
+			return;
+		bool is_all;
+		msg.msg_iovlen = chat_peer_fill_output(peer, iov, &is_all);
+		chat_shard_count_syscall(shard);
+		ssize_t rc = sendmsg(peer->socket, &msg, chat_shard_send_flags(
+			shard, peer, is_all));
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				peer->is_writable = false;
+				return;
+			}
+			chat_shard_close_peer(shard, peer);
+			return;
+		}
+		chat_peer_consume_output(peer, rc);
+		if (peer->is_stalled &&
+		    peer->out_size <= shard->server->out_low)
+			chat_shard_unstall_peer(shard, peer);
+		if (peer->out_count == 0)
+			--shard->pending_output_count;
+	}
+}
+
+#endif /* !CHAT_USE_URING */
+
+/**
+ * Drop the oldest message of the output queue, except the newest one
+ * and the ones being sent: a partially sent one and the records of
+ * the frame being sent. Returns false if there is nothing to drop.
+ */
+static bool
+chat_peer_drop_oldest(struct chat_peer *peer)
+{
+	uint32_t mask = peer->out_capacity - 1;
+	uint32_t frame_begin = peer->out_text_count;
+	uint32_t frame_end = frame_begin + peer->frame_count;
+	uint32_t i = peer->out_pos > 0 ? 1 : 0;
+#if CHAT_USE_URING
+	if (i < peer->send_count)
+		i = peer->send_count;
+#endif
+	const char *data;
+	uint32_t size;
+	struct chat_buffer *buf = NULL;
+	for (; i + 1 < peer->out_count; ++i) {
+		if (i >= frame_begin && i < frame_end)
+			continue;
+		buf = chat_peer_output(peer, i, &data, &size);
+		if (buf->author != NULL)
+			break;
+	}
+	if (i + 1 >= peer->out_count)
+		return false;
+	/* The ones before take the place of the dropped one. */
+	for (uint32_t j = i; j > 0; --j) {
+		peer->out_queue[(peer->out_begin + j) & mask] =
+			peer->out_queue[(peer->out_begin + j - 1) & mask];
+	}
+	peer->out_begin = (peer->out_begin + 1) & mask;
+	--peer->out_count;
+	if (i < peer->out_text_count)
+		--peer->out_text_count;
+	peer->out_size -= size;
+	chat_buffer_unref(buf);
+	return true;
+}
+
+/** Append a reference to the buffer to the peer's output queue. */
+static void
+chat_shard_queue_output(struct chat_shard *shard, struct chat_peer *peer,
+			struct chat_buffer *buf)
+{
+	if (peer->out_count == peer->out_capacity) {
+		uint32_t capacity = peer->out_capacity == 0 ?
+				    8 : peer->out_capacity * 2;
+		struct chat_buffer **queue =
+			malloc(capacity * sizeof(queue[0]));
+		if (queue == NULL)
+			abort();
+		/* Unwrap the ring into the beginning of the new one. */
+		for (uint32_t i = 0; i < peer->out_count; ++i) {
+			queue[i] = peer->out_queue[(peer->out_begin + i) &
+						   (peer->out_capacity - 1)];
+		}
+		free(peer->out_queue);
+		peer->out_queue = queue;
+		peer->out_begin = 0;
+		peer->out_capacity = capacity;
+	}
+	if (peer->out_count == 0)
+		++shard->pending_output_count;
+	++peer->out_count;
+	const char *data;
+	uint32_t size;
+	uint32_t pos = (peer->out_begin + peer->out_count - 1) &
+		       (peer->out_capacity - 1);
+	peer->out_queue[pos] = buf;
+	chat_peer_output(peer, peer->out_count - 1, &data, &size);
+	peer->out_size += size;
+	chat_buffer_ref(buf);
+}
+
+/**
+ * Queue the message to the peer. A binary peer gets the name of the
+ * author first, if the author is new to it. When the queue gets above
+ * the high watermark the overflow policy is applied, the peer can be
+ * closed then.
+ */
+static void
+chat_shard_push_output(struct chat_shard *shard, struct chat_peer *peer,
+		       struct chat_buffer *buf)
+{
+	struct chat_author *author = buf->author;
+	if (peer->protocol == CHAT_PROTOCOL_BINARY &&
+	    !chat_author_map_get(&peer->known_authors, author->id, NULL)) {
+		chat_author_map_put(&peer->known_authors, author->id, NULL);
+		struct chat_buffer *record =
+			chat_buffer_new_author_record(author);
+		chat_shard_queue_output(shard, peer, record);
+		chat_buffer_unref(record);
+	}
+	chat_shard_queue_output(shard, peer, buf);
+
+	struct chat_server *server = shard->server;
+	if (server->out_high == 0 || peer->out_size <= server->out_high)
+		return;
+	if (!peer->is_stalled)
+		chat_shard_stall_peer(shard, peer);
+	switch (server->overflow_policy) {
+	case CHAT_OVERFLOW_DROP_OLDEST:
+		while (peer->out_size > server->out_high &&
+		       chat_peer_drop_oldest(peer)) {
+			__atomic_add_fetch(&server->stat.dropped_msg_count, 1,
+					   __ATOMIC_RELAXED);
+		}
+		break;
+	case CHAT_OVERFLOW_DISCONNECT:
+		__atomic_add_fetch(&server->stat.disconnected_peer_count, 1,
+				   __ATOMIC_RELAXED);
+		chat_shard_close_peer(shard, peer);
+		break;
+	case CHAT_OVERFLOW_STOP_READING:
+		/* The readers stop in chat_shard_read_peer(). */
+		break;
+	}
+}
+
+/** Memory of the buffer, as counted by the history. */
+static inline size_t
+chat_buffer_mem_size(const struct chat_buffer *buf)
+{
+	return sizeof(*buf) + CHAT_RECORD_HEAD_MAX + buf->text_size;
+}
+
+/**
+ * Append the message to the history and forget the oldest ones above
+ * the limits.
+ */
+static void
+chat_shard_remember(struct chat_shard *shard, struct chat_buffer *buf)
+{
+	struct chat_server *server = shard->server;
+	if (server->history_count == 0)
+		return;
+	if (shard->history_count == shard->history_capacity) {
+		uint32_t capacity = shard->history_capacity == 0 ?
+				    8 : shard->history_capacity * 2;
+		struct chat_buffer **history =
+			malloc(capacity * sizeof(history[0]));
+		if (history == NULL)
+			abort();
+		for (uint64_t i = shard->history_end - shard->history_count;
+		     i < shard->history_end; ++i) {
+			history[i & (capacity - 1)] = shard->history[
+				i & (shard->history_capacity - 1)];
+		}
+		free(shard->history);
+		shard->history = history;
+		shard->history_capacity = capacity;
+	}
+	uint32_t mask = shard->history_capacity - 1;
+	chat_buffer_ref(buf);
+	shard->history[shard->history_end++ & mask] = buf;
+	++shard->history_count;
+	shard->history_size += chat_buffer_mem_size(buf);
+	size_t size_max = server->history_size / server->shard_count;
+	while (shard->history_count > server->history_count ||
+	       shard->history_size > size_max) {
+		uint64_t first = shard->history_end - shard->history_count;
+		struct chat_buffer *old = shard->history[first & mask];
+		shard->history_size -= chat_buffer_mem_size(old);
+		--shard->history_count;
+		chat_buffer_unref(old);
+	}
+}
+
+/** Keep a message broadcast during the replay of the peer. */
+static void
+chat_peer_hold(struct chat_peer *peer, struct chat_buffer *buf)
+{
+	if (peer->held_count == peer->held_capacity) {
+		uint32_t capacity = peer->held_capacity == 0 ?
+				    8 : peer->held_capacity * 2;
+		struct chat_buffer **held =
+			realloc(peer->held, capacity * sizeof(held[0]));
+		if (held == NULL)
+			abort();
+		peer->held = held;
+		peer->held_capacity = capacity;
+	}
+	peer->held[peer->held_count++] = buf;
+	peer->held_size += buf->text_size;
+	chat_buffer_ref(buf);
+}
+
+/**
+ * Finish the replay and queue the messages held during it. The part
+ * of the history not replayed yet is counted as dropped.
+ */
+static void
+chat_shard_end_replay(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->replay_pos < peer->replay_end) {
+		__atomic_add_fetch(&shard->server->stat.dropped_msg_count,
+				   peer->replay_end - peer->replay_pos,
+				   __ATOMIC_RELAXED);
+	}
+	peer->is_replaying = false;
+	for (uint32_t i = 0; i < peer->held_count; ++i) {
+		if (peer->socket >= 0)
+			chat_shard_push_output(shard, peer, peer->held[i]);
+		chat_buffer_unref(peer->held[i]);
+	}
+	free(peer->held);
+	peer->held = NULL;
+	peer->held_count = 0;
+	peer->held_capacity = 0;
+	peer->held_size = 0;
+}
+
+/**
+ * Top the output of a replaying peer up from the history, until it
+ * takes CHAT_SERVER_REPLAY_SIZE or the high watermark. So the history
+ * goes out as fast as the peer reads it, a piece per flush, without
+ * holding the reactor or tripping the overflow policy. Only the
+ * messages the history had when the peer came are replayed. The ones
+ * forgotten by the history before their turn are counted as dropped.
+ */
+static void
+chat_shard_replay_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (!peer->is_replaying)
+		return;
+	struct chat_server *server = shard->server;
+	size_t limit = CHAT_SERVER_REPLAY_SIZE;
+	if (server->out_high != 0 && server->out_high < limit)
+		limit = server->out_high;
+	uint64_t first = shard->history_end - shard->history_count;
+	if (peer->replay_pos < first) {
+		if (first > peer->replay_end)
+			first = peer->replay_end;
+		__atomic_add_fetch(&server->stat.dropped_msg_count,
+				   first - peer->replay_pos, __ATOMIC_RELAXED);
+		peer->replay_pos = first;
+	}
+	uint32_t mask = shard->history_capacity - 1;
+	while (peer->replay_pos < peer->replay_end &&
+	       peer->out_size < limit && peer->socket >= 0) {
+		chat_shard_push_output(shard, peer,
+				       shard->history[peer->replay_pos++ & mask]);
+	}
+	if (peer->replay_pos == peer->replay_end)
+		chat_shard_end_replay(shard, peer);
+}
+
+/**
+ * Flush the peer in the end of the update, once for all the output
+ * queued during the update.
+ */
+static inline void
+chat_shard_mark_dirty(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (rlist_empty(&peer->in_dirty))
+		rlist_add_tail_entry(&shard->dirty_peers, peer, in_dirty);
+}
+
+/**
+ * Send the buffer to all the shard's peers except the author, and
+ * remember it in the history. The replaying peers hold it until the
+ * replay ends. If the held messages do not fit into the output limit,
+ * the rest of the history is given up for them.
+ */
+static void
+chat_shard_send_all(struct chat_shard *shard, struct chat_peer *author,
+		    struct chat_buffer *buf)
+{
+	struct chat_server *server = shard->server;
+	chat_shard_remember(shard, buf);
+	struct chat_peer *peer, *tmp;
+	rlist_foreach_entry_safe(peer, &shard->peers, in_peers, tmp) {
+		if (peer == author)
+			continue;
+		if (peer->is_replaying) {
+			chat_peer_hold(peer, buf);
+			if (server->out_high == 0 ||
+			    peer->out_size + peer->held_size <= server->out_high)
+				continue;
+			chat_shard_end_replay(shard, peer);
+		} else {
+#ifdef CHAT_COPY_OUTPUT
+			/* A copy per peer, to compare with the shared buffers. */
+			struct chat_buffer *copy = chat_buffer_new(buf->author,
+				buf->data + CHAT_RECORD_HEAD_MAX,
+				buf->text_size - 1);
+			chat_shard_push_output(shard, peer, copy);
+			chat_buffer_unref(copy);
+#else
+			chat_shard_push_output(shard, peer, buf);
+#endif
+		}
+		if (peer->socket >= 0 && peer->is_writable)
+			chat_shard_mark_dirty(shard, peer);
+	}
+}
+
+/**
+ * Add the accepted peer and start sending it the history. Nagle's
+ * algorithm is off, the output is coalesced by the flushes instead,
+ * so it would only delay the tails.
+ */
+static void
+chat_shard_add_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	int value = 1;
+	setsockopt(peer->socket, IPPROTO_TCP, TCP_NODELAY, &value,
+		   sizeof(value));
+	rlist_add_tail_entry(&shard->peers, peer, in_peers);
+	if (shard->history_count == 0)
+		return;
+	peer->is_replaying = true;
+	peer->replay_pos = shard->history_end - shard->history_count;
+	peer->replay_end = shard->history_end;
+	chat_shard_mark_dirty(shard, peer);
+}
+
+/**
+ * Post a message to another shard. Its inbox is a lock-free stack,
+ * the eventfd is written only when the stack was empty, as then the
+ * owner could be sleeping. Otherwise the wakeup is already pending.
+ */
+static void
+chat_shard_post(struct chat_shard *shard, struct chat_buffer *buf)
+{
+	/* The buffer belongs to the consumer right after the exchange. */
+	struct chat_buffer *top = __atomic_load_n(&shard->inbox,
+						  __ATOMIC_RELAXED);
+	do
+		buf->next = top;
+	while (!__atomic_compare_exchange_n(&shard->inbox, &top, buf, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (top == NULL)
+		chat_wakeup(shard->inbox_fd);
+}
+
+/**
+ * Send the messages posted by the other shards to all the local
+ * peers. The stack is taken whole and reversed into the order of
+ * posting, so the messages of one author keep their order.
+ */
+static void
+chat_shard_read_inbox(struct chat_shard *shard)
+{
+	uint64_t value;
+	while (read(shard->inbox_fd, &value, sizeof(value)) < 0 &&
+	       errno == EINTR)
+		;
+	struct chat_buffer *list = __atomic_exchange_n(&shard->inbox, NULL,
+						       __ATOMIC_ACQUIRE);
+	struct chat_buffer *buf = NULL;
+	while (list != NULL) {
+		struct chat_buffer *next = list->next;
+		list->next = buf;
+		buf = list;
+		list = next;
+	}
+	while (buf != NULL) {
+		struct chat_buffer *next = buf->next;
+		chat_shard_send_all(shard, NULL, buf);
+		chat_buffer_unref(buf);
+		buf = next;
+	}
+}
+
+/**
+ * Queue the message to the app and send it to all but the author,
+ * the peers of the other shards get it through their inboxes. Each
+ * shard has an own copy, so the reference counters are never shared
+ * between the threads.
+ */
+static void
+chat_shard_broadcast(struct chat_shard *shard, struct chat_peer *peer,
+		     const char *data, size_t size)
+{
+	struct chat_server *server = shard->server;
+	__atomic_add_fetch(&shard->msg_count, 1, __ATOMIC_RELAXED);
+	chat_server_deliver(server, chat_message_new(data, size));
+	/* A text peer has no name, its author is created by need. */
+	if (peer->author == NULL)
+		peer->author = chat_author_new(server, "", 0);
+	/* The reference keeps the buffer while it is sent to the peers. */
+	struct chat_buffer *buf = chat_buffer_new(peer->author, data, size);
+	chat_shard_send_all(shard, peer, buf);
+	chat_buffer_unref(buf);
+	for (int i = 0; i < server->shard_count; ++i) {
+		if (&server->shards[i] != shard)
+			chat_shard_post(&server->shards[i],
+					chat_buffer_new(peer->author, data,
+							size));
+	}
+}
+
+/**
+ * Find out the protocol of the peer by its first byte. A binary one
+ * starts with a hello. It is answered, and the output is switched to
+ * the binary protocol after the answer. The messages queued before
+ * are sent as text yet.
+ *
+ * @retval true The protocol is known.
+ * @retval false Not enough data, or the peer is closed.
+ */
+static bool
+chat_shard_parse_hello(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_input *in = &peer->input;
+	const char *pos = in->buf + in->pos;
+	const char *end = in->buf + in->size;
+	if (pos == end)
+		return false;
+	if (*pos != 0) {
+		peer->is_protocol_known = true;
+		return true;
+	}
+	if (end - pos < 2)
+		return false;
+	if (pos[1] != CHAT_BINARY_VERSION)
+		goto error;
+	uint32_t name_size;
+	const char *name = chat_varint_decode(pos + 2, end, &name_size);
+	if (name == NULL) {
+		if (end - pos >= 2 + 5)
+			goto error;
+		return false;
+	}
+	if ((size_t)(end - name) < name_size)
+		return false;
+	peer->author = chat_author_new(shard->server, name, name_size);
+	in->pos = name + name_size - in->buf;
+	in->scanned = in->pos;
+
+	struct chat_buffer *answer = chat_buffer_alloc(NULL, 2);
+	answer->data[CHAT_RECORD_HEAD_MAX] = 0;
+	answer->data[CHAT_RECORD_HEAD_MAX + 1] = CHAT_BINARY_VERSION;
+	answer->text_size = 2;
+	chat_shard_queue_output(shard, peer, answer);
+	chat_buffer_unref(answer);
+	peer->out_text_count = peer->out_count;
+	peer->protocol = CHAT_PROTOCOL_BINARY;
+	peer->is_protocol_known = true;
+	if (peer->is_writable)
+		chat_shard_mark_dirty(shard, peer);
+	return true;
+
+error:
+	chat_shard_close_peer(shard, peer);
+	return false;
+}
+
+/**
+ * Broadcast the messages of the complete frames of the input, until
+ * the reading is stopped. A frame is broadcast whole.
+ */
+static void
+chat_shard_parse_frames(struct chat_shard *shard, struct chat_peer *peer)
+{
+	char *frame;
+	size_t frame_size = 0;
+	while (!chat_shard_is_reading_stopped(shard) &&
+	       (frame = chat_input_next_frame(&peer->input,
+					      CHAT_CLIENT_FRAME_MAX,
+					      &frame_size)) != NULL) {
+		const char *pos = frame;
+		const char *end = frame + frame_size;
+		while (pos < end) {
+			uint32_t msg_size;
+			pos = chat_varint_decode(pos, end, &msg_size);
+			if (pos == NULL || (size_t)(end - pos) < msg_size) {
+				chat_shard_close_peer(shard, peer);
+				return;
+			}
+			size_t size = msg_size;
+			char *data = chat_trim((char *)pos, &size);
+			if (size > 0)
+				chat_shard_broadcast(shard, peer, data, size);
+			pos += msg_size;
+		}
+	}
+	/* The peer would make the server buffer the frame whole. */
+	if (frame_size > CHAT_CLIENT_FRAME_MAX)
+		chat_shard_close_peer(shard, peer);
+}
+
+/**
+ * Broadcast the complete messages of the input, until the reading is
+ * stopped. The rest is left in the input till the reading resumes.
+ */
+static void
+chat_shard_parse_input(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (!peer->is_protocol_known && !chat_shard_parse_hello(shard, peer))
+		return;
+	if (peer->protocol == CHAT_PROTOCOL_BINARY) {
+		chat_shard_parse_frames(shard, peer);
+		return;
+	}
+	char *data;
+	size_t size;
+	while (!chat_shard_is_reading_stopped(shard) &&
+	       (data = chat_input_next(&peer->input, &size)) != NULL) {
+		data = chat_trim(data, &size);
+		if (size > 0)
+			chat_shard_broadcast(shard, peer, data, size);
+	}
+}
+
+static void
+chat_shard_read_peer(struct chat_shard *shard, struct chat_peer *peer);
+
+/**
+ * Flush the binary peers and read the peers left unread, if the
+ * reading is resumed. A flush can resume the reading, and the reading
+ * gives new output.
+ */
+static void
+chat_shard_flush_dirty(struct chat_shard *shard)
+{
+	do {
+		while (!rlist_empty(&shard->dirty_peers)) {
+			struct chat_peer *peer = rlist_shift_entry(
+				&shard->dirty_peers, struct chat_peer,
+				in_dirty);
+			rlist_create(&peer->in_dirty);
+			chat_shard_flush_peer(shard, peer);
+		}
+		while (!rlist_empty(&shard->paused_peers) &&
+		       !chat_shard_is_reading_stopped(shard)) {
+			struct chat_peer *peer = rlist_shift_entry(
+				&shard->paused_peers, struct chat_peer,
+				in_paused);
+			rlist_create(&peer->in_paused);
+			chat_shard_read_peer(shard, peer);
+		}
+	} while (!rlist_empty(&shard->dirty_peers));
+}
+
+#if CHAT_USE_URING
+
+/**
+ * Broadcast the received messages and receive more. While the reading
+ * is stopped the receive is cancelled, the data received before the
+ * cancellation waits in the input.
+ */
+static void
+chat_shard_read_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	chat_shard_parse_input(shard, peer);
+	if (peer->socket < 0)
+		return;
+	if (chat_shard_is_reading_stopped(shard)) {
+		if (rlist_empty(&peer->in_paused)) {
+			rlist_add_tail_entry(&shard->paused_peers, peer,
+					     in_paused);
+			if (peer->is_recv_armed)
+				chat_uring_prep_cancel(&shard->ring,
+					chat_op_data(peer, CHAT_OP_RECV));
+		}
+		return;
+	}
+	if (!peer->is_recv_armed) {
+		peer->is_recv_armed = true;
+		chat_uring_prep_recv(&shard->ring, peer->socket,
+				     chat_op_data(peer, CHAT_OP_RECV));
+	}
+}
+
+/**
+ * Take a received piece of data from the provided buffer. The buffer
+ * goes back to the kernel right away.
+ */
+static void
+chat_shard_complete_recv(struct chat_shard *shard, struct chat_peer *peer,
+			 const struct io_uring_cqe *cqe)
+{
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+		peer->is_recv_armed = false;
+	if (cqe->res > 0 && peer->socket >= 0) {
+		struct chat_input *in = &peer->input;
+		chat_input_reserve(in, cqe->res);
+		memcpy(in->buf + in->size, chat_uring_buf(&shard->ring, cqe),
+		       cqe->res);
+		in->size += cqe->res;
+	}
+	if ((cqe->flags & IORING_CQE_F_BUFFER) != 0)
+		chat_uring_recycle(&shard->ring, cqe);
+	if (peer->socket < 0)
+		return;
+	/*
+	 * EOF or an error. Out of the buffers or cancelled by a pause
+	 * are not errors, the receive is started again.
+	 */
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS &&
+			      cqe->res != -ECANCELED)) {
+		chat_shard_close_peer(shard, peer);
+		return;
+	}
+	chat_shard_read_peer(shard, peer);
+}
+
+/** Drop the sent output, and send the rest. */
+static void
+chat_shard_complete_send(struct chat_shard *shard, struct chat_peer *peer,
+			 const struct io_uring_cqe *cqe)
+{
+	peer->is_sending = false;
+	peer->send_count = 0;
+	if (peer->socket < 0)
+		return;
+	if (cqe->res < 0) {
+		chat_shard_close_peer(shard, peer);
+		return;
+	}
+	chat_peer_consume_output(peer, cqe->res);
+	if (peer->is_stalled && peer->out_size <= shard->server->out_low)
+		chat_shard_unstall_peer(shard, peer);
+	if (peer->out_count == 0)
+		--shard->pending_output_count;
+	chat_shard_mark_dirty(shard, peer);
+}
+
+/** Add the accepted client. */
+static int
+chat_shard_complete_accept(struct chat_shard *shard,
+			   const struct io_uring_cqe *cqe)
+{
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0 && shard->socket >= 0)
+		chat_shard_prep_accept(shard);
+	if (cqe->res < 0) {
+		if (cqe->res == -ECANCELED || cqe->res == -ECONNABORTED)
+			return 0;
+		errno = -cqe->res;
+		return CHAT_ERR_SYS;
+	}
+	struct chat_peer *peer = chat_peer_new(cqe->res);
+	peer->is_recv_armed = true;
+	chat_uring_prep_recv(&shard->ring, peer->socket,
+			     chat_op_data(peer, CHAT_OP_RECV));
+	chat_shard_add_peer(shard, peer);
+	return 0;
+}
+
+/**
+ * Handle the completions of the shard's operations. The new ones are
+ * submitted in the end, so the ring's descriptor is not readable
+ * before they complete.
+ */
+static int
+chat_shard_update(struct chat_shard *shard, double timeout)
+{
+	struct chat_uring *ring = &shard->ring;
+	if (chat_uring_wait(ring, timeout) != 0)
+		return CHAT_ERR_SYS;
+	int rc = CHAT_ERR_TIMEOUT;
+	struct io_uring_cqe *cqe;
+	while ((cqe = chat_uring_peek(ring)) != NULL) {
+		if (rc == CHAT_ERR_TIMEOUT)
+			rc = 0;
+		void *owner = (void *)(uintptr_t)(cqe->user_data &
+						  ~(uint64_t)CHAT_OP_MASK);
+		switch (cqe->user_data & CHAT_OP_MASK) {
+		case CHAT_OP_ACCEPT:
+			if (chat_shard_complete_accept(shard, cqe) != 0)
+				rc = CHAT_ERR_SYS;
+			break;
+		case CHAT_OP_INBOX:
+			if ((cqe->flags & IORING_CQE_F_MORE) == 0 &&
+			    cqe->res != -ECANCELED)
+				chat_shard_prep_inbox(shard);
+			chat_shard_read_inbox(shard);
+			break;
+		case CHAT_OP_RECV:
+			chat_shard_complete_recv(shard, owner, cqe);
+			break;
+		case CHAT_OP_SEND:
+			chat_shard_complete_send(shard, owner, cqe);
+			break;
+		}
+		chat_uring_advance(ring);
+	}
+	chat_shard_flush_dirty(shard);
+	struct chat_peer *peer, *tmp;
+	rlist_foreach_entry_safe(peer, &shard->closed_peers, in_peers, tmp) {
+		if (peer->is_recv_armed || peer->is_sending)
+			continue;
+		rlist_del_entry(peer, in_peers);
+		chat_peer_delete(peer);
+	}
+	if (chat_uring_submit(ring) != 0)
+		return CHAT_ERR_SYS;
+	return rc;
+}
+
+#else /* !CHAT_USE_URING */
+
+/** Read the socket until EAGAIN, as required by the edge-triggered mode. */
+static void
+chat_shard_read_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	while (peer->socket >= 0) {
+		if (chat_shard_is_reading_stopped(shard)) {
+			/* The rest is read when the reading resumes. */
+			if (rlist_empty(&peer->in_paused)) {
+				rlist_add_tail_entry(&shard->paused_peers, peer,
+						     in_paused);
+			}
+			return;
+		}
+		/* The messages left by a stop go before the new ones. */
+		chat_shard_parse_input(shard, peer);
+		if (peer->socket < 0 || chat_shard_is_reading_stopped(shard))
+			continue;
+		struct chat_input *in = &peer->input;
+		chat_input_reserve(in, CHAT_SERVER_READ_SIZE);
+		chat_shard_count_syscall(shard);
+		ssize_t rc = recv(peer->socket, in->buf + in->size,
+				  in->capacity - in->size, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (rc <= 0) {
+			chat_shard_close_peer(shard, peer);
+			return;
+		}
+		in->size += rc;
+	}
+}
+
+/** Accept all the pending clients, until EAGAIN. */
+static int
+chat_shard_accept(struct chat_shard *shard)
+{
+	while (true) {
+		chat_shard_count_syscall(shard);
+		int sock = accept4(shard->socket, NULL, NULL,
+				   SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return CHAT_ERR_SYS;
+		}
+		struct chat_peer *peer = chat_peer_new(sock);
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.ptr = peer;
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, sock,
+			      &event) != 0) {
+			close(sock);
+			free(peer);
+			return CHAT_ERR_SYS;
+		}
+		chat_shard_add_peer(shard, peer);
+	}
+}
+
+/** Handle one batch of events of the shard. */
+static int
+chat_shard_update(struct chat_shard *shard, double timeout)
+{
+	struct epoll_event events[CHAT_SERVER_EVENT_BATCH];
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	chat_shard_count_syscall(shard);
+	int count = epoll_wait(shard->epoll_fd, events,
+			       CHAT_SERVER_EVENT_BATCH, timeout_ms);
+	if (count < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (count == 0)
+		return CHAT_ERR_TIMEOUT;
+
+	int rc = 0;
+	for (int i = 0; i < count; ++i) {
+		if (events[i].data.ptr == shard) {
+			if (chat_shard_accept(shard) != 0)
+				rc = CHAT_ERR_SYS;
+			continue;
+		}
+		if (events[i].data.ptr == &shard->inbox_fd) {
+			chat_shard_read_inbox(shard);
+			continue;
+		}
+		struct chat_peer *peer = events[i].data.ptr;
+		if (peer->socket < 0)
+			continue;
+		if ((events[i].events & EPOLLOUT) != 0) {
+			peer->is_writable = true;
+			chat_shard_mark_dirty(shard, peer);
+		}
+		if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0)
+			chat_shard_read_peer(shard, peer);
+	}
+	chat_shard_flush_dirty(shard);
+	while (!rlist_empty(&shard->closed_peers)) {
+		chat_peer_delete(rlist_shift_entry(&shard->closed_peers,
+						   struct chat_peer, in_peers));
+	}
+	return rc;
+}
+
+#endif /* !CHAT_USE_URING */
+
+static void *
+chat_shard_thread_f(void *arg)
+{
+	struct chat_shard *shard = arg;
+	struct chat_server *server = shard->server;
+	/*
+	 * The errors are not fatal, like accept() failing on a too
+	 * high count of descriptors, so the loop goes on.
+	 */
+	while (!__atomic_load_n(&server->is_stopped, __ATOMIC_ACQUIRE))
+		chat_shard_update(shard, -1);
 	return NULL;
 }
 
+/**
+ * Wait for the messages received by the threads and move them into
+ * the list for chat_server_pop_next() in the order of receipt.
+ */
+static int
+chat_server_read_inbox(struct chat_server *server, double timeout)
+{
+	struct pollfd pfd;
+	pfd.fd = server->msg_inbox_fd;
+	pfd.events = POLLIN;
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	int rc = poll(&pfd, 1, timeout_ms);
+	if (rc < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (rc == 0)
+		return CHAT_ERR_TIMEOUT;
+	uint64_t value;
+	while (read(server->msg_inbox_fd, &value, sizeof(value)) < 0 &&
+	       errno == EINTR)
+		;
+	struct chat_message *list = __atomic_exchange_n(
+		&server->msg_inbox, NULL, __ATOMIC_ACQUIRE);
+	if (list == NULL)
+		return CHAT_ERR_TIMEOUT;
+	struct chat_message *last = list;
+	struct chat_message *first = NULL;
+	while (list != NULL) {
+		struct chat_message *next = list->next;
+		list->next = first;
+		first = list;
+		list = next;
+	}
+	chat_server_append(server, first, last);
+	return 0;
+}
+
 int
 chat_server_update(struct chat_server *server, double timeout)
 {
-	/*
-	 * 1) Wait on epoll/kqueue/poll for update on any socket.
-	 * 2) Handle the update.
-	 * 2.1) If the update was on listen-socket, then you probably need to
-	 *     call accept() on it - a new client wants to join.
-	 * 2.2) If the update was on a client-socket, then you might want to
-	 *     read/write on it.
-	 */
-	(void)server;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (server->shards == NULL)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->thread_count > 0)
+		return chat_server_read_inbox(server, timeout);
+	return chat_shard_update(&server->shards[0], timeout);
 }
 
 int
 chat_server_get_descriptor(const struct chat_server *server)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
-
+	if (server->shards == NULL)
+		return -1;
 	/*
-	 * Server has multiple sockets - own and from connected clients. Hence
-	 * you can't return a socket here. But if you are using epoll/kqueue,
-	 * then you can return their descriptor. These descriptors can be polled
-	 * just like sockets and will return an event when any of their owned
-	 * descriptors has any events.
-	 *
-	 * For example, assume you created an epoll descriptor and added to
-	 * there a listen-socket and a few client-sockets. Now if you will call
-	 * poll() on the epoll's descriptor, then on return from poll() you can
-	 * be sure epoll_wait() can return something useful for some of those
-	 * sockets.
+	 * With threads only the received messages are waited for, the
+	 * sockets are handled by the threads themselves.
 	 */
+	if (server->thread_count > 0)
+		return server->msg_inbox_fd;
+#if CHAT_USE_URING
+	/* The ring's descriptor is readable when it has completions. */
+	return server->shards[0].ring.fd;
+#else
+	/*
+	 * The epoll descriptor is readable when any of the server's
+	 * sockets has an event.
+	 */
+	return server->shards[0].epoll_fd;
 #endif
-	(void)server;
-	return -1;
 }
 
 int
 chat_server_get_socket(const struct chat_server *server)
 {
-	return server->socket;
+	if (server->shards == NULL)
+		return -1;
+	return server->shards[0].socket;
 }
 
 int
 chat_server_get_events(const struct chat_server *server)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer in any of the client-sockets.
-	 */
-	(void)server;
+	if (server->shards == NULL)
+		return 0;
+#if CHAT_USE_URING
+	/* The sends are done by the ring and complete as the input. */
 	return CHAT_EVENT_INPUT;
+#else
+	if (server->thread_count == 0 &&
+	    server->shards[0].pending_output_count > 0)
+		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
+	return CHAT_EVENT_INPUT;
+#endif
 }
 
 int
@@ -1,9 +1,54 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_server;
 
+/** What to do with a peer which does not read its messages. */
+enum chat_overflow_policy {
+	/**
+	 * Drop the oldest messages of the peer, so its output stays
+	 * below the high watermark.
+	 */
+	CHAT_OVERFLOW_DROP_OLDEST,
+	/** Disconnect the peer. */
+	CHAT_OVERFLOW_DISCONNECT,
+	/**
+	 * Stop reading from all the peers until the output of the
+	 * peer is sent down to the low watermark. The senders are
+	 * throttled by TCP then.
+	 */
+	CHAT_OVERFLOW_STOP_READING,
+};
+
+struct chat_server_stat {
+	/**
+	 * Messages dropped from the output of the peers, including the
+	 * ones gone from the history before they were replayed.
+	 */
+	uint64_t dropped_msg_count;
+	/** How many times an output reached the high watermark. */
+	uint64_t stall_count;
+	/**
+	 * Peers having the output reached the high watermark and not
+	 * sent down to the low one yet.
+	 */
+	uint64_t stalled_peer_count;
+	/** Peers disconnected by CHAT_OVERFLOW_DISCONNECT. */
+	uint64_t disconnected_peer_count;
+	/** Messages received from the peers. */
+	uint64_t msg_count;
+	/**
+	 * System calls of the network I/O: the waits, accepts, receives
+	 * and sends. With io_uring these are io_uring_enter() calls, the
+	 * operations themselves are done by the kernel. Divided by
+	 * msg_count it shows how well the output is coalesced.
+	 */
+	uint64_t syscall_count;
+};
+
 /**
  * Create a new chat server. No bind, no listen, just allocate and
  * initialize it.
@@ -15,6 +60,74 @@ chat_server_new(void);
 void
 chat_server_delete(struct chat_server *server);
 
+/**
+ * Run the server in @a count threads, each with its own listening
+ * socket and a part of the clients. The sockets share the port with
+ * SO_REUSEPORT, so the kernel balances the new clients between them.
+ * Then chat_server_update() only collects the messages received by
+ * the threads. 0, the default, means no threads: all the work is
+ * done by chat_server_update() in the caller's thread.
+ *
+ * Note, that other processes of the same user can bind the port with
+ * SO_REUSEPORT too, so CHAT_ERR_PORT_BUSY is not guaranteed then.
+ *
+ * @retval 0 Success.
+ * @retval CHAT_ERR_ALREADY_STARTED The server is already listening.
+ */
+int
+chat_server_set_thread_count(struct chat_server *server, int count);
+
+/**
+ * Limit the output queued for one peer. When the not sent messages
+ * take more than @a high bytes, the @a policy is applied. The peer
+ * counts as stalled until its output is sent down to @a low bytes.
+ * By default there is no limit, the same as @a high 0.
+ *
+ * @retval 0 Success.
+ * @retval CHAT_ERR_INVALID_ARGUMENT @a low is above @a high.
+ * @retval CHAT_ERR_ALREADY_STARTED The server is already listening.
+ */
+int
+chat_server_set_output_limit(struct chat_server *server, size_t high,
+			     size_t low, enum chat_overflow_policy policy);
+
+/**
+ * Keep the last @a count messages, taking no more than @a size bytes
+ * of memory, and send them to each new client before the new ones.
+ * The history holds the same buffers as the output queues, so a
+ * message is not copied for it. The messages broadcast while a client
+ * gets the history are sent after it. If they exceed the output limit
+ * first, the rest of the history is dropped for the client instead.
+ * With threads each thread keeps a copy of the history for its own
+ * clients, and @a size is split between them evenly, so all the copies
+ * take no more than @a size together. By default there is no history,
+ * the same as @a count 0.
+ *
+ * @retval 0 Success.
+ * @retval CHAT_ERR_ALREADY_STARTED The server is already listening.
+ */
+int
+chat_server_set_history(struct chat_server *server, uint32_t count,
+			size_t size);
+
+/**
+ * Cork the output during a flush of a peer: a burst which takes more
+ * than one send goes out in full TCP segments, like with TCP_CORK.
+ * Only the last send of the flush pushes the data right away. Off by
+ * default. Nagle's algorithm is always off, as the output of one
+ * update is coalesced and sent to a peer at once anyway.
+ *
+ * @retval 0 Success.
+ * @retval CHAT_ERR_ALREADY_STARTED The server is already listening.
+ */
+int
+chat_server_set_cork(struct chat_server *server, bool is_corked);
+
+/** Get the counters of the server. */
+void
+chat_server_get_stat(const struct chat_server *server,
+		     struct chat_server_stat *stat);
+
 /**
  * Try to listen for new clients on the given port.
  *
@@ -36,6 +36,13 @@ main(int argc, char **argv)
 		return -1;
 	}
 	struct chat_server *serv = chat_server_new();
+	/* The optional second argument is a count of threads. */
+	if (argc > 2 &&
+	    chat_server_set_thread_count(serv, atoi(argv[2])) != 0) {
+		printf("Couldn't set the thread count\n");
+		chat_server_delete(serv);
+		return -1;
+	}
 	rc = chat_server_listen(serv, port);
 	if (rc != 0) {
 		printf("Couldn't listen: %d\n", rc);
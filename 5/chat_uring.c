@@ -0,0 +1,284 @@
+#include "chat.h"
+
+#if CHAT_USE_URING
+
+#include "chat_uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int
+chat_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+		 uint32_t flags, const void *arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       arg, arg_size);
+}
+
+static void *
+chat_uring_map(int fd, size_t size, off_t offset)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, fd, offset);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/** Unmap what is mapped and close the ring. */
+static void
+chat_uring_free(struct chat_uring *ring)
+{
+	if (ring->buf_ring != NULL)
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	if (ring->bufs != NULL)
+		munmap(ring->bufs, (size_t)ring->buf_count * ring->buf_size);
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr != NULL)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/**
+ * Register the ring of the provided buffers and give all of them to
+ * the kernel. The memory is mapped, as the ring has to be aligned to
+ * a page.
+ */
+static int
+chat_uring_create_bufs(struct chat_uring *ring, uint32_t count, uint32_t size)
+{
+	ring->buf_count = count;
+	ring->buf_size = size;
+	ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, ring->buf_ring_size,
+			      PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		return -1;
+	}
+	ring->bufs = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->bufs == MAP_FAILED) {
+		ring->bufs = NULL;
+		return -1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring->buf_ring;
+	reg.ring_entries = count;
+	reg.bgid = CHAT_URING_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		return -1;
+	for (uint32_t i = 0; i < count; ++i) {
+		struct io_uring_buf *buf = &ring->buf_ring->bufs[i];
+		buf->addr = (uintptr_t)(ring->bufs + (size_t)i * size);
+		buf->len = size;
+		buf->bid = i;
+	}
+	ring->buf_tail = count;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail,
+			 __ATOMIC_RELEASE);
+	return 0;
+}
+
+int
+chat_uring_create(struct chat_uring *ring, uint32_t entries,
+		  uint32_t cq_entries, uint32_t buf_count, uint32_t buf_size)
+{
+	memset(ring, 0, sizeof(*ring));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = cq_entries;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+		/* The timed wait needs it, since 5.11. */
+		errno = ENOSYS;
+		goto error;
+	}
+	ring->sq_size = params.sq_off.array +
+			params.sq_entries * sizeof(uint32_t);
+	ring->cq_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = chat_uring_map(ring->fd, ring->sq_size,
+				      IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == NULL)
+		goto error;
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		ring->cq_ptr = ring->sq_ptr;
+	else
+		ring->cq_ptr = chat_uring_map(ring->fd, ring->cq_size,
+					      IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == NULL)
+		goto error;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = chat_uring_map(ring->fd, ring->sqes_size,
+				    IORING_OFF_SQES);
+	if (ring->sqes == NULL)
+		goto error;
+
+	char *sq = ring->sq_ptr;
+	ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+	ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+	ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+	ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	char *cq = ring->cq_ptr;
+	ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+	ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	if (chat_uring_create_bufs(ring, buf_count, buf_size) != 0)
+		goto error;
+	return 0;
+
+error: {
+	int err = errno;
+	chat_uring_free(ring);
+	errno = err;
+	return -1;
+}
+}
+
+void
+chat_uring_destroy(struct chat_uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+	/*
+	 * The kernel can write into the buffers until the operations
+	 * complete, even after the ring is closed.
+	 */
+	if (ring->op_count > 0) {
+		struct io_uring_sqe *sqe = chat_uring_get_sqe(ring, 0);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL |
+				    IORING_ASYNC_CANCEL_ANY;
+	}
+	while (ring->op_count > 0) {
+		if (chat_uring_wait(ring, -1) != 0)
+			break;
+		while (chat_uring_peek(ring) != NULL)
+			chat_uring_advance(ring);
+	}
+	chat_uring_free(ring);
+}
+
+/** Make the new entries visible to the kernel and submit them. */
+static int
+chat_uring_flush(struct chat_uring *ring, uint32_t min_complete,
+		 uint32_t flags, const void *arg, size_t arg_size)
+{
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	uint32_t to_submit = ring->sq_local_tail -
+			     __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	/* Read by other threads. */
+	__atomic_add_fetch(&ring->enter_count, 1, __ATOMIC_RELAXED);
+	if (chat_uring_enter(ring->fd, to_submit, min_complete, flags, arg,
+			     arg_size) >= 0)
+		return 0;
+	/*
+	 * Interrupted, timed out, or the completion queue is overflown.
+	 * The caller reaps the completions and comes again.
+	 */
+	if (errno == EINTR || errno == ETIME || errno == EBUSY ||
+	    errno == EAGAIN)
+		return 0;
+	return -1;
+}
+
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring, uint64_t user_data)
+{
+	while (ring->sq_local_tail - __atomic_load_n(ring->sq_head,
+						     __ATOMIC_ACQUIRE) ==
+	       ring->sq_entries)
+		chat_uring_flush(ring, 0, 0, NULL, 0);
+	uint32_t index = ring->sq_local_tail++ & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	if (user_data != 0)
+		++ring->op_count;
+	return sqe;
+}
+
+int
+chat_uring_submit(struct chat_uring *ring)
+{
+	if (ring->sq_local_tail == __atomic_load_n(ring->sq_head,
+						   __ATOMIC_ACQUIRE))
+		return 0;
+	return chat_uring_flush(ring, 0, 0, NULL, 0);
+}
+
+int
+chat_uring_wait(struct chat_uring *ring, double timeout)
+{
+	uint32_t flags = IORING_ENTER_GETEVENTS;
+	if (timeout == 0 || chat_uring_peek(ring) != NULL)
+		return chat_uring_flush(ring, 0, flags, NULL, 0);
+	if (timeout < 0)
+		return chat_uring_flush(ring, 1, flags, NULL, 0);
+	struct __kernel_timespec ts;
+	ts.tv_sec = (int64_t)timeout;
+	ts.tv_nsec = (int64_t)((timeout - ts.tv_sec) * 1e9);
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uintptr_t)&ts;
+	return chat_uring_flush(ring, 1, flags | IORING_ENTER_EXT_ARG, &arg,
+				sizeof(arg));
+}
+
+void
+chat_uring_recycle(struct chat_uring *ring, const struct io_uring_cqe *cqe)
+{
+	struct io_uring_buf *buf =
+		&ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+	buf->addr = (uintptr_t)chat_uring_buf(ring, cqe);
+	buf->len = ring->buf_size;
+	buf->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	++ring->buf_tail;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail,
+			 __ATOMIC_RELEASE);
+}
+
+void
+chat_uring_prep_recv(struct chat_uring *ring, int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring, user_data);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = CHAT_URING_BUF_GROUP;
+}
+
+void
+chat_uring_prep_cancel(struct chat_uring *ring, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring, 0);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = user_data;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+
+#endif /* CHAT_USE_URING */
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A minimal io_uring on the raw system calls, only what the server
+ * and the client need: the rings mapped into the process, one group
+ * of provided buffers for the multishot receives, and the submission
+ * with a wait for the completions.
+ *
+ * The user_data of an operation is a pointer to its owner with a tag
+ * in the low bits. 0 is for the operations without an owner, like the
+ * cancellations, their completions are skipped.
+ */
+struct chat_uring {
+	int fd;
+	/** Submission queue. */
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_array;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	struct io_uring_sqe *sqes;
+	/** Tail with the entries got but not submitted yet. */
+	uint32_t sq_local_tail;
+	/** Completion queue. */
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+	/** The mapped memory, to unmap it in the end. */
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	/** Ring of the provided buffers, and the buffers themselves. */
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	char *bufs;
+	uint32_t buf_count;
+	uint32_t buf_size;
+	uint16_t buf_tail;
+	/**
+	 * Operations of the owners which are not complete yet. The ring
+	 * is freed only when it is 0.
+	 */
+	uint32_t op_count;
+	/** Count of io_uring_enter() calls, for the statistics. */
+	uint64_t enter_count;
+};
+
+enum {
+	/** Group ID of the provided buffers. */
+	CHAT_URING_BUF_GROUP = 0,
+};
+
+/**
+ * Create the ring with @a entries of the submission queue and
+ * @a cq_entries of the completion queue, and register @a buf_count
+ * buffers of @a buf_size. The count is a power of 2.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+chat_uring_create(struct chat_uring *ring, uint32_t entries,
+		  uint32_t cq_entries, uint32_t buf_count, uint32_t buf_size);
+
+/**
+ * Cancel all the operations, wait for their completions, and free the
+ * ring. The owners must not use the completions anymore.
+ */
+void
+chat_uring_destroy(struct chat_uring *ring);
+
+/**
+ * Get a zeroed submission entry with the @a user_data. When the queue
+ * is full, the entries got before are submitted first. An operation
+ * with an owner is counted until its last completion is advanced.
+ */
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring, uint64_t user_data);
+
+/**
+ * Submit the new entries, if there are any.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+chat_uring_submit(struct chat_uring *ring);
+
+/**
+ * Submit the new entries and wait for a completion, for @a timeout
+ * seconds, < 0 for infinity. With 0 timeout only the pending kernel
+ * work is done, without sleeping.
+ *
+ * @retval 0 Success or timeout.
+ * @retval -1 Error, errno is set.
+ */
+int
+chat_uring_wait(struct chat_uring *ring, double timeout);
+
+/** Take the next completion, or NULL if there is none. */
+static inline struct io_uring_cqe *
+chat_uring_peek(struct chat_uring *ring)
+{
+	uint32_t head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/** Free the completion taken by chat_uring_peek(). */
+static inline void
+chat_uring_advance(struct chat_uring *ring)
+{
+	uint32_t head = *ring->cq_head;
+	const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+	if (cqe->user_data != 0 && (cqe->flags & IORING_CQE_F_MORE) == 0)
+		--ring->op_count;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/** Data of the provided buffer selected for the completion. */
+static inline char *
+chat_uring_buf(const struct chat_uring *ring, const struct io_uring_cqe *cqe)
+{
+	uint32_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	return ring->bufs + (size_t)id * ring->buf_size;
+}
+
+/** Give the buffer of the completion back to the kernel. */
+void
+chat_uring_recycle(struct chat_uring *ring, const struct io_uring_cqe *cqe);
+
+/** Start a multishot receive into the provided buffers. */
+void
+chat_uring_prep_recv(struct chat_uring *ring, int fd, uint64_t user_data);
+
+/** Cancel all the operations with the @a user_data. */
+void
+chat_uring_prep_cancel(struct chat_uring *ring, uint64_t user_data);
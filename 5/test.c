@@ -4,9 +4,12 @@
 #include "chat_server.h"
 
 #include <arpa/inet.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 enum {
 	TEST_MSG_ID_LEN = 64,
@@ -333,6 +336,54 @@ test_multi_feed(void)
 	unit_test_finish();
 }
 
+static void
+test_framing(void)
+{
+	unit_test_start();
+
+	char text[256];
+	size_t size;
+	char *res;
+	/* Runs of spaces of different lengths. */
+	for (int left = 0; left < 40; ++left) {
+		for (int right = 0; right < 40; right += 3) {
+			int len = sprintf(text, "%*sa b%*s", left, "", right,
+					  "");
+			text[0] = left > 0 ? '\t' : text[0];
+			text[len - 1] = right > 0 ? '\r' : text[len - 1];
+			size = len;
+			res = chat_trim(text, &size);
+			unit_fail_if(size != 3 || memcmp(res, "a b", 3) != 0);
+		}
+	}
+	memset(text, ' ', 100);
+	size = 100;
+	chat_trim(text, &size);
+	unit_check(size == 0, "trim of only spaces");
+
+	struct chat_input in;
+	memset(&in, 0, sizeof(in));
+	const char *parts[] = {"  first\nsec", "ond\n", "", "\nthird  \n"};
+	const char *expected[] = {"  first", "second", "", "third  "};
+	int count = 0;
+	for (int i = 0; i < 4; ++i) {
+		chat_input_reserve(&in, 16);
+		memcpy(in.buf + in.size, parts[i], strlen(parts[i]));
+		in.size += strlen(parts[i]);
+		while ((res = chat_input_next(&in, &size)) != NULL) {
+			unit_fail_if(count >= 4);
+			unit_fail_if(size != strlen(expected[count]));
+			unit_fail_if(memcmp(res, expected[count], size) != 0);
+			++count;
+		}
+	}
+	unit_check(count == 4, "input is cut into messages");
+	unit_check(in.size == 0, "input buffer is reset when all is read");
+	chat_input_destroy(&in);
+
+	unit_test_finish();
+}
+
 static void
 test_multi_client(void)
 {
@@ -449,6 +500,760 @@ test_multi_client(void)
 	unit_test_finish();
 }
 
+static void
+test_many_clients(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	const int client_count = 1000;
+	struct chat_client **clis = malloc(client_count * sizeof(clis[0]));
+	for (int i = 0; i < client_count; ++i) {
+		char name[128];
+		sprintf(name, "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	server_consume_events(s);
+	unit_check(chat_server_get_events(s) == CHAT_EVENT_INPUT,
+		   "no output with idle clients");
+
+	/* A burst of messages goes to each peer with one send. */
+	const int msg_count = 10;
+	struct chat_server_stat stat;
+	chat_server_get_stat(s, &stat);
+	uint64_t syscall_count = stat.syscall_count;
+	char data[10 * msg_count];
+	for (int i = 0; i < msg_count; ++i)
+		memcpy(data + i * 10, "hello all\n", 10);
+	unit_fail_if(chat_client_feed(clis[0], data, sizeof(data)) != 0);
+	struct chat_message *msg;
+	for (int i = 0; i < msg_count; ++i) {
+		msg = server_pop_next_blocking_from(s, clis[0]);
+		unit_fail_if(strcmp(msg->data, "hello all") != 0);
+		chat_message_delete(msg);
+	}
+	chat_server_get_stat(s, &stat);
+	unit_check(stat.msg_count == (uint64_t)msg_count, "messages are counted");
+	unit_check(stat.syscall_count - syscall_count <
+		   (uint64_t)client_count * 2, "output is coalesced");
+	bool is_delivered = true;
+	for (int i = 1; i < client_count; ++i) {
+		for (int j = 0; j < msg_count; ++j) {
+			msg = client_pop_next_blocking(clis[i], s);
+			is_delivered = is_delivered &&
+				       strcmp(msg->data, "hello all") == 0;
+			chat_message_delete(msg);
+		}
+	}
+	unit_check(is_delivered, "all clients got the message");
+	unit_check(chat_server_get_events(s) == CHAT_EVENT_INPUT,
+		   "all output is sent");
+
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	free(clis);
+	server_consume_events(s);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_thread_count(s, 4) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_thread_count(s, 2) ==
+		   CHAT_ERR_ALREADY_STARTED, "thread count is fixed after listen");
+	uint16_t port = server_get_port(s);
+	const int client_count = 20;
+	const int msg_count = 100;
+	struct test_msg *test_msg = test_msg_new(100);
+	struct chat_client **clis = malloc(client_count * sizeof(clis[0]));
+	for (int i = 0; i < client_count; ++i) {
+		char name[128];
+		sprintf(name, "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	/*
+	 * A client is accepted when its message is seen. The later
+	 * messages reach all the clients.
+	 */
+	for (int i = 0; i < client_count; ++i) {
+		unit_fail_if(chat_client_feed(clis[i], "hello\n", 6) != 0);
+		struct chat_message *msg =
+			server_pop_next_blocking_from(s, clis[i]);
+		unit_fail_if(strcmp(msg->data, "hello") != 0);
+		chat_message_delete(msg);
+	}
+	unit_msg("Send messages");
+	for (int mi = 0; mi < msg_count; ++mi) {
+		for (int ci = 0; ci < client_count; ++ci) {
+			test_msg_set_id(test_msg, ci, mi);
+			unit_fail_if(chat_client_feed(
+				clis[ci], test_msg->data, test_msg->size) != 0);
+		}
+	}
+	unit_msg("Check all is delivered to the server");
+	test_msg_clear_id(test_msg);
+	int *msg_counts = calloc(client_count, sizeof(msg_counts[0]));
+	bool is_ordered = true;
+	for (int i = 0, end = msg_count * client_count; i < end; ++i) {
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) == NULL) {
+			for (int ci = 0; ci < client_count; ++ci)
+				chat_client_update(clis[ci], 0);
+			chat_server_update(s, 0);
+		}
+		int cli_id = -1;
+		int msg_id = -1;
+		chat_message_extract_id(msg, &cli_id, &msg_id);
+		unit_fail_if(cli_id >= client_count || cli_id < 0);
+		is_ordered = is_ordered && msg_counts[cli_id] == msg_id;
+		++msg_counts[cli_id];
+		test_msg_check_data(test_msg, msg->data);
+		chat_message_delete(msg);
+	}
+	unit_check(is_ordered, "server got each author's messages in order");
+	unit_msg("Check all is delivered to the clients");
+	for (int ci = 0; ci < client_count; ++ci) {
+		memset(msg_counts, 0, client_count * sizeof(msg_counts[0]));
+		struct chat_client *cli = clis[ci];
+		int total_msg_count = msg_count * (client_count - 1);
+		for (int mi = 0; mi < total_msg_count;) {
+			struct chat_message *msg =
+				client_pop_next_blocking(cli, s);
+			/*
+			 * A hello can be missed by a client not yet
+			 * accepted by its thread at that moment.
+			 */
+			if (strcmp(msg->data, "hello") == 0) {
+				chat_message_delete(msg);
+				continue;
+			}
+			++mi;
+			int cli_id = -1;
+			int msg_id = -1;
+			chat_message_extract_id(msg, &cli_id, &msg_id);
+			unit_fail_if(cli_id >= client_count || cli_id < 0);
+			is_ordered = is_ordered && msg_counts[cli_id] == msg_id;
+			++msg_counts[cli_id];
+			chat_message_delete(msg);
+		}
+		unit_fail_if(msg_counts[ci] != 0);
+	}
+	unit_check(is_ordered, "clients got each author's messages in order");
+
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	free(clis);
+	free(msg_counts);
+	chat_server_delete(s);
+	test_msg_delete(test_msg);
+
+	unit_test_finish();
+}
+
+/** A plain socket with a small receive buffer, to stop reading it. */
+static int
+raw_client_connect(uint16_t port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	unit_fail_if(sock < 0);
+	int size = 4096;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(connect(sock, (void *)&addr, sizeof(addr)) != 0);
+	return sock;
+}
+
+static size_t
+get_rss(void)
+{
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	unit_fail_if(f == NULL);
+	unit_fail_if(fscanf(f, "%*d %ld", &pages) != 1);
+	fclose(f);
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+static int
+server_pop_all(struct chat_server *s)
+{
+	int count = 0;
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL) {
+		++count;
+		chat_message_delete(msg);
+	}
+	return count;
+}
+
+static void
+test_slow_reader(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_output_limit(s, 1, 2,
+		CHAT_OVERFLOW_DROP_OLDEST) != CHAT_ERR_INVALID_ARGUMENT);
+	unit_fail_if(chat_server_set_output_limit(s, 64 * 1024, 32 * 1024,
+		CHAT_OVERFLOW_DROP_OLDEST) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	const int sender_count = 1000;
+	const int msg_count = 5;
+	int reader = raw_client_connect(port);
+	int *senders = malloc(sender_count * sizeof(senders[0]));
+	for (int i = 0; i < sender_count; ++i)
+		senders[i] = raw_client_connect(port);
+	server_consume_events(s);
+	size_t rss = get_rss();
+
+	unit_msg("Each sender sends %d KB to all", msg_count);
+	char msg[1024];
+	memset(msg, 'x', sizeof(msg));
+	msg[sizeof(msg) - 1] = '\n';
+	int received = 0;
+	for (int mi = 0; mi < msg_count; ++mi) {
+		for (int i = 0; i < sender_count; ++i) {
+			unit_fail_if(send(senders[i], msg, sizeof(msg), 0) !=
+				     sizeof(msg));
+		}
+		while (chat_server_update(s, 0) == 0)
+			received += server_pop_all(s);
+	}
+	while (received < sender_count * msg_count) {
+		unit_fail_if(chat_server_update(s, 1) != 0);
+		received += server_pop_all(s);
+	}
+	size_t rss_growth = get_rss() - rss;
+	unit_msg("RSS growth %zu KB", rss_growth / 1024);
+	struct chat_server_stat stat;
+	chat_server_get_stat(s, &stat);
+	unit_check(stat.dropped_msg_count > 0, "messages are dropped");
+	unit_check(stat.stalled_peer_count > 0, "peers are stalled");
+	unit_check(stat.disconnected_peer_count == 0, "nobody is disconnected");
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+	/*
+	 * Without a limit it is more than 50MB. The sanitizers have own
+	 * memory, so RSS says nothing then.
+	 */
+	unit_check(rss_growth < 16 * 1024 * 1024, "RSS is bounded");
+#endif
+
+	close(reader);
+	for (int i = 0; i < sender_count; ++i)
+		close(senders[i]);
+	free(senders);
+	server_consume_events(s);
+	chat_server_get_stat(s, &stat);
+	unit_check(stat.stalled_peer_count == 0, "closed peers are not stalled");
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_overflow_policies(void)
+{
+	unit_test_start();
+
+	const int msg_count = 4000;
+	char msg[1024];
+	memset(msg, 'x', sizeof(msg));
+	msg[sizeof(msg) - 1] = '\n';
+	struct chat_server_stat stat;
+
+	unit_msg("Disconnect");
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_output_limit(s, 16 * 1024, 8 * 1024,
+		CHAT_OVERFLOW_DISCONNECT) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	int reader = raw_client_connect(port);
+	struct chat_client *cli = chat_client_new("cli");
+	unit_fail_if(chat_client_connect(cli, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	for (int i = 0; i < msg_count; ++i)
+		unit_fail_if(chat_client_feed(cli, msg, sizeof(msg)) != 0);
+	int received = 0;
+	while (received < msg_count) {
+		chat_client_update(cli, 0);
+		chat_server_update(s, 0);
+		received += server_pop_all(s);
+	}
+	chat_server_get_stat(s, &stat);
+	unit_check(stat.disconnected_peer_count == 1, "reader is disconnected");
+	char buf[4096];
+	ssize_t rc;
+	while ((rc = recv(reader, buf, sizeof(buf), 0)) > 0)
+		;
+	unit_check(rc == 0, "reader got EOF");
+	close(reader);
+	chat_client_delete(cli);
+	chat_server_delete(s);
+
+	unit_msg("Stop reading");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_output_limit(s, 16 * 1024, 8 * 1024,
+		CHAT_OVERFLOW_STOP_READING) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	reader = raw_client_connect(port);
+	cli = chat_client_new("cli");
+	unit_fail_if(chat_client_connect(cli, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	for (int i = 0; i < msg_count; ++i)
+		unit_fail_if(chat_client_feed(cli, msg, sizeof(msg)) != 0);
+	received = 0;
+	bool have_events = true;
+	while (have_events) {
+		have_events = chat_client_update(cli, 0) == 0;
+		if (chat_server_update(s, 0) == 0)
+			have_events = true;
+		received += server_pop_all(s);
+	}
+	chat_server_get_stat(s, &stat);
+	unit_check(received < msg_count, "sender is not read");
+	unit_check(stat.stalled_peer_count == 1, "reader is stalled");
+	size_t total = 0;
+	while (received < msg_count || total < msg_count * sizeof(msg)) {
+		while ((rc = recv(reader, buf, sizeof(buf),
+				  MSG_DONTWAIT)) > 0)
+			total += rc;
+		chat_client_update(cli, 0);
+		chat_server_update(s, 0);
+		received += server_pop_all(s);
+	}
+	chat_server_get_stat(s, &stat);
+	unit_check(total == msg_count * sizeof(msg), "reader got all");
+	unit_check(stat.stalled_peer_count == 0, "reader is not stalled");
+	unit_check(stat.dropped_msg_count == 0, "nothing is dropped");
+	close(reader);
+	chat_client_delete(cli);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+/**
+ * Pop a message sent by another client, skipping the hellos, which
+ * can be seen or not.
+ */
+static struct chat_message *
+client_pop_next_from(struct chat_client *c, struct chat_client *from,
+		     struct chat_server *s)
+{
+	while (true) {
+		struct chat_message *msg;
+		while ((msg = chat_client_pop_next(c)) == NULL) {
+			chat_client_update(from, 0);
+			chat_client_update(c, 0);
+			chat_server_update(s, 0);
+		}
+		if (strcmp(msg->data, "hello") != 0)
+			return msg;
+		chat_message_delete(msg);
+	}
+}
+
+static void
+test_binary_protocol_run(int thread_count)
+{
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_thread_count(s, thread_count) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_set_protocol(c1, CHAT_PROTOCOL_BINARY) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_set_protocol(c2, CHAT_PROTOCOL_BINARY) != 0);
+	struct chat_client *c3 = chat_client_new("c3");
+	struct chat_client *clis[] = {c1, c2, c3};
+	/* A client is accepted when its hello is seen. */
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(chat_client_connect(clis[i],
+						 make_addr_str(port)) != 0);
+		unit_fail_if(chat_client_feed(clis[i], "hello\n", 6) != 0);
+		struct chat_message *msg =
+			server_pop_next_blocking_from(s, clis[i]);
+		unit_fail_if(strcmp(msg->data, "hello") != 0);
+		chat_message_delete(msg);
+	}
+	unit_check(chat_client_set_protocol(c3, CHAT_PROTOCOL_BINARY) ==
+		   CHAT_ERR_ALREADY_STARTED, "protocol is fixed after connect");
+
+	const char *data = " msg1 \nms";
+	unit_fail_if(chat_client_feed(c1, data, strlen(data)) != 0);
+	unit_fail_if(chat_client_feed(c1, "g2\n\n  \n", 7) != 0);
+	for (int i = 1; i < 3; ++i) {
+		struct chat_message *msg = client_pop_next_from(clis[i], c1, s);
+		unit_check(strcmp(msg->data, "msg1") == 0, "msg1 from binary");
+		unit_check(author_is_eq(msg, "c1"), "msg1 author");
+		chat_message_delete(msg);
+		msg = client_pop_next_from(clis[i], c1, s);
+		unit_check(strcmp(msg->data, "msg2") == 0, "msg2 from binary");
+		chat_message_delete(msg);
+	}
+	unit_fail_if(chat_client_feed(c3, "from text\n", 10) != 0);
+	for (int i = 0; i < 2; ++i) {
+		struct chat_message *msg = client_pop_next_from(clis[i], c3, s);
+		unit_check(strcmp(msg->data, "from text") == 0,
+			   "binary client got text msg");
+		chat_message_delete(msg);
+	}
+	struct test_msg *test_msg = test_msg_new(1024 * 1024);
+	int count = 10;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(chat_client_feed(c2, test_msg->data,
+					      test_msg->size) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		struct chat_message *msg = client_pop_next_from(c1, c2, s);
+		test_msg_check_data(test_msg, msg->data);
+		chat_message_delete(msg);
+		msg = client_pop_next_from(c3, c2, s);
+		test_msg_check_data(test_msg, msg->data);
+		chat_message_delete(msg);
+	}
+	unit_msg("big messages are delivered");
+	int popped = 0;
+	struct chat_message *msg;
+	while (popped < 2 + 1 + count) {
+		chat_server_update(s, 0);
+		if ((msg = chat_server_pop_next(s)) != NULL) {
+			++popped;
+			chat_message_delete(msg);
+		}
+	}
+	unit_check(chat_server_pop_next(s) == NULL, "server got all");
+
+	/* A hello of an unknown version is not accepted. */
+	int sock = raw_client_connect(port);
+	unit_fail_if(send(sock, "\0\x7f", 2, 0) != 2);
+	char buf[16];
+	ssize_t rc;
+	while ((rc = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) != 0)
+		chat_server_update(s, 0);
+	unit_check(rc == 0, "unknown version is rejected");
+	close(sock);
+
+	/* A frame too big to buffer is not waited for. */
+	sock = raw_client_connect(port);
+	unit_fail_if(send(sock, "\0\x01\x01" "a" "\xff\xff\xff\x7f", 8, 0) != 8);
+	while ((rc = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) != 0)
+		chat_server_update(s, 0);
+	unit_check(rc == 0, "too big frame is rejected");
+	close(sock);
+
+	test_msg_delete(test_msg);
+	for (int i = 0; i < 3; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+}
+
+static void
+test_binary_protocol(void)
+{
+	unit_test_start();
+
+	unit_msg("No threads");
+	test_binary_protocol_run(0);
+	unit_msg("Threads");
+	test_binary_protocol_run(2);
+
+	unit_msg("Drop oldest");
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_output_limit(s, 16 * 1024, 8 * 1024,
+		CHAT_OVERFLOW_DROP_OLDEST) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *reader = chat_client_new("reader");
+	unit_fail_if(chat_client_set_protocol(reader,
+					      CHAT_PROTOCOL_BINARY) != 0);
+	unit_fail_if(chat_client_connect(reader, make_addr_str(port)) != 0);
+	struct chat_client *cli = chat_client_new("cli");
+	unit_fail_if(chat_client_connect(cli, make_addr_str(port)) != 0);
+	client_consume_events(reader);
+	server_consume_events(s);
+	const int msg_count = 8000;
+	char msg[1024];
+	memset(msg, 'x', sizeof(msg));
+	msg[sizeof(msg) - 1] = '\n';
+	for (int i = 0; i < msg_count; ++i)
+		unit_fail_if(chat_client_feed(cli, msg, sizeof(msg)) != 0);
+	int received = 0;
+	while (received < msg_count) {
+		chat_client_update(cli, 0);
+		chat_server_update(s, 0);
+		received += server_pop_all(s);
+	}
+	/* The rest of the queue goes to the reader now. */
+	int delivered = 0;
+	bool is_valid = true;
+	bool have_events = true;
+	while (have_events) {
+		int rc = chat_client_update(reader, 0);
+		unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+		have_events = rc == 0;
+		if (chat_server_update(s, 0) == 0)
+			have_events = true;
+		struct chat_message *m;
+		while ((m = chat_client_pop_next(reader)) != NULL) {
+			is_valid = is_valid && strlen(m->data) == 1023 &&
+				   m->data[0] == 'x';
+			++delivered;
+			chat_message_delete(m);
+		}
+	}
+	struct chat_server_stat stat;
+	chat_server_get_stat(s, &stat);
+	unit_check(stat.dropped_msg_count > 0, "messages are dropped");
+	unit_check(delivered + stat.dropped_msg_count == (uint64_t)msg_count,
+		   "binary reader got the rest");
+	unit_check(is_valid, "the frames are valid");
+	chat_client_delete(reader);
+	chat_client_delete(cli);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+/**
+ * Wait for the descriptors of the server and the clients with poll(),
+ * and update the ones with events.
+ */
+static void
+poll_all(struct chat_server *s, struct chat_client **clis, int count)
+{
+	struct pollfd fds[8];
+	fds[0].fd = chat_server_get_descriptor(s);
+	fds[0].events = chat_events_to_poll_events(chat_server_get_events(s));
+	for (int i = 0; i < count; ++i) {
+		fds[i + 1].fd = chat_client_get_descriptor(clis[i]);
+		fds[i + 1].events = chat_events_to_poll_events(
+			chat_client_get_events(clis[i]));
+	}
+	unit_fail_if(poll(fds, count + 1, 5000) <= 0);
+	if (fds[0].revents != 0)
+		chat_server_update(s, 0);
+	for (int i = 0; i < count; ++i) {
+		if (fds[i + 1].revents != 0)
+			chat_client_update(clis[i], 0);
+	}
+}
+
+static void
+test_descriptors(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_get_descriptor(s) >= 0, "server descriptor");
+	uint16_t port = server_get_port(s);
+	struct chat_client *clis[2];
+	for (int i = 0; i < 2; ++i) {
+		clis[i] = chat_client_new("cli");
+		unit_fail_if(chat_client_connect(clis[i],
+						 make_addr_str(port)) != 0);
+	}
+	unit_check(chat_client_get_descriptor(clis[0]) >= 0,
+		   "client descriptor");
+	/* Nothing is updated until its descriptor has events. */
+	unit_fail_if(chat_client_feed(clis[0], "msg1\n", 5) != 0);
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) == NULL)
+		poll_all(s, clis, 2);
+	unit_check(strcmp(msg->data, "msg1") == 0, "server got msg");
+	chat_message_delete(msg);
+	while ((msg = chat_client_pop_next(clis[1])) == NULL)
+		poll_all(s, clis, 2);
+	unit_check(strcmp(msg->data, "msg1") == 0, "client got msg");
+	chat_message_delete(msg);
+	chat_client_delete(clis[0]);
+	chat_client_delete(clis[1]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+/**
+ * Send 10 messages of 1KB to a server with the history of @a size
+ * bytes, and return how many of them a late client gets. -1 if the
+ * last one is not the newest.
+ */
+static int
+test_history_replay_count(int thread_count, size_t size)
+{
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_thread_count(s, thread_count) != 0);
+	unit_fail_if(chat_server_set_history(s, 1000, size) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	char buf[1024];
+	memset(buf, 'x', sizeof(buf));
+	buf[sizeof(buf) - 1] = '\n';
+	for (int i = 0; i < 10; ++i) {
+		buf[0] = '0' + i;
+		unit_fail_if(chat_client_feed(c1, buf, sizeof(buf)) != 0);
+		chat_message_delete(server_pop_next_blocking_from(s, c1));
+	}
+	/* Let the other threads take the messages from their inboxes. */
+	if (thread_count > 0)
+		unit_fail_if(chat_server_update(s, 0.1) != CHAT_ERR_TIMEOUT);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	client_consume_events(c2);
+	server_consume_events(s);
+	unit_fail_if(chat_client_feed(c1, "end\n", 4) != 0);
+	int count = 0;
+	char last = 0;
+	struct chat_message *msg;
+	while ((msg = client_pop_next_from(c2, c1, s)) != NULL &&
+	       strcmp(msg->data, "end") != 0) {
+		last = msg->data[0];
+		++count;
+		chat_message_delete(msg);
+	}
+	chat_message_delete(msg);
+	chat_client_delete(c2);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+	return last == '9' ? count : -1;
+}
+
+static void
+test_history(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_history(s, 3, 1024 * 1024) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_history(s, 0, 0) ==
+		   CHAT_ERR_ALREADY_STARTED, "history is fixed after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	const char *data = "msg1\nmsg2\nmsg3\nmsg4\n";
+	unit_fail_if(chat_client_feed(c1, data, strlen(data)) != 0);
+	for (int i = 0; i < 4; ++i)
+		chat_message_delete(server_pop_next_blocking_from(s, c1));
+	/* The late one gets the last 3, then the new ones. */
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	bool is_ok = true;
+	for (int i = 2; i <= 4; ++i) {
+		struct chat_message *msg = client_pop_next_blocking(c2, s);
+		char expected[16];
+		sprintf(expected, "msg%d", i);
+		is_ok = is_ok && strcmp(msg->data, expected) == 0 &&
+			author_is_eq(msg, "c1");
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "late client got the history");
+	unit_fail_if(chat_client_feed(c1, "msg5\n", 5) != 0);
+	struct chat_message *msg = client_pop_next_from(c2, c1, s);
+	unit_check(strcmp(msg->data, "msg5") == 0, "then the new msg");
+	chat_message_delete(msg);
+	chat_client_delete(c2);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	/* 10 messages of 1KB do not fit into 4KB. */
+	int count = test_history_replay_count(0, 4096);
+	unit_check(count > 0 && count < 10, "history is limited by size");
+	/* The threads split the size, each keeps a copy of the history. */
+	int split_count = test_history_replay_count(2, 4096);
+	unit_check(split_count > 0 && split_count < count,
+		   "history size is split between the threads");
+
+	/*
+	 * A slow late reader is still replaying when more new messages
+	 * come than the history keeps. The new ones are not lost, only
+	 * the history can be forgotten before the reader gets it.
+	 */
+	s = chat_server_new();
+	const int history_count = 20;
+	const int live_count = 40;
+	unit_fail_if(chat_server_set_history(s, history_count,
+					     64 * 1024 * 1024) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct test_msg *big = test_msg_new(256 * 1024);
+	int sock = -1;
+	for (int i = 0; i < history_count + live_count; ++i) {
+		/* The reader does not read until all is sent. */
+		if (i == history_count) {
+			sock = raw_client_connect(port);
+			server_consume_events(s);
+		}
+		big->data[0] = 'A' + i;
+		unit_fail_if(chat_client_feed(c1, big->data, big->size) != 0);
+		chat_message_delete(server_pop_next_blocking_from(s, c1));
+	}
+	int total = history_count + live_count;
+	int received = 0;
+	int live_received = 0;
+	int last_id = -1;
+	bool is_line_start = true;
+	bool is_ordered = true;
+	while (last_id < total - 1) {
+		char rbuf[64 * 1024];
+		ssize_t rc = recv(sock, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+		if (rc == 0)
+			break;
+		/* Nothing to read and nothing to send, all is got. */
+		if (rc < 0 && chat_server_update(s, 0.1) == CHAT_ERR_TIMEOUT)
+			break;
+		if (rc < 0)
+			continue;
+		for (ssize_t i = 0; i < rc; ++i) {
+			if (is_line_start) {
+				int id = rbuf[i] - 'A';
+				is_ordered = is_ordered && id > last_id;
+				last_id = id;
+				++received;
+				if (id >= history_count)
+					++live_received;
+			}
+			is_line_start = rbuf[i] == '\n';
+		}
+	}
+	struct chat_server_stat stat;
+	chat_server_get_stat(s, &stat);
+	unit_check(is_ordered && live_received == live_count,
+		   "slow late reader got all the new msgs in order");
+	unit_check(received + stat.dropped_msg_count == (uint64_t)total,
+		   "forgotten history is counted as dropped");
+	close(sock);
+	test_msg_delete(big);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
 struct test_stress_ctx {
 	int msg_count;
 	uint32_t msg_len;
@@ -489,6 +1294,8 @@ test_stress(void)
 	unit_test_start();
 
 	struct chat_server *s = chat_server_new();
+	/* The bursts of the broadcast are sent corked. */
+	unit_fail_if(chat_server_set_cork(s, true) != 0);
 	unit_fail_if(chat_server_listen(s, 0) != 0);
 
 	const int client_count = 10;
@@ -696,7 +1503,15 @@ main(int argc, char **argv)
 	test_basic();
 	test_big_messages();
 	test_multi_feed();
+	test_framing();
 	test_multi_client();
+	test_many_clients();
+	test_threads();
+	test_slow_reader();
+	test_overflow_policies();
+	test_binary_protocol();
+	test_descriptors();
+	test_history();
 	test_stress();
 	test_big_author();
 	test_server_feed();